@@ -0,0 +1,125 @@
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    hint::black_box,
+    sync::atomic::{AtomicUsize, Ordering},
+    time::Instant,
+};
+
+use chariot::config::{lexer, parser};
+
+mod report;
+
+// Counts allocations so the parse benchmark can report them next to the throughput
+struct CountingAlloc;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+static ALLOCATED_BYTES: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        ALLOCATED_BYTES.fetch_add(layout.size(), Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        ALLOCATED_BYTES.fetch_add(new_size, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAlloc = CountingAlloc;
+
+// Generates a config of `recipes` package recipes whose scripts are full of redirections, heredocs and comparisons
+fn generate_config(recipes: usize, script_lines: usize) -> String {
+    let mut config = String::from("@option \"buildtype\" = [ \"release\", \"debug\" ]\n@env \"CFLAGS\" = \"-O2\"\n\n");
+    for i in 0..recipes {
+        config.push_str(&format!(
+            "source/pkg{} {{\n    url: \"https://example.org/pkg{}.tar.gz\"\n    type: \"tar.gz\"\n    b2sum: \"{:0128x}\"\n}}\n\n",
+            i, i, i
+        ));
+        config.push_str(&format!(
+            "// package number {}\npackage/pkg{} {{\n    options: [ \"buildtype\" ]\n    dependencies: [ source/pkg{}, *tool/gcc, image/python3",
+            i, i, i
+        ));
+        if i > 0 {
+            config.push_str(&format!(", package/pkg{}", i - 1));
+        }
+        config.push_str(" ]\n    build: <sh>\n");
+        for line in 0..script_lines {
+            config.push_str(&format!("        if [ $((i + {})) -lt 10 ]; then cat <<EOF > out{}.txt 2>&1 < /dev/null\n", line, line));
+        }
+        config.push_str("    </sh>\n    install: <sh> make DESTDIR=\"$INSTALL_DIR\" install </sh>\n}\n\n");
+    }
+    config
+}
+
+fn bench_lex(report: &mut report::Report, name: &str, input: &str, iterations: usize) {
+    let mut tokens = 0;
+    let start = Instant::now();
+    for _ in 0..iterations {
+        tokens = black_box(lexer::lex(black_box(input)).expect("lex failed")).len();
+    }
+    let elapsed = start.elapsed() / iterations as u32;
+
+    println!(
+        "{:<40} {:>10} bytes {:>9} tokens {:>12.3?}/iter {:>10.1} MiB/s",
+        name,
+        input.len(),
+        tokens,
+        elapsed,
+        input.len() as f64 / elapsed.as_secs_f64() / (1024.0 * 1024.0)
+    );
+    report.record(name, elapsed);
+}
+
+fn bench_parse(report: &mut report::Report, name: &str, input: &str, recipes: usize, iterations: usize) {
+    let mut elapsed = std::time::Duration::ZERO;
+    let mut allocations = 0;
+    let mut allocated_bytes = 0;
+    for _ in 0..iterations {
+        let mut tokens = lexer::lex(input).expect("lex failed");
+
+        let start_allocations = ALLOCATIONS.load(Ordering::Relaxed);
+        let start_bytes = ALLOCATED_BYTES.load(Ordering::Relaxed);
+        let start = Instant::now();
+        black_box(parser::parse_config(black_box(&mut tokens)).expect("parse failed"));
+        elapsed += start.elapsed();
+        allocations = ALLOCATIONS.load(Ordering::Relaxed) - start_allocations;
+        allocated_bytes = ALLOCATED_BYTES.load(Ordering::Relaxed) - start_bytes;
+    }
+    let elapsed = elapsed / iterations as u32;
+
+    println!(
+        "{:<40} {:>10} bytes {:>12.3?}/iter {:>10.1} MiB/s {:>8.1} allocs/recipe {:>10.1} bytes/recipe",
+        name,
+        input.len(),
+        elapsed,
+        input.len() as f64 / elapsed.as_secs_f64() / (1024.0 * 1024.0),
+        allocations as f64 / recipes as f64,
+        allocated_bytes as f64 / recipes as f64
+    );
+    report.record(name, elapsed);
+}
+
+fn main() {
+    let mut report = report::Report::new("config");
+
+    for (recipes, script_lines, iterations) in [(100, 10, 100), (1000, 10, 10), (10000, 10, 3), (100, 1000, 10), (10, 100000, 3)] {
+        let config = generate_config(recipes, script_lines);
+        bench_lex(&mut report, &format!("lex {} recipes x {} script lines", recipes, script_lines), &config, iterations);
+    }
+
+    for (recipes, iterations) in [(100, 100), (1000, 10), (10000, 3)] {
+        let config = generate_config(recipes, 10);
+        bench_parse(&mut report, &format!("parse {} recipes", recipes), &config, recipes, iterations);
+    }
+
+    report.save();
+}
@@ -0,0 +1,36 @@
+use std::{env, hint::black_box, time::Instant};
+
+use chariot::runtime::{OutputConfig, RuntimeConfig};
+
+mod report;
+
+// Spawning a container needs user namespaces and a rootfs, point `CHARIOT_BENCH_ROOTFS` at one (eg. `.chariot-cache/rootfs/<version>`)
+fn main() {
+    let rootfs = match env::var("CHARIOT_BENCH_ROOTFS") {
+        Ok(rootfs) => rootfs,
+        Err(_) => {
+            println!("CHARIOT_BENCH_ROOTFS is not set, skipping container benchmarks");
+            return;
+        }
+    };
+
+    let mut report = report::Report::new("container");
+
+    for (name, output_pipe, iterations) in [("spawn true", false, 50), ("spawn true with output pipe", true, 50)] {
+        let mut runtime_config = RuntimeConfig::new(&rootfs);
+        if output_pipe {
+            runtime_config = runtime_config.set_output_config(OutputConfig { quiet: true, log_path: None });
+        }
+
+        let start = Instant::now();
+        for _ in 0..iterations {
+            black_box(runtime_config.run(vec![String::from("true")]).expect("container run failed"));
+        }
+        let elapsed = start.elapsed() / iterations as u32;
+
+        println!("{:<40} {:>12.3?}/run", name, elapsed);
+        report.record(name, elapsed);
+    }
+
+    report.save();
+}
@@ -0,0 +1,189 @@
+use std::{
+    env::{self, temp_dir},
+    fs::{copy, create_dir_all, read_to_string, remove_dir_all, write},
+    os::unix::fs::symlink,
+    path::{Path, PathBuf},
+    process::{self, Command},
+    time::{Duration, Instant},
+};
+
+mod report;
+
+const CHARIOT: &str = env!("CARGO_BIN_EXE_chariot");
+
+// Everything the generated scripts need, copied from the host together with the shared libraries they link against
+const ROOTFS_PROGRAMS: &[&str] = &["bash", "sh", "cat", "cp", "echo", "mkdir", "true"];
+
+// Shape of the generated recipe graph, every value can be overridden through `CHARIOT_E2E_<NAME>`
+struct Shape {
+    recipes: usize,
+    depth: usize,
+    fan_in: usize,
+    options: usize,
+    source_kib: usize,
+}
+
+fn shape_value(name: &str, default: usize) -> usize {
+    match env::var(format!("CHARIOT_E2E_{}", name)) {
+        Err(_) => default,
+        Ok(value) => value.parse().unwrap_or_else(|_| panic!("CHARIOT_E2E_{} is not a number", name)),
+    }
+}
+
+// Builds a minimal rootfs from host binaries and packs it the way the release archives are packed, a single top level directory compressed with zstd
+fn build_rootfs(dir: &Path) -> PathBuf {
+    let tree = dir.join("rootfs-tree");
+    let root = tree.join("rootfs");
+    for subdir in ["usr/bin", "etc", "dev", "proc", "run", "tmp", "root", "home"] {
+        create_dir_all(root.join(subdir)).expect("failed to create rootfs dir");
+    }
+    symlink("usr/bin", root.join("bin")).expect("failed to link rootfs bin");
+    write(root.join("etc/resolv.conf"), "").expect("failed to write resolv.conf");
+
+    for program in ROOTFS_PROGRAMS {
+        let path = which::which(program).unwrap_or_else(|_| panic!("host is missing `{}`", program));
+        copy(&path, root.join("usr/bin").join(program)).expect("failed to copy program");
+
+        let ldd = Command::new("ldd").arg(&path).output().expect("failed to run ldd");
+        for line in String::from_utf8_lossy(&ldd.stdout).lines() {
+            let library = match line.split_once("=>") {
+                Some((_, library)) => library.trim().split(' ').next().unwrap_or(""),
+                None => line.trim().split(' ').next().unwrap_or(""),
+            };
+            if !library.starts_with('/') {
+                continue;
+            }
+
+            let dest = root.join(library.trim_start_matches('/'));
+            create_dir_all(dest.parent().unwrap()).expect("failed to create library dir");
+            copy(library, &dest).expect("failed to copy library");
+        }
+    }
+
+    let archive = dir.join("rootfs.tar.zst");
+    let status = Command::new("bsdtar")
+        .args(["-c", "--zstd", "-f", archive.to_str().unwrap(), "-C", tree.to_str().unwrap(), "rootfs"])
+        .status()
+        .expect("failed to run bsdtar");
+    assert!(status.success(), "failed to pack rootfs");
+    archive
+}
+
+// Packages are laid out in `depth` layers, each depending on `fan_in` packages of the layer below and on its own local source.
+// A custom recipe without scripts depends on every package so a single target covers the whole graph.
+fn generate_config(dir: &Path, shape: &Shape) {
+    let width = shape.recipes.div_ceil(shape.depth);
+    let mut config = String::new();
+    for option in 0..shape.options {
+        config.push_str(&format!("@option \"opt{}\" = [ \"a\", \"b\" ]\n", option));
+    }
+
+    let mut all = Vec::new();
+    for i in 0..shape.recipes {
+        // Sources grow in steps so copies and change detection see a mix of sizes
+        let source_dir = dir.join("sources").join(format!("src{}", i));
+        create_dir_all(&source_dir).expect("failed to create source dir");
+        let file_size = shape.source_kib * 1024 * (1 + i % 4) / 4;
+        for file in 0..4 {
+            write(source_dir.join(format!("file{}.c", file)), vec![b'x'; file_size]).expect("failed to write source file");
+        }
+        config.push_str(&format!("source/src{} {{\n    type: \"local\"\n    url: \"sources/src{}\"\n}}\n\n", i, i));
+
+        let layer = i / width;
+        let mut dependencies = vec![format!("source/src{}", i)];
+        if layer > 0 {
+            for dep in 0..shape.fan_in {
+                let dep = format!("package/pkg{}", (layer - 1) * width + (i * 7 + dep * 13) % width);
+                if !dependencies.contains(&dep) {
+                    dependencies.push(dep);
+                }
+            }
+        }
+
+        let option = i % shape.options.max(1);
+        let options = if shape.options > 0 { format!("    options: [ \"opt{}\" ]\n", option) } else { String::new() };
+        config.push_str(&format!(
+            "package/pkg{} {{\n{}    dependencies: [ {} ]\n    build: <sh> echo \"$OPTION_opt{}\" > option </sh>\n    install: <sh> mkdir -p \"$INSTALL_DIR$PREFIX/share/pkg{}\" && cp option \"$INSTALL_DIR$PREFIX/share/pkg{}/\" </sh>\n}}\n\n",
+            i,
+            options,
+            dependencies.join(", "),
+            option,
+            i,
+            i
+        ));
+        all.push(format!("package/pkg{}", i));
+    }
+    config.push_str(&format!("custom/all {{\n    dependencies: [ {} ]\n}}\n", all.join(", ")));
+
+    write(dir.join("config.chariot"), config).expect("failed to write config");
+}
+
+// Runs chariot and returns the wall time together with the number of recipes it built, taken from its event stream
+fn run_chariot(dir: &Path, rootfs: &Path, args: &[&str]) -> (Duration, usize) {
+    let events_path = dir.join("events.jsonl");
+    let start = Instant::now();
+    let output = Command::new(CHARIOT)
+        .arg("--config")
+        .arg(dir.join("config.chariot"))
+        .arg("--cache")
+        .arg(dir.join("cache"))
+        .arg("--rootfs-archive")
+        .arg(rootfs)
+        .arg("--events")
+        .arg(&events_path)
+        .args(args)
+        .output()
+        .expect("failed to run chariot");
+    let elapsed = start.elapsed();
+
+    if !output.status.success() {
+        panic!("chariot {:?} failed:\n{}", args, String::from_utf8_lossy(&output.stderr));
+    }
+
+    let events = read_to_string(&events_path).expect("failed to read events");
+    (elapsed, events.lines().filter(|line| line.contains("\"event\":\"recipe_finished\"")).count())
+}
+
+fn main() {
+    let shape = Shape {
+        recipes: shape_value("RECIPES", 200),
+        depth: shape_value("DEPTH", 10).max(1),
+        fan_in: shape_value("FAN_IN", 3),
+        options: shape_value("OPTIONS", 4),
+        source_kib: shape_value("SOURCE_KIB", 64),
+    };
+
+    let dir = temp_dir().join(format!("chariot-e2e-{}", process::id()));
+    create_dir_all(&dir).expect("failed to create bench dir");
+
+    let rootfs = build_rootfs(&dir);
+    generate_config(&dir, &shape);
+
+    let mut report = report::Report::new("e2e");
+    let label = format!("{} recipes depth {} fan-in {}", shape.recipes, shape.depth, shape.fan_in);
+
+    // Targets are always rebuilt, so even a null build builds the scriptless `custom/all`
+    let mut scenarios: Vec<(&str, Vec<&str>, Option<usize>)> = vec![
+        ("rootfs init", vec!["build"], None),
+        ("cold build", vec!["build", "custom/all"], None),
+        ("null build", vec!["build", "custom/all"], None),
+        ("leaf change rebuild", vec!["build", "custom/all"], Some(0)),
+    ];
+    if shape.options > 0 {
+        scenarios.push(("option switch", vec!["-o", "opt0=b", "build", "custom/all"], None));
+        scenarios.push(("option switch back", vec!["-o", "opt0=a", "build", "custom/all"], None));
+    }
+
+    for (name, args, changed_source) in scenarios {
+        if let Some(source) = changed_source {
+            write(dir.join("sources").join(format!("src{}", source)).join("changed.c"), name).expect("failed to change source");
+        }
+
+        let (elapsed, built) = run_chariot(&dir, &rootfs, &args);
+        println!("{:<24} {:>12.3?} {:>6} recipe(s) built ({})", name, elapsed, built, label);
+        report.record(format!("{} {}", name, label), elapsed);
+    }
+
+    remove_dir_all(&dir).expect("failed to remove bench dir");
+    report.save();
+}
@@ -0,0 +1,110 @@
+use std::{
+    env::temp_dir,
+    fs::{create_dir_all, write},
+    hint::black_box,
+    os::unix::fs::symlink,
+    path::Path,
+    process,
+    time::{Duration, Instant},
+};
+
+use chariot::util;
+
+mod report;
+
+// Generates `dirs` directories of `files` files of `file_size` bytes, every directory also gets a nested directory and a symlink like an install tree would
+fn generate_tree(root: &Path, dirs: usize, files: usize, file_size: usize) -> usize {
+    let data = vec![b'x'; file_size];
+    for dir in 0..dirs {
+        let dir_path = root.join(format!("dir{}", dir)).join("lib");
+        create_dir_all(&dir_path).expect("failed to create tree dir");
+        for file in 0..files {
+            write(dir_path.join(format!("file{}.so", file)), &data).expect("failed to write tree file");
+        }
+        symlink("file0.so", dir_path.join("link.so")).expect("failed to create tree symlink");
+    }
+    dirs * (files + 1)
+}
+
+// Copies and hardlinks go into an existing, empty directory
+fn reset(target: &Path) {
+    util::force_rm(target).expect("force_rm failed");
+    create_dir_all(target).expect("failed to create target dir");
+}
+
+fn bench(report: &mut report::Report, name: &str, entries: usize, iterations: usize, mut setup: impl FnMut(), mut run: impl FnMut()) {
+    let mut elapsed = Duration::ZERO;
+    for _ in 0..iterations {
+        setup();
+        let start = Instant::now();
+        run();
+        elapsed += start.elapsed();
+    }
+    let elapsed = elapsed / iterations as u32;
+
+    println!("{:<40} {:>8} entries {:>12.3?}/iter {:>10.3?}/entry", name, entries, elapsed, elapsed / entries as u32);
+    report.record(name, elapsed);
+}
+
+fn main() {
+    let dir = temp_dir().join(format!("chariot-bench-{}", process::id()));
+    let mut report = report::Report::new("fs");
+
+    for (dirs, files, file_size, iterations) in [(10, 100, 4096, 10), (100, 100, 1024, 3), (10, 10, 4 * 1024 * 1024, 3)] {
+        let label = format!("{}x{}x{}", dirs, files, file_size);
+        let tree = dir.join(format!("tree-{}", label));
+        let target = dir.join(format!("target-{}", label));
+        let entries = generate_tree(&tree, dirs, files, file_size);
+
+        bench(
+            &mut report,
+            &format!("recursive_copy {}", label),
+            entries,
+            iterations,
+            || reset(&target),
+            || util::recursive_copy(&tree, &target).expect("recursive_copy failed"),
+        );
+        bench(
+            &mut report,
+            &format!("recursive_hardlink {}", label),
+            entries,
+            iterations,
+            || reset(&target),
+            || util::recursive_hardlink(&tree, &target).expect("recursive_hardlink failed"),
+        );
+        bench(
+            &mut report,
+            &format!("force_rm {}", label),
+            entries,
+            iterations,
+            || {
+                reset(&target);
+                util::recursive_copy(&tree, &target).expect("recursive_copy failed");
+            },
+            || util::force_rm(&target).expect("force_rm failed"),
+        );
+        bench(
+            &mut report,
+            &format!("dir_size {}", label),
+            entries,
+            iterations,
+            || {},
+            || {
+                black_box(util::dir_size(&tree).expect("dir_size failed"));
+            },
+        );
+        bench(
+            &mut report,
+            &format!("dir_changed_at {}", label),
+            entries,
+            iterations,
+            || {},
+            || {
+                black_box(util::dir_changed_at(&tree).expect("dir_changed_at failed"));
+            },
+        );
+    }
+
+    util::force_rm(&dir).expect("failed to remove bench dir");
+    report.save();
+}
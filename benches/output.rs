@@ -0,0 +1,67 @@
+use std::{
+    hint::black_box,
+    io::{sink, Write},
+    time::Instant,
+};
+
+use chariot::runtime::OutputPump;
+
+mod report;
+
+// Container output is read from the pipe in chunks of this size
+const CHUNK_SIZE: usize = 1024;
+
+// Generates build log like output, compiler lines of varying length with the occasional long warning
+fn generate_output(bytes: usize) -> Vec<u8> {
+    let mut output = Vec::with_capacity(bytes + 512);
+    let mut line = 0;
+    while output.len() < bytes {
+        match line % 50 {
+            0 => writeln!(
+                output,
+                "src/file{}.c:{}:5: warning: implicit conversion changes signedness: 'int' to 'unsigned long' [-Wsign-conversion]",
+                line, line
+            ),
+            _ => writeln!(output, "  CC       src/file{}.o", line),
+        }
+        .unwrap();
+        line += 1;
+    }
+    output
+}
+
+fn bench_pump<W: Write>(report: &mut report::Report, name: &str, output: &[u8], iterations: usize, mut out: impl FnMut() -> W) {
+    let start = Instant::now();
+    for _ in 0..iterations {
+        let mut out = out();
+        let mut pump = OutputPump::new();
+        for chunk in output.chunks(CHUNK_SIZE) {
+            pump.pump(black_box(chunk), &mut out).expect("pump failed");
+        }
+        black_box(out);
+    }
+    let elapsed = start.elapsed() / iterations as u32;
+
+    println!(
+        "{:<40} {:>10} bytes {:>12.3?}/iter {:>10.1} MiB/s",
+        name,
+        output.len(),
+        elapsed,
+        output.len() as f64 / elapsed.as_secs_f64() / (1024.0 * 1024.0)
+    );
+    report.record(name, elapsed);
+}
+
+fn main() {
+    let mut report = report::Report::new("output");
+
+    for (bytes, iterations) in [(1024 * 1024, 20), (64 * 1024 * 1024, 3)] {
+        let output = generate_output(bytes);
+
+        // Quiet runs buffer the output in memory, verbose runs write it through to stdout
+        bench_pump(&mut report, &format!("pump {} MiB to buffer", bytes / (1024 * 1024)), &output, iterations, Vec::new);
+        bench_pump(&mut report, &format!("pump {} MiB to sink", bytes / (1024 * 1024)), &output, iterations, sink);
+    }
+
+    report.save();
+}
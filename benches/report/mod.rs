@@ -0,0 +1,67 @@
+use std::{
+    collections::BTreeMap,
+    env,
+    fs::{create_dir_all, read_to_string, write},
+    path::PathBuf,
+    time::Duration,
+};
+
+// Benchmark results are stored as `<results>/<label>/<bench>.json` so runs of different releases can be compared.
+// The results directory defaults to `target/bench-results` (`CHARIOT_BENCH_RESULTS`), the label to the crate version (`CHARIOT_BENCH_LABEL`).
+// With `CHARIOT_BENCH_BASELINE=<label>` every result is also printed next to the one stored under that label.
+pub struct Report {
+    bench: &'static str,
+    results: BTreeMap<String, f64>,
+}
+
+impl Report {
+    pub fn new(bench: &'static str) -> Report {
+        Report { bench, results: BTreeMap::new() }
+    }
+
+    // Results are times per iteration, lower is better
+    pub fn record(&mut self, name: impl Into<String>, elapsed: Duration) {
+        self.results.insert(name.into(), elapsed.as_nanos() as f64);
+    }
+
+    pub fn save(self) {
+        let results_dir = match env::var("CHARIOT_BENCH_RESULTS") {
+            Ok(dir) => PathBuf::from(dir),
+            Err(_) => PathBuf::from(env!("CARGO_MANIFEST_DIR")).join("target").join("bench-results"),
+        };
+        let label = env::var("CHARIOT_BENCH_LABEL").unwrap_or(String::from(env!("CARGO_PKG_VERSION")));
+
+        let path = results_dir.join(&label).join(format!("{}.json", self.bench));
+        create_dir_all(path.parent().unwrap()).expect("failed to create results dir");
+        write(&path, serde_json::to_string_pretty(&self.results).expect("failed to serialize results")).expect("failed to write results");
+        println!("results stored in {}", path.to_string_lossy());
+
+        let baseline = match env::var("CHARIOT_BENCH_BASELINE") {
+            Ok(baseline) => baseline,
+            Err(_) => return,
+        };
+
+        let baseline_path = results_dir.join(&baseline).join(format!("{}.json", self.bench));
+        let baseline_results: BTreeMap<String, f64> = match read_to_string(&baseline_path) {
+            Err(_) => {
+                println!("no baseline results in {}", baseline_path.to_string_lossy());
+                return;
+            }
+            Ok(data) => serde_json::from_str(&data).expect("failed to parse baseline results"),
+        };
+
+        println!("compared to `{}`:", baseline);
+        for (name, nanos) in &self.results {
+            match baseline_results.get(name) {
+                None => println!("{:<60} {:>12.3?} (new)", name, Duration::from_nanos(*nanos as u64)),
+                Some(baseline_nanos) => println!(
+                    "{:<60} {:>12.3?} -> {:>12.3?} {:>+8.1}%",
+                    name,
+                    Duration::from_nanos(*baseline_nanos as u64),
+                    Duration::from_nanos(*nanos as u64),
+                    (nanos / baseline_nanos - 1.0) * 100.0
+                ),
+            }
+        }
+    }
+}
@@ -0,0 +1,101 @@
+use std::{collections::HashMap, env::temp_dir, fs::write, hint::black_box, process, time::Instant};
+
+use chariot::config;
+
+mod report;
+
+// Generates a config of `recipes` packages, each depending on a handful of earlier packages, tools, and nested collections
+fn generate_config(recipes: usize) -> String {
+    let mut config = String::new();
+    for option in 0..16 {
+        config.push_str(&format!("@option \"opt{}\" = [ \"a\", \"b\" ]\n", option));
+    }
+
+    for tool in 0..32 {
+        config.push_str(&format!("tool/tool{} {{\n    options: [ \"opt{}\" ]\n    build: <sh> make </sh>\n}}\n\n", tool, tool % 16));
+    }
+
+    config.push_str("@collection base = [ tool/tool0, tool/tool1, image/python3 ]\n");
+    for collection in 1..16 {
+        config.push_str(&format!(
+            "@collection col{} = [ collection/base, tool/tool{}, *tool/tool{} ]\n",
+            collection,
+            collection + 1,
+            collection + 16
+        ));
+    }
+
+    for i in 0..recipes {
+        config.push_str(&format!(
+            "source/pkg{} {{\n    url: \"https://example.org/pkg{}.tar.gz\"\n    type: \"tar.gz\"\n    b2sum: \"{:0128x}\"\n}}\n\n",
+            i, i, i
+        ));
+        config.push_str(&format!(
+            "package/pkg{} {{\n    options: [ \"opt{}\" ]\n    dependencies: [ source/pkg{}, collection/col{}",
+            i,
+            i % 16,
+            i,
+            i % 15 + 1
+        ));
+        for dep in [1, 2, 7, 31] {
+            if i >= dep {
+                config.push_str(&format!(", *package/pkg{}", i - dep));
+            }
+        }
+        config.push_str(" ]\n    build: <sh> make -j$THREADS </sh>\n    install: <sh> make DESTDIR=\"$INSTALL_DIR\" install </sh>\n}\n\n");
+    }
+    config
+}
+
+fn main() {
+    let dir = temp_dir().join(format!("chariot-bench-{}", process::id()));
+    std::fs::create_dir_all(&dir).expect("failed to create bench dir");
+
+    let mut report = report::Report::new("resolve");
+
+    for (recipes, iterations) in [(1000, 10), (2500, 5), (5000, 3), (10000, 3)] {
+        let path = dir.join(format!("config-{}.chariot", recipes));
+        write(&path, generate_config(recipes)).expect("failed to write config");
+
+        let start = Instant::now();
+        for _ in 0..iterations {
+            black_box(config::Config::parse(&path, HashMap::new(), None).expect("parse failed"));
+        }
+        let elapsed = start.elapsed() / iterations as u32;
+
+        println!("parse and resolve {:>6} recipes {:>12.3?}/iter {:>10.3?}/recipe", recipes * 2, elapsed, elapsed / (recipes * 2) as u32);
+        report.record(format!("parse and resolve {} recipes", recipes * 2), elapsed);
+
+        // A single target early in the chain only reaches a handful of recipes
+        let scope = [String::from("package/pkg40")];
+        let start = Instant::now();
+        for _ in 0..iterations {
+            black_box(config::Config::parse(&path, HashMap::new(), Some(&scope)).expect("parse failed"));
+        }
+        let elapsed = start.elapsed() / iterations as u32;
+
+        println!("parse and resolve {:>6} recipes {:>12.3?}/iter (scoped to `{}`)", recipes * 2, elapsed, scope[0]);
+        report.record(format!("parse and resolve {} recipes scoped", recipes * 2), elapsed);
+
+        // The hash of every recipe is checked on each build, local sources aside this is all `hash_recipe` does
+        let (config, _) = config::Config::parse(&path, HashMap::new(), None).expect("parse failed");
+        let start = Instant::now();
+        for _ in 0..iterations {
+            for recipe in &config.recipes {
+                black_box(config.recipe_hasher(recipe.id).expect("hash failed").finalize());
+            }
+        }
+        let elapsed = start.elapsed() / iterations as u32;
+
+        println!(
+            "hash              {:>6} recipes {:>12.3?}/iter {:>10.3?}/recipe",
+            config.recipes.len(),
+            elapsed,
+            elapsed / config.recipes.len() as u32
+        );
+        report.record(format!("hash {} recipes", config.recipes.len()), elapsed);
+    }
+
+    std::fs::remove_dir_all(&dir).expect("failed to remove bench dir");
+    report.save();
+}
@@ -0,0 +1,209 @@
+use std::{
+    collections::{BTreeMap, BTreeSet},
+    ffi::OsString,
+    fs::{read_dir, read_to_string, symlink_metadata},
+    os::fd::AsFd,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex,
+    },
+    thread::{self, JoinHandle},
+};
+
+use anyhow::{Context, Result};
+use nix::{
+    errno::Errno,
+    poll::{poll, PollFd, PollFlags},
+    sys::inotify::{AddWatchFlags, InitFlags, Inotify, WatchDescriptor},
+};
+
+// Records which dependency files containers open, through inotify watches on the host directories that get mounted into them.
+// Inotify reports opens on the inode no matter which mount they went through, so read-only bind mounts and hardlinks are covered.
+pub struct AccessTracer {
+    inotify: Arc<Inotify>,
+    watches: BTreeMap<WatchDescriptor, PathBuf>,
+    watched: BTreeSet<PathBuf>,
+    events: Arc<Mutex<BTreeSet<(WatchDescriptor, OsString)>>>,
+    complete: Arc<AtomicBool>,
+    stop: Arc<AtomicBool>,
+    reader: Option<JoinHandle<()>>,
+}
+
+// A direct dependency, the host directory its files show up in and, when that directory is shared with other dependencies, the files that belong to it
+pub type AccessTarget = (String, PathBuf, Option<BTreeSet<PathBuf>>);
+
+impl AccessTracer {
+    pub fn new() -> Result<AccessTracer> {
+        let inotify = Arc::new(Inotify::init(InitFlags::IN_NONBLOCK | InitFlags::IN_CLOEXEC).context("Failed to initialize inotify")?);
+        let events = Arc::new(Mutex::new(BTreeSet::new()));
+        let complete = Arc::new(AtomicBool::new(true));
+        let stop = Arc::new(AtomicBool::new(false));
+
+        // Builds open files far faster than the inotify queue can hold them, so it is drained while the containers run
+        let reader = {
+            let (inotify, events, complete, stop) = (inotify.clone(), events.clone(), complete.clone(), stop.clone());
+            thread::Builder::new()
+                .name(String::from("access"))
+                .spawn(move || loop {
+                    let stopping = stop.load(Ordering::Relaxed);
+                    let _ = poll(&mut [PollFd::new(inotify.as_fd(), PollFlags::POLLIN)], 100_u16);
+                    while let Ok(read) = inotify.read_events() {
+                        let mut events = events.lock().unwrap();
+                        for event in read {
+                            if event.mask.contains(AddWatchFlags::IN_Q_OVERFLOW) {
+                                complete.store(false, Ordering::Relaxed);
+                            }
+                            if event.mask.contains(AddWatchFlags::IN_ISDIR) {
+                                continue;
+                            }
+                            if let Some(name) = event.name {
+                                events.insert((event.wd, name));
+                            }
+                        }
+                    }
+                    if stopping {
+                        return;
+                    }
+                })
+                .context("Failed to spawn access tracer")?
+        };
+
+        Ok(AccessTracer {
+            inotify,
+            watches: BTreeMap::new(),
+            watched: BTreeSet::new(),
+            events,
+            complete,
+            stop,
+            reader: Some(reader),
+        })
+    }
+
+    // Running out of watches only makes the result incomplete
+    pub fn watch(&mut self, dir: &Path) -> Result<()> {
+        if !self.watched.insert(dir.to_path_buf()) {
+            return Ok(());
+        }
+
+        match self.inotify.add_watch(dir, AddWatchFlags::IN_OPEN | AddWatchFlags::IN_ONLYDIR) {
+            Ok(wd) => {
+                self.watches.insert(wd, dir.to_path_buf());
+            }
+            Err(Errno::ENOSPC) => self.complete.store(false, Ordering::Relaxed),
+            Err(Errno::ENOENT) | Err(Errno::ENOTDIR) => {}
+            Err(err) => return Err(err).with_context(|| format!("Failed to watch `{}`", dir.to_string_lossy())),
+        }
+        Ok(())
+    }
+
+    pub fn watch_tree(&mut self, dir: &Path) -> Result<()> {
+        self.watch(dir)?;
+        for entry in read_dir(dir).with_context(|| format!("Failed to read directory `{}`", dir.to_string_lossy()))? {
+            let entry = entry?;
+            if entry.file_type()?.is_dir() {
+                self.watch_tree(&entry.path())?;
+            }
+        }
+        Ok(())
+    }
+
+    pub fn watch_target(&mut self, target: &AccessTarget) -> Result<()> {
+        match &target.2 {
+            None => self.watch_tree(&target.1),
+            Some(files) => {
+                for file in files {
+                    if let Some(parent) = target.1.join(file).parent() {
+                        self.watch(parent)?;
+                    }
+                }
+                Ok(())
+            }
+        }
+    }
+
+    // Returns the host path of every file opened since the tracer started and whether every open was seen
+    pub fn finish(mut self) -> (BTreeSet<PathBuf>, bool) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(reader) = self.reader.take() {
+            let _ = reader.join();
+        }
+
+        let events = self.events.lock().unwrap();
+        let opened = events.iter().filter_map(|(wd, name)| self.watches.get(wd).map(|dir| dir.join(name))).collect();
+        (opened, self.complete.load(Ordering::Relaxed))
+    }
+}
+
+impl Drop for AccessTracer {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+    }
+}
+
+// Every non directory below the root, relative to it
+pub fn list_files(root: &Path) -> Result<BTreeSet<PathBuf>> {
+    let mut files = BTreeSet::new();
+    let mut dirs = vec![PathBuf::new()];
+    while let Some(dir) = dirs.pop() {
+        for entry in read_dir(root.join(&dir)).with_context(|| format!("Failed to read directory `{}`", root.join(&dir).to_string_lossy()))? {
+            let entry = entry?;
+            match entry.file_type()?.is_dir() {
+                true => dirs.push(dir.join(entry.file_name())),
+                false => {
+                    files.insert(dir.join(entry.file_name()));
+                }
+            }
+        }
+    }
+    Ok(files)
+}
+
+// The files an image package installed into a rootfs, taken from the dpkg file lists
+pub fn image_package_files(rootfs_path: &Path, package: &str) -> Result<Option<BTreeSet<PathBuf>>> {
+    let info_path = rootfs_path.join("var/lib/dpkg/info");
+    let mut list = None;
+    for entry in read_dir(&info_path).context("Failed to read dpkg info")? {
+        let name = entry?.file_name().to_string_lossy().to_string();
+        if name == format!("{}.list", package) || (name.starts_with(&format!("{}:", package)) && name.ends_with(".list")) {
+            list = Some(read_to_string(info_path.join(name)).context("Failed to read dpkg file list")?);
+            break;
+        }
+    }
+
+    let list = match list {
+        None => return Ok(None),
+        Some(list) => list,
+    };
+
+    let mut files = BTreeSet::new();
+    for line in list.lines() {
+        let file = PathBuf::from(line.trim_start_matches('/'));
+        if let Ok(meta) = symlink_metadata(rootfs_path.join(&file)) {
+            if !meta.is_dir() {
+                files.insert(file);
+            }
+        }
+    }
+    Ok(Some(files))
+}
+
+// For every target the files it owns that were opened, relative to its directory, and how many files it has
+pub fn access_report(targets: &[AccessTarget], opened: &BTreeSet<PathBuf>) -> Result<Vec<(String, Vec<PathBuf>, usize)>> {
+    let mut report = Vec::new();
+    for (name, root, files) in targets {
+        let total = match files {
+            Some(files) => files.len(),
+            None => list_files(root)?.len(),
+        };
+
+        let opened_files = opened
+            .iter()
+            .filter_map(|path| path.strip_prefix(root).ok())
+            .filter(|path| files.as_ref().is_none_or(|files| files.contains(*path)))
+            .map(|path| path.to_path_buf())
+            .collect();
+        report.push((name.clone(), opened_files, total));
+    }
+    Ok(report)
+}
@@ -1,15 +1,17 @@
 use std::{
     collections::BTreeMap,
-    fs::{create_dir_all, exists, read_dir, read_to_string, write, File},
+    fs::{copy, create_dir_all, exists, read_dir, read_to_string, write, File},
+    os::fd::AsRawFd,
     path::{Path, PathBuf},
     rc::Rc,
 };
 
 use anyhow::{bail, Context, Result};
 use fs2::FileExt;
-use nix::unistd::Pid;
+use log::info;
+use nix::unistd::{close, Pid};
 
-use crate::util::{acquire_lockfile, force_rm};
+use crate::util::{acquire_lockfile, force_rm, get_timestamp};
 
 pub struct Cache {
     path: PathBuf,
@@ -19,41 +21,33 @@ pub struct Cache {
 
 const CACHE_VERSION: i64 = 2;
 
+// A migration upgrades a cache from the previous version to the one it is listed with. Migrations rewrite metadata and layout in place,
+// install trees, build dirs, sources and the rootfs have to survive them. Every bump of CACHE_VERSION comes with one.
+pub type CacheMigration = (i64, &'static str, fn(&Path) -> Result<()>);
+
+const MIGRATIONS: &[CacheMigration] = &[];
+
 impl Cache {
     pub fn init(path: impl AsRef<Path>, acquire_lock: bool) -> Result<Rc<Cache>> {
         create_dir_all(&path).context("Failed to create cache directory")?;
 
-        let cache_state_path = path.as_ref().join("cache_state.toml");
-        if exists(&cache_state_path)? {
-            let data = read_to_string(&cache_state_path).context("Failed to read cache state")?;
-            let state_table = data.parse::<toml::Table>().context("Failed to parse cache state")?;
-            let version = state_table["version"].as_integer().unwrap_or(0);
-
-            if version != CACHE_VERSION {
-                bail!(
-                    "Cache version mismatch, expected {}, got {}! Please manually delete it and chariot will generate a new one.",
-                    CACHE_VERSION,
-                    version
-                );
-            }
-        } else {
-            let mut state_table = toml::Table::new();
-            state_table.insert(String::from("version"), toml::Value::Integer(CACHE_VERSION));
-
-            let cache_state_data = toml::to_string(&state_table).context("Failed to serialize cache state")?;
-            write(&cache_state_path, cache_state_data).context("Failed to write cache state")?;
-        }
-
         let mut cache = Cache {
             path: path.as_ref().to_path_buf(),
             lock: None,
             proc_lock: None,
         };
 
+        // Taken before looking at the version, so no other chariot uses the cache while it is migrated
         if acquire_lock {
             cache.lock = Some(acquire_lockfile(cache.path.join("cache.lock")).context("Failed to acquire cache lock")?);
         }
 
+        match read_cache_version(&cache.path)? {
+            None => write_cache_version(&cache.path, CACHE_VERSION)?,
+            Some(version) if version != CACHE_VERSION => migrate(&cache.path, version, CACHE_VERSION, MIGRATIONS)?,
+            Some(_) => {}
+        }
+
         if exists(cache.path_proc_caches())? {
             for proc_cache in read_dir(cache.path_proc_caches()).context("Failed to read proc caches dir")? {
                 let lock_path = proc_cache.as_ref().unwrap().path().join("proc.lock");
@@ -74,6 +68,13 @@ impl Cache {
         Ok(Rc::new(cache))
     }
 
+    // For processes forked to outlive this one, they must not keep the cache locked. They never drop the cache, so the files are not closed twice.
+    pub fn close_locks(&self) {
+        for lock in [&self.lock, &self.proc_lock].into_iter().flatten() {
+            let _ = close(lock.as_raw_fd());
+        }
+    }
+
     pub fn path(&self) -> PathBuf {
         self.path.clone()
     }
@@ -82,10 +83,22 @@ impl Cache {
         self.path.join("proc")
     }
 
+    pub fn path_config_cache(&self) -> PathBuf {
+        self.path.join("config.bin")
+    }
+
     pub fn path_rootfs(&self) -> PathBuf {
         self.path.join("rootfs")
     }
 
+    pub fn path_backups(&self) -> PathBuf {
+        self.path.join("backups")
+    }
+
+    pub fn path_history(&self) -> PathBuf {
+        self.path.join("history.jsonl")
+    }
+
     pub fn path_recipes(&self) -> PathBuf {
         self.path.join("recipes")
     }
@@ -102,7 +115,11 @@ impl Cache {
         self.path_proc_caches().join(Pid::this().to_string())
     }
 
-    fn path_dependency_cache(&self) -> PathBuf {
+    pub fn path_pack(&self) -> PathBuf {
+        self.path_proc_cache().join("pack")
+    }
+
+    pub fn path_dependency_cache(&self) -> PathBuf {
         self.path_proc_cache().join("depcache")
     }
 
@@ -117,4 +134,196 @@ impl Cache {
     pub fn path_dependency_cache_packages(&self) -> PathBuf {
         self.path_dependency_cache().join("packages")
     }
+
+    pub fn path_dependency_cache_custom(&self) -> PathBuf {
+        self.path_dependency_cache().join("custom")
+    }
+}
+
+fn read_cache_version(path: &Path) -> Result<Option<i64>> {
+    let cache_state_path = path.join("cache_state.toml");
+    if !exists(&cache_state_path)? {
+        return Ok(None);
+    }
+
+    let data = read_to_string(&cache_state_path).context("Failed to read cache state")?;
+    let state_table = data.parse::<toml::Table>().context("Failed to parse cache state")?;
+    Ok(Some(state_table.get("version").and_then(|v| v.as_integer()).unwrap_or(0)))
+}
+
+fn write_cache_version(path: &Path, version: i64) -> Result<()> {
+    let mut state_table = toml::Table::new();
+    state_table.insert(String::from("version"), toml::Value::Integer(version));
+
+    let cache_state_data = toml::to_string(&state_table).context("Failed to serialize cache state")?;
+    write(path.join("cache_state.toml"), cache_state_data).context("Failed to write cache state")
+}
+
+// Returns the version of the cache and the migrations bringing it to the current version, without touching it
+pub fn cache_migration_plan(path: impl AsRef<Path>) -> Result<(i64, Vec<&'static CacheMigration>)> {
+    migration_plan(path.as_ref(), CACHE_VERSION, MIGRATIONS)
+}
+
+fn migration_plan<'a>(path: &Path, current: i64, migrations: &'a [CacheMigration]) -> Result<(i64, Vec<&'a CacheMigration>)> {
+    let version = read_cache_version(path)?.unwrap_or(current);
+    if version > current {
+        bail!("Cache version {} is newer than the version {} supported by this chariot, please upgrade chariot", version, current);
+    }
+
+    let mut plan = Vec::new();
+    for target in version + 1..=current {
+        match migrations.iter().find(|migration| migration.0 == target) {
+            Some(migration) => plan.push(migration),
+            None => bail!(
+                "Cache version mismatch, expected {}, got {} and it cannot be migrated! Please manually delete it and chariot will generate a new one.",
+                current,
+                version
+            ),
+        }
+    }
+    Ok((version, plan))
+}
+
+// The metadata is backed up first, the version is recorded after every step so a failed migration resumes where it stopped
+fn migrate(path: &Path, version: i64, current: i64, migrations: &[CacheMigration]) -> Result<()> {
+    let (_, plan) = migration_plan(path, current, migrations)?;
+
+    let backup_path = path.join("backups").join(format!("v{}-{}", version, get_timestamp()?));
+    for file in cache_metadata_files(path).context("Failed to collect cache metadata")? {
+        let dest = backup_path.join(&file);
+        create_dir_all(dest.parent().unwrap()).context("Failed to create metadata backup dir")?;
+        copy(path.join(&file), &dest).with_context(|| format!("Failed to back up `{}`", file.to_string_lossy()))?;
+    }
+    info!("Backed up cache metadata to `{}`", backup_path.to_string_lossy());
+
+    for (target, description, migration) in plan {
+        info!("Migrating cache to version {}: {}", target, description);
+        migration(path).with_context(|| {
+            format!(
+                "Failed to migrate cache to version {}, metadata from before the migration is in `{}`",
+                target,
+                backup_path.to_string_lossy()
+            )
+        })?;
+        write_cache_version(path, *target)?;
+    }
+    Ok(())
+}
+
+// Every file describing the contents of the cache relative to it, the state of recipes and rootfs subsets but none of their trees.
+// Recipes nest their option variants below `opt/<option>/<value>` and subsets nest below `subset/<package>`.
+pub fn cache_metadata_files(path: &Path) -> Result<Vec<PathBuf>> {
+    fn children(dir: &Path) -> Result<Vec<PathBuf>> {
+        if !exists(dir)? {
+            return Ok(Vec::new());
+        }
+
+        let mut children = Vec::new();
+        for entry in read_dir(dir).with_context(|| format!("Failed to read directory `{}`", dir.to_string_lossy()))? {
+            children.push(PathBuf::from(entry?.file_name()));
+        }
+        Ok(children)
+    }
+
+    let mut files = Vec::new();
+    for file in ["cache_state.toml", "history.jsonl", "history.1.jsonl"] {
+        if exists(path.join(file))? {
+            files.push(PathBuf::from(file));
+        }
+    }
+
+    let mut dirs = vec![PathBuf::from("rootfs")];
+    for namespace in children(&path.join("recipes"))? {
+        for recipe in children(&path.join("recipes").join(&namespace))? {
+            dirs.push(Path::new("recipes").join(&namespace).join(recipe));
+        }
+    }
+
+    while let Some(dir) = dirs.pop() {
+        if exists(path.join(&dir).join("state.toml"))? {
+            files.push(dir.join("state.toml"));
+        }
+        for manifest in children(&path.join(&dir).join("outputs"))? {
+            files.push(dir.join("outputs").join(manifest));
+        }
+        for package in children(&path.join(&dir).join("subset"))? {
+            dirs.push(dir.join("subset").join(package));
+        }
+        for option in children(&path.join(&dir).join("opt"))? {
+            for value in children(&path.join(&dir).join("opt").join(&option))? {
+                dirs.push(dir.join("opt").join(&option).join(value));
+            }
+        }
+    }
+    Ok(files)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{
+        env::temp_dir,
+        fs::{create_dir_all, read_dir, read_to_string, remove_dir_all, write},
+        path::{Path, PathBuf},
+        process,
+    };
+
+    use anyhow::{Context, Result};
+
+    use super::{cache_metadata_files, migrate, migration_plan, read_cache_version, write_cache_version, CacheMigration};
+
+    fn temp_cache(name: &str) -> PathBuf {
+        let path = temp_dir().join(format!("chariot-test-{}-{}", name, process::id()));
+        let _ = remove_dir_all(&path);
+        create_dir_all(path.join("recipes/package/xyz")).unwrap();
+        write(path.join("recipes/package/xyz/state.toml"), "timestamp = 1\n").unwrap();
+        path
+    }
+
+    fn rename_timestamp(path: &Path) -> Result<()> {
+        let state_path = path.join("recipes/package/xyz/state.toml");
+        let state = read_to_string(&state_path).context("Failed to read state")?;
+        write(&state_path, state.replace("timestamp", "built_at")).context("Failed to write state")
+    }
+
+    fn add_marker(path: &Path) -> Result<()> {
+        write(path.join("marker"), "3").context("Failed to write marker")
+    }
+
+    const MIGRATIONS: &[CacheMigration] = &[(2, "rename timestamp", rename_timestamp), (3, "add marker", add_marker)];
+
+    #[test]
+    fn migrations_run_in_order_and_back_up_metadata() {
+        let path = temp_cache("migrate");
+        write_cache_version(&path, 1).unwrap();
+
+        let (version, plan) = migration_plan(&path, 3, MIGRATIONS).unwrap();
+        assert_eq!(version, 1);
+        assert_eq!(plan.iter().map(|migration| migration.0).collect::<Vec<_>>(), vec![2, 3]);
+
+        migrate(&path, 1, 3, MIGRATIONS).unwrap();
+        assert_eq!(read_cache_version(&path).unwrap(), Some(3));
+        assert_eq!(read_to_string(path.join("recipes/package/xyz/state.toml")).unwrap(), "built_at = 1\n");
+        assert_eq!(read_to_string(path.join("marker")).unwrap(), "3");
+
+        // The backup holds the metadata as it was before the first migration
+        let backups = read_dir(path.join("backups")).unwrap().collect::<Vec<_>>();
+        assert_eq!(backups.len(), 1);
+        let backup = backups.into_iter().next().unwrap().unwrap().path();
+        assert_eq!(read_to_string(backup.join("recipes/package/xyz/state.toml")).unwrap(), "timestamp = 1\n");
+        assert!(cache_metadata_files(&backup).unwrap().contains(&PathBuf::from("cache_state.toml")));
+
+        remove_dir_all(&path).unwrap();
+    }
+
+    #[test]
+    fn missing_migration_is_refused() {
+        let path = temp_cache("missing");
+        write_cache_version(&path, 0).unwrap();
+
+        assert!(migration_plan(&path, 3, MIGRATIONS).is_err());
+        assert!(migrate(&path, 0, 3, MIGRATIONS).is_err());
+        assert_eq!(read_cache_version(&path).unwrap(), Some(0));
+
+        remove_dir_all(&path).unwrap();
+    }
 }
@@ -0,0 +1,207 @@
+use std::{
+    collections::{BTreeMap, HashMap},
+    env::current_dir,
+    fs::{metadata, read, read_dir, remove_file, rename, write},
+    os::unix::fs::MetadataExt,
+    path::{Path, PathBuf},
+    rc::Rc,
+    time::SystemTime,
+};
+
+use anyhow::{Context, Result};
+use glob::glob;
+use log::warn;
+use serde::{Deserialize, Serialize};
+
+use super::{Config, ConfigRecipeId};
+
+const CONFIG_CACHE_VERSION: u32 = 4;
+
+// Scoped parses are cached next to the full one, one file per scope, keeping only the most recently written ones
+const SCOPED_CACHE_LIMIT: usize = 8;
+
+// Everything a parse read from disk, files map to their size, mtime, and content hash
+#[derive(Serialize, Deserialize, Default)]
+pub struct ConfigInputs {
+    pub files: BTreeMap<PathBuf, (u64, (i64, i64), [u8; 32])>,
+    pub imports: BTreeMap<String, Vec<PathBuf>>,
+}
+
+#[derive(Serialize, Deserialize)]
+struct ConfigCacheKey {
+    version: u32,
+    chariot_version: String,
+    config_dir: PathBuf,
+    path: PathBuf,
+    overrides: BTreeMap<String, String>,
+    scope: Option<Vec<String>>,
+    inputs: ConfigInputs,
+}
+
+impl Config {
+    // Loads the config from the binary cache when none of its inputs changed, otherwise parses it and refreshes the cache.
+    // A cached full config also serves scoped loads, a cached scoped config only serves the same scope and lives in its own file,
+    // so switching scopes never evicts the full cache or another scope. Also returns whether the cache was used.
+    pub fn load(path: impl AsRef<Path>, overrides: HashMap<String, String>, scope: Option<Vec<String>>, cache_path: impl AsRef<Path>) -> Result<(Rc<Config>, bool)> {
+        let cache_path = cache_path.as_ref();
+        let scoped_cache_path = scope.as_ref().map(|scope| scoped_cache_path(cache_path, scope));
+
+        let mut key = ConfigCacheKey {
+            version: CONFIG_CACHE_VERSION,
+            chariot_version: String::from(env!("CARGO_PKG_VERSION")),
+            config_dir: current_dir().context("Failed to resolve config directory")?,
+            path: path.as_ref().to_path_buf(),
+            overrides: BTreeMap::from_iter(overrides.clone()),
+            scope,
+            inputs: ConfigInputs::default(),
+        };
+
+        for candidate in scoped_cache_path.iter().map(PathBuf::as_path).chain([cache_path]) {
+            let Ok(data) = read(candidate) else {
+                continue;
+            };
+
+            if let Some((config, refreshed)) = load_cached(&key, &data) {
+                if let Some(refreshed) = refreshed {
+                    if let Err(err) = rewrite_cached_key(candidate, &refreshed, &data) {
+                        warn!("Failed to write config cache: {}", err);
+                    }
+                }
+                return Ok((Rc::new(config), true));
+            }
+        }
+
+        let (config, inputs) = Config::parse(path, overrides, key.scope.as_deref())?;
+        key.inputs = inputs;
+
+        // A failed write only costs the next invocation a full parse
+        if let Err(err) = write_cached(scoped_cache_path.as_deref().unwrap_or(cache_path), &key, &config) {
+            warn!("Failed to write config cache: {}", err);
+        }
+
+        if scoped_cache_path.is_some() {
+            prune_scoped_caches(cache_path);
+        }
+
+        Ok((Rc::new(config), false))
+    }
+}
+
+// Also returns the cached key with refreshed mtimes when files were touched without their contents changing, so they are not hashed again next time
+fn load_cached(key: &ConfigCacheKey, data: &[u8]) -> Option<(Config, Option<ConfigCacheKey>)> {
+    // The key is decoded on its own so a stale cache is rejected before the config itself is decoded
+    let (mut cached_key, data) = postcard::take_from_bytes::<ConfigCacheKey>(data).ok()?;
+    if cached_key.version != key.version
+        || cached_key.chariot_version != key.chariot_version
+        || cached_key.config_dir != key.config_dir
+        || cached_key.path != key.path
+        || cached_key.overrides != key.overrides
+        || (cached_key.scope.is_some() && cached_key.scope != key.scope)
+    {
+        return None;
+    }
+
+    let refreshed = inputs_unchanged(&mut cached_key.inputs)?;
+
+    let mut config = postcard::from_bytes::<Config>(data).ok()?;
+    for (recipe_id, recipe) in config.recipes.iter_mut().enumerate() {
+        recipe.id = recipe_id as ConfigRecipeId;
+    }
+    Some((config, refreshed.then_some(cached_key)))
+}
+
+// Returns `None` when an input changed, otherwise whether the mtime of a touched file was updated
+fn inputs_unchanged(inputs: &mut ConfigInputs) -> Option<bool> {
+    // Import globs are re-evaluated so added or removed files are noticed
+    for (pattern, imports) in &inputs.imports {
+        let matches = match glob(pattern) {
+            Err(_) => return None,
+            Ok(paths) => paths.collect::<Result<Vec<PathBuf>, _>>(),
+        };
+        match matches {
+            Ok(matches) if &matches == imports => {}
+            _ => return None,
+        }
+    }
+
+    let mut refreshed = false;
+    for (path, (size, mtime, hash)) in inputs.files.iter_mut() {
+        let meta = metadata(path).ok()?;
+        if meta.len() != *size {
+            return None;
+        }
+
+        if (meta.mtime(), meta.mtime_nsec()) == *mtime {
+            continue;
+        }
+
+        // Touched files are only stale when their contents actually changed
+        match read(path) {
+            Ok(data) if blake3::hash(&data).as_bytes() == hash => {
+                *mtime = (meta.mtime(), meta.mtime_nsec());
+                refreshed = true;
+            }
+            _ => return None,
+        }
+    }
+    Some(refreshed)
+}
+
+fn scoped_cache_path(cache_path: &Path, scope: &[String]) -> PathBuf {
+    let mut hasher = blake3::Hasher::new();
+    for name in scope {
+        hasher.update(name.as_bytes());
+        hasher.update(&[0]);
+    }
+    cache_path.with_file_name(format!("{}-{}.bin", scoped_cache_prefix(cache_path), &hasher.finalize().to_hex()[..16]))
+}
+
+fn scoped_cache_prefix(cache_path: &Path) -> String {
+    cache_path.file_stem().map(|stem| stem.to_string_lossy().into_owned()).unwrap_or_default()
+}
+
+// Drops the oldest scoped caches past the limit, a failure here only leaves an extra file behind
+fn prune_scoped_caches(cache_path: &Path) {
+    let (Some(dir), prefix) = (cache_path.parent(), format!("{}-", scoped_cache_prefix(cache_path))) else {
+        return;
+    };
+    let Ok(entries) = read_dir(dir) else {
+        return;
+    };
+
+    let mut scoped: Vec<(SystemTime, PathBuf)> = entries
+        .filter_map(|entry| entry.ok())
+        .filter(|entry| entry.file_name().to_string_lossy().strip_prefix(&prefix).is_some_and(|rest| rest.ends_with(".bin")))
+        .filter_map(|entry| Some((entry.metadata().ok()?.modified().ok()?, entry.path())))
+        .collect();
+    if scoped.len() <= SCOPED_CACHE_LIMIT {
+        return;
+    }
+
+    scoped.sort_by(|a, b| b.0.cmp(&a.0));
+    for (_, path) in &scoped[SCOPED_CACHE_LIMIT..] {
+        if let Err(err) = remove_file(path) {
+            warn!("Failed to remove scoped config cache `{}`: {}", path.display(), err);
+        }
+    }
+}
+
+fn write_cached(cache_path: &Path, key: &ConfigCacheKey, config: &Config) -> Result<()> {
+    write_cache_file(cache_path, key, postcard::to_allocvec(config).context("Failed to serialize config")?)
+}
+
+// The config bytes behind the key are reused as they are, only the key is encoded again
+fn rewrite_cached_key(cache_path: &Path, key: &ConfigCacheKey, data: &[u8]) -> Result<()> {
+    let (_, config_data) = postcard::take_from_bytes::<ConfigCacheKey>(data).context("Failed to decode config cache key")?;
+    write_cache_file(cache_path, key, config_data.to_vec())
+}
+
+fn write_cache_file(cache_path: &Path, key: &ConfigCacheKey, mut config_data: Vec<u8>) -> Result<()> {
+    let mut data = postcard::to_allocvec(key).context("Failed to serialize config cache key")?;
+    data.append(&mut config_data);
+
+    let tmp_path = cache_path.with_extension("tmp");
+    write(&tmp_path, data).context("Failed to write config cache")?;
+    rename(&tmp_path, cache_path).context("Failed to move config cache into place")?;
+    Ok(())
+}
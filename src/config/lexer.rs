@@ -1,26 +1,39 @@
 use std::fmt::{Debug, Display};
 
+use memchr::{memchr, memchr_iter, memmem, memrchr};
 use thiserror::Error;
 
 #[derive(Error, Debug)]
 pub enum LexerError {
-    #[error("Unexpected symbol `{ch}`")]
-    UnexpectedSymbol { offset: usize, ch: char },
+    #[error("Unexpected symbol `{ch}` at {span}")]
+    UnexpectedSymbol { span: Span, ch: char },
 
-    #[error("Unexpected EOF")]
-    UnexpectedEOF,
+    #[error("Unexpected EOF, unterminated {kind} starting at {span}")]
+    UnexpectedEOF { kind: &'static str, span: Span },
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct Span {
+    pub line: usize,
+    pub column: usize,
+}
+
+impl Display for Span {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}:{}", self.line, self.column)
+    }
 }
 
 #[derive(Debug)]
-pub enum Token {
-    Identifier(String),
+pub enum Token<'a> {
+    Identifier(&'a str),
     Symbol(char),
-    String(String),
-    Directive(String),
-    CodeBlock { lang: String, code: String },
+    String(&'a str),
+    Directive(&'a str),
+    CodeBlock { lang: &'a str, code: &'a str },
 }
 
-impl Display for Token {
+impl Display for Token<'_> {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
         match &self {
             Self::Identifier(id) => write!(f, "Identifier({})", id),
@@ -32,146 +45,168 @@ impl Display for Token {
     }
 }
 
-pub fn lex(input: &str) -> Result<Vec<Token>, LexerError> {
-    let mut iter = input.char_indices().peekable();
-    let mut tokens: Vec<Token> = Vec::new();
-
-    enum LexState {
-        Initial,
-        CommentPossible,
-        CommentLine,
-        CommentMulti { end: bool },
-        Identifier(Vec<char>),
-        String(Vec<char>),
-        Directive(Vec<char>),
-        CodeBlockLang(Vec<char>),
-        CodeBlock { lang: String, code: Vec<char> },
-        CodeBlockEnd { lang: String, code: Vec<char>, endtag: Option<Vec<char>> },
+struct Lexer<'a> {
+    input: &'a str,
+    bytes: &'a [u8],
+    offset: usize,
+    line: usize,
+    line_start: usize,
+}
+
+impl<'a> Lexer<'a> {
+    fn span(&self) -> Span {
+        Span {
+            line: self.line,
+            column: self.offset - self.line_start + 1,
+        }
     }
 
-    let mut state: LexState = LexState::Initial;
-
-    let mut current_value = iter.next();
-    while let Some((offset, ch)) = current_value {
-        match &mut state {
-            LexState::Initial => match ch {
-                ch if ch.is_whitespace() => {}
-                '{' | '}' | ':' | '[' | ']' | ',' | '*' | '%' | '!' | '=' | '?' => tokens.push(Token::Symbol(ch)),
-                ch if ch.is_alphabetic() => state = LexState::Identifier(vec![ch]),
-                '/' => state = LexState::CommentPossible,
-                '"' => state = LexState::String(Vec::new()),
-                '<' => state = LexState::CodeBlockLang(Vec::new()),
-                '@' => state = LexState::Directive(Vec::new()),
-                _ => return Err(LexerError::UnexpectedSymbol { offset, ch }),
-            },
-            LexState::CommentPossible => match ch {
-                '/' => state = LexState::CommentLine,
-                '*' => state = LexState::CommentMulti { end: false },
-                _ => {
-                    tokens.push(Token::Symbol('/'));
-                    state = LexState::Initial;
-                    continue;
-                }
-            },
-            LexState::CommentLine => match ch {
-                '\n' => state = LexState::Initial,
-                _ => {}
-            },
-            LexState::CommentMulti { end: false } => match ch {
-                '*' => state = LexState::CommentMulti { end: true },
-                _ => {}
-            },
-            LexState::CommentMulti { end: true } => match ch {
-                '/' => state = LexState::Initial,
-                '*' => state = LexState::CommentMulti { end: true },
-                _ => state = LexState::CommentMulti { end: false },
-            },
-            LexState::Identifier(id) => match ch {
-                ch if ch.is_alphanumeric() || ch == '_' || ch == '-' || ch == '+' || ch == '.' => id.push(ch),
-                _ => {
-                    tokens.push(Token::Identifier(id.iter().collect::<String>()));
-                    state = LexState::Initial;
-                    continue;
+    // Moves to `offset` keeping the line tracking intact, newlines are counted with memchr instead of per byte
+    fn advance_to(&mut self, offset: usize) {
+        let skipped = &self.bytes[self.offset..offset];
+        let newlines = memchr_iter(b'\n', skipped).count();
+        if newlines > 0 {
+            self.line += newlines;
+            self.line_start = self.offset + memrchr(b'\n', skipped).unwrap() + 1;
+        }
+        self.offset = offset;
+    }
+
+    fn char_at(&self, offset: usize) -> char {
+        self.input[offset..].chars().next().unwrap()
+    }
+
+    fn scan_while(&self, mut offset: usize, accept_ascii: impl Fn(u8) -> bool, accept_char: impl Fn(char) -> bool) -> usize {
+        while offset < self.bytes.len() {
+            let byte = self.bytes[offset];
+            if byte.is_ascii() {
+                if !accept_ascii(byte) {
+                    break;
                 }
-            },
-            LexState::String(str) => match ch {
-                '"' => {
-                    tokens.push(Token::String(str.iter().collect::<String>()));
-                    state = LexState::Initial;
+                offset += 1;
+                continue;
+            }
+
+            let ch = self.char_at(offset);
+            if !accept_char(ch) {
+                break;
+            }
+            offset += ch.len_utf8();
+        }
+        offset
+    }
+}
+
+pub fn lex(input: &str) -> Result<Vec<(Token<'_>, Span)>, LexerError> {
+    let mut lexer = Lexer {
+        input,
+        bytes: input.as_bytes(),
+        offset: 0,
+        line: 1,
+        line_start: 0,
+    };
+    let mut tokens: Vec<(Token, Span)> = Vec::new();
+
+    while lexer.offset < lexer.bytes.len() {
+        let start = lexer.offset;
+        let span = lexer.span();
+        let byte = lexer.bytes[start];
+
+        match byte {
+            b' ' | b'\t' | b'\r' | b'\n' | b'\x0b' | b'\x0c' => {
+                let end = lexer.scan_while(start, |b| b.is_ascii_whitespace() || b == b'\x0b', |ch| ch.is_whitespace());
+                lexer.advance_to(end);
+            }
+            b'{' | b'}' | b':' | b'[' | b']' | b',' | b'*' | b'%' | b'!' | b'=' | b'?' => {
+                tokens.push((Token::Symbol(byte as char), span));
+                lexer.offset += 1;
+            }
+            b'/' => match lexer.bytes.get(start + 1) {
+                Some(b'/') => {
+                    let end = match memchr(b'\n', &lexer.bytes[start..]) {
+                        Some(newline) => start + newline,
+                        None => lexer.bytes.len(),
+                    };
+                    lexer.advance_to(end);
                 }
-                _ => str.push(ch),
-            },
-            LexState::Directive(id) => match ch {
-                ch if ch.is_alphanumeric() || ch == '_' || ch == '-' => id.push(ch),
+                Some(b'*') => match memmem::find(&lexer.bytes[start + 2..], b"*/") {
+                    Some(end) => lexer.advance_to(start + 2 + end + 2),
+                    None => return Err(LexerError::UnexpectedEOF { kind: "comment", span }),
+                },
                 _ => {
-                    tokens.push(Token::Directive(id.iter().collect::<String>()));
-                    state = LexState::Initial;
-                    continue;
+                    tokens.push((Token::Symbol('/'), span));
+                    lexer.offset += 1;
                 }
             },
-            LexState::CodeBlockLang(lang) => match ch {
-                ch if ch.is_alphabetic() => lang.push(ch),
-                '>' => {
-                    state = LexState::CodeBlock {
-                        lang: lang.iter().collect::<String>(),
-                        code: Vec::new(),
-                    }
+            b'"' => match memchr(b'"', &lexer.bytes[start + 1..]) {
+                Some(end) => {
+                    tokens.push((Token::String(&input[start + 1..start + 1 + end]), span));
+                    lexer.advance_to(start + 1 + end + 1);
                 }
-                _ => return Err(LexerError::UnexpectedSymbol { offset, ch }),
+                None => return Err(LexerError::UnexpectedEOF { kind: "string", span }),
             },
-            LexState::CodeBlock { lang, code } => match ch {
-                '<' => {
-                    state = LexState::CodeBlockEnd {
-                        lang: lang.clone(),
-                        code: code.clone(),
-                        endtag: None,
-                    };
+            b'@' => {
+                let end = lexer.scan_while(start + 1, |b| b.is_ascii_alphanumeric() || b == b'_' || b == b'-', |ch| ch.is_alphanumeric());
+                tokens.push((Token::Directive(&input[start + 1..end]), span));
+                lexer.offset = end;
+            }
+            b'<' => {
+                let lang_end = lexer.scan_while(start + 1, |b| b.is_ascii_alphabetic(), |ch| ch.is_alphabetic());
+                match lexer.bytes.get(lang_end) {
+                    Some(b'>') => {}
+                    Some(_) => {
+                        lexer.offset = lang_end;
+                        return Err(LexerError::UnexpectedSymbol {
+                            span: lexer.span(),
+                            ch: lexer.char_at(lang_end),
+                        });
+                    }
+                    None => return Err(LexerError::UnexpectedEOF { kind: "code block", span }),
                 }
-                _ => code.push(ch),
-            },
-            LexState::CodeBlockEnd { lang, code, endtag: None } => match ch {
-                '/' => {
-                    state = LexState::CodeBlockEnd {
-                        lang: lang.clone(),
-                        code: code.clone(),
-                        endtag: Some(Vec::new()),
+
+                let lang = &input[start + 1..lang_end];
+                let code_start = lang_end + 1;
+
+                // The code block ends at the first `</lang>`, a single memmem pass over the block
+                let mut end_tag = String::with_capacity(lang.len() + 3);
+                end_tag.push_str("</");
+                end_tag.push_str(lang);
+                end_tag.push('>');
+                match memmem::find(&lexer.bytes[code_start..], end_tag.as_bytes()) {
+                    Some(code_len) => {
+                        tokens.push((
+                            Token::CodeBlock {
+                                lang,
+                                code: &input[code_start..code_start + code_len],
+                            },
+                            span,
+                        ));
+                        lexer.advance_to(code_start + code_len + end_tag.len());
                     }
+                    None => return Err(LexerError::UnexpectedEOF { kind: "code block", span }),
                 }
-                _ => {
-                    code.push('<');
-                    code.push(ch);
-                    state = LexState::CodeBlock {
-                        lang: lang.clone(),
-                        code: code.clone(),
-                    };
+            }
+            _ => {
+                let ch = lexer.char_at(start);
+                if ch.is_whitespace() {
+                    let end = lexer.scan_while(start, |b| b.is_ascii_whitespace() || b == b'\x0b', |ch| ch.is_whitespace());
+                    lexer.advance_to(end);
+                    continue;
                 }
-            },
-            LexState::CodeBlockEnd { lang, code, endtag: Some(endtag) } => {
-                if lang.len() == endtag.len() && ch == '>' {
-                    tokens.push(Token::CodeBlock {
-                        lang: lang.clone(),
-                        code: code.iter().collect::<String>(),
-                    });
-                    state = LexState::Initial;
-                } else {
-                    endtag.push(ch);
-                    if !lang.starts_with(endtag.iter().collect::<String>().as_str()) {
-                        code.push('<');
-                        code.push('/');
-                        code.append(endtag);
-                        state = LexState::CodeBlock {
-                            lang: lang.clone(),
-                            code: code.clone(),
-                        };
-                    }
+
+                if !ch.is_alphabetic() {
+                    return Err(LexerError::UnexpectedSymbol { span, ch });
                 }
+
+                let end = lexer.scan_while(
+                    start + ch.len_utf8(),
+                    |b| b.is_ascii_alphanumeric() || b == b'_' || b == b'-' || b == b'+' || b == b'.',
+                    |ch| ch.is_alphanumeric(),
+                );
+                tokens.push((Token::Identifier(&input[start..end]), span));
+                lexer.offset = end;
             }
         }
-        current_value = iter.next();
-    }
-
-    if !matches!(state, LexState::Initial) {
-        return Err(LexerError::UnexpectedEOF);
     }
 
     tokens.reverse();
@@ -1,23 +1,27 @@
-use anyhow::{bail, Context, Result};
-use glob::glob;
-use serde::Serialize;
+use anyhow::{anyhow, bail, Context, Result};
+use blake3::Hasher;
+use glob::{glob, Pattern};
+use serde::{Deserialize, Serialize};
 use std::{
-    collections::{BTreeSet, HashMap},
+    collections::{BTreeMap, HashMap},
     fmt::Display,
-    fs::read_to_string,
-    ops::Deref,
-    path::Path,
-    rc::Rc,
+    fs::{canonicalize, metadata, read_to_string},
+    os::unix::fs::MetadataExt,
+    path::{Path, PathBuf},
+    thread::{self, available_parallelism},
 };
 
-use parser::{parse_config, ConfigFragment};
+use cache::ConfigInputs;
+use parser::{parse_config, ConfigArena, ConfigFragment};
 
-mod lexer;
-mod parser;
+mod cache;
+pub mod lexer;
+pub mod parser;
 
 pub type ConfigRecipeId = u32;
+pub type ConfigOptionId = u32;
 
-#[derive(Serialize)]
+#[derive(Serialize, Deserialize)]
 pub enum ConfigNamespace {
     Source(ConfigRecipeSource),
     Custom(ConfigRecipeCommon),
@@ -25,9 +29,9 @@ pub enum ConfigNamespace {
     Tool(ConfigRecipeCommon),
 }
 
-#[derive(Serialize)]
+#[derive(Serialize, Deserialize)]
 pub struct ConfigRecipe {
-    #[serde(skip_serializing)]
+    #[serde(skip)]
     pub id: ConfigRecipeId,
 
     pub namespace: ConfigNamespace,
@@ -37,7 +41,7 @@ pub struct ConfigRecipe {
     pub image_dependencies: Vec<ConfigImageDependency>,
 }
 
-#[derive(Serialize)]
+#[derive(Serialize, Deserialize)]
 pub enum ConfigSourceKind {
     Local,
     Git(String),
@@ -45,7 +49,7 @@ pub enum ConfigSourceKind {
     TarXz(String),
 }
 
-#[derive(Serialize)]
+#[derive(Serialize, Deserialize)]
 pub struct ConfigRecipeSource {
     pub url: String,
     pub patch: Option<String>,
@@ -53,41 +57,66 @@ pub struct ConfigRecipeSource {
     pub regenerate: Option<ConfigCodeBlock>,
 }
 
-#[derive(Serialize)]
+#[derive(Serialize, Deserialize)]
 pub struct ConfigRecipeCommon {
     pub always_clean: bool,
     pub configure: Option<ConfigCodeBlock>,
     pub build: Option<ConfigCodeBlock>,
     pub install: Option<ConfigCodeBlock>,
+    pub check: Option<ConfigCodeBlock>,
+    pub post_install: ConfigPostInstall,
+    pub outputs: BTreeMap<String, Vec<String>>,
+    pub prebuilt: Option<ConfigPrebuilt>,
 }
 
-#[derive(Serialize)]
+// An archive of the install tree that is used instead of building the recipe, local paths are relative to the root chariot file
+#[derive(Serialize, Deserialize)]
+pub enum ConfigPrebuilt {
+    Url { url: String, b2sum: String },
+    Path { path: String, b2sum: Option<String> },
+}
+
+#[derive(Serialize, Deserialize, Clone, Default, PartialEq)]
+pub struct ConfigPostInstall {
+    pub strip: Option<bool>,
+    pub compress_man: Option<bool>,
+    pub prune: Option<Vec<String>>,
+}
+
+#[derive(Serialize, Deserialize)]
 pub struct ConfigRecipeDependency {
     pub recipe_id: ConfigRecipeId,
     pub runtime: bool,
     pub mutable: bool,
     pub loose: bool,
     pub optional: bool,
+    pub output: Option<String>,
 }
 
-#[derive(Serialize, Clone)]
+#[derive(Serialize, Deserialize, Clone)]
 pub struct ConfigImageDependency {
     pub package: String,
     pub runtime: bool,
 }
 
-#[derive(Serialize)]
+#[derive(Serialize, Deserialize)]
 pub struct ConfigCodeBlock {
     pub lang: String,
     pub code: String,
 }
 
+#[derive(Serialize, Deserialize)]
+// Recipe ids are dense, so everything per recipe is stored in vectors indexed by id.
+// Options are interned by their position in the sorted `option_names`, per recipe option sets are bitsets of `option_words` words in `options_map`.
 pub struct Config {
     pub global_env: HashMap<String, String>,
-    pub recipes: HashMap<ConfigRecipeId, ConfigRecipe>,
-    pub dependency_map: HashMap<ConfigRecipeId, Vec<ConfigRecipeDependency>>,
-    pub options_map: HashMap<ConfigRecipeId, BTreeSet<String>>,
-    pub options: HashMap<String, Vec<String>>,
+    pub recipes: Vec<ConfigRecipe>,
+    pub recipe_ids: HashMap<String, ConfigRecipeId>,
+    pub dependency_map: Vec<Vec<ConfigRecipeDependency>>,
+    pub option_names: Vec<String>,
+    pub options: Vec<Vec<String>>,
+    options_map: Vec<u64>,
+    option_words: usize,
     pub global_pkgs: Vec<String>,
 }
 
@@ -97,16 +126,57 @@ impl Display for ConfigRecipe {
     }
 }
 
-impl Display for ConfigNamespace {
-    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
-        let namespace = match &self {
+impl ConfigRecipe {
+    pub fn output_names(&self) -> Vec<String> {
+        let common = match &self.namespace {
+            ConfigNamespace::Source(_) => return Vec::new(),
+            ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) | ConfigNamespace::Custom(common) => common,
+        };
+
+        let mut outputs: Vec<String> = common.outputs.keys().cloned().collect();
+        if !outputs.is_empty() || common.post_install.strip == Some(true) {
+            outputs.push(String::from("runtime"));
+        }
+        if common.post_install.strip == Some(true) {
+            outputs.push(String::from("debug"));
+        }
+        outputs
+    }
+
+    pub fn has_output(&self, output: &str) -> bool {
+        self.output_names().iter().any(|name| name == output)
+    }
+}
+
+impl ConfigRecipeDependency {
+    // How the dependency edge is hashed and recorded with the recipe state
+    pub fn modifiers(&self) -> String {
+        let mut modifiers = String::new();
+        modifiers.push(if self.loose { 'l' } else { '-' });
+        modifiers.push(if self.mutable { 'm' } else { '-' });
+        modifiers.push(if self.runtime { 'r' } else { '-' });
+        if let Some(output) = &self.output {
+            modifiers.push(':');
+            modifiers.push_str(output);
+        }
+        modifiers
+    }
+}
+
+impl ConfigNamespace {
+    pub fn name(&self) -> &'static str {
+        match &self {
             ConfigNamespace::Source(_) => "source",
             ConfigNamespace::Package(_) => "package",
             ConfigNamespace::Tool(_) => "tool",
             ConfigNamespace::Custom(_) => "custom",
-        };
+        }
+    }
+}
 
-        write!(f, "{}", namespace)
+impl Display for ConfigNamespace {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}", self.name())
     }
 }
 
@@ -120,33 +190,41 @@ macro_rules! expect_frag {
 }
 
 macro_rules! try_consume_field {
-    ($fields:expr, $field:literal, $frag_pat:pat => $frag_expr:expr) => {{
-        let mut value = None;
-        for field in $fields {
-            if *field.0 != $field {
-                continue;
-            }
-
-            value = Some(expect_frag!(field.1.0.deref(), $frag_pat => $frag_expr));
-            field.1.1 = true;
+    ($field:expr, $frag_pat:pat => $frag_expr:expr) => {
+        match $field {
+            None => None,
+            Some(frag) => Some(expect_frag!(frag, $frag_pat => $frag_expr)),
         }
-        value
-    }};
+    };
 }
 
 macro_rules! consume_field {
-    ($fields:expr, $field:literal, $frag_pat:pat => $frag_expr:expr) => {
-        match try_consume_field!($fields, $field, $frag_pat => $frag_expr) {
-            None => bail!("Missing field `{}`", $field),
-            Some(value) => value
+    ($field:expr, $name:literal, $frag_pat:pat => $frag_expr:expr) => {
+        match $field {
+            None => bail!("Missing field `{}`", $name),
+            Some(frag) => expect_frag!(frag, $frag_pat => $frag_expr),
         }
     };
 }
 
-fn parse_bool_string(str: Option<&String>) -> Result<bool> {
+// Splits the fields of an object into `keys` in a single pass over the object, any other field is rejected
+fn take_fields<'f, 'a, const N: usize>(arena: &'f ConfigArena<'a>, frag: &ConfigFragment<'a>, keys: [&str; N]) -> Result<[Option<&'f ConfigFragment<'a>>; N]> {
+    let fields = expect_frag!(frag, ConfigFragment::Object(fields) => *fields);
+
+    let mut values = [None; N];
+    for (key, value) in arena.object(fields) {
+        match keys.iter().position(|candidate| *candidate == key) {
+            None => bail!("Unknown field `{}`", key),
+            Some(index) => values[index] = Some(value),
+        }
+    }
+    Ok(values)
+}
+
+fn parse_bool_string(str: Option<&str>) -> Result<bool> {
     match str {
         None => Ok(false),
-        Some(str) => match str.as_str() {
+        Some(str) => match str {
             "yes" | "true" => Ok(true),
             "no" | "false" => Ok(false),
             _ => bail!("Value `{}` is not a valid boolean", str),
@@ -154,15 +232,106 @@ fn parse_bool_string(str: Option<&String>) -> Result<bool> {
     }
 }
 
+fn parse_post_install(arena: &ConfigArena, frag: &ConfigFragment) -> Result<ConfigPostInstall> {
+    let [strip, compress_man, prune] = take_fields(arena, frag, ["strip", "compress_man", "prune"])?;
+
+    let strip = try_consume_field!(strip, ConfigFragment::String(v) => *v);
+    let compress_man = try_consume_field!(compress_man, ConfigFragment::String(v) => *v);
+    let prune = match try_consume_field!(prune, ConfigFragment::List(v) => *v) {
+        None => None,
+        Some(patterns) => {
+            let mut prune = Vec::new();
+            for pattern in arena.list(patterns) {
+                let pattern = expect_frag!(pattern, ConfigFragment::String(v) => *v);
+                Pattern::new(pattern).with_context(|| format!("Invalid prune pattern `{}`", pattern))?;
+                prune.push(pattern.to_string());
+            }
+            Some(prune)
+        }
+    };
+
+    Ok(ConfigPostInstall {
+        strip: match strip {
+            None => None,
+            Some(strip) => Some(parse_bool_string(Some(strip))?),
+        },
+        compress_man: match compress_man {
+            None => None,
+            Some(compress_man) => Some(parse_bool_string(Some(compress_man))?),
+        },
+        prune,
+    })
+}
+
+fn parse_prebuilt(arena: &ConfigArena, frag: &ConfigFragment) -> Result<ConfigPrebuilt> {
+    let [url, path, b2sum] = take_fields(arena, frag, ["url", "path", "b2sum"])?;
+
+    let url = try_consume_field!(url, ConfigFragment::String(v) => v.to_string());
+    let path = try_consume_field!(path, ConfigFragment::String(v) => v.to_string());
+    let b2sum = try_consume_field!(b2sum, ConfigFragment::String(v) => v.to_string());
+
+    Ok(match (url, path) {
+        (Some(url), None) => ConfigPrebuilt::Url {
+            url,
+            b2sum: b2sum.ok_or(anyhow!("Missing field `b2sum`"))?,
+        },
+        (None, Some(path)) => ConfigPrebuilt::Path { path, b2sum },
+        _ => bail!("Exactly one of `url` and `path` is required"),
+    })
+}
+
 impl Config {
-    pub fn parse(path: impl AsRef<Path>, overrides: HashMap<String, String>) -> Result<Rc<Config>> {
+    // With a scope only the closure of the selected recipes is resolved and validated, global directives are always evaluated
+    pub fn parse(path: impl AsRef<Path>, overrides: HashMap<String, String>, scope: Option<&[String]>) -> Result<(Config, ConfigInputs)> {
         let mut id_counter: ConfigRecipeId = 0;
         let mut global_env: HashMap<String, String> = HashMap::new();
-        let mut collections: HashMap<String, (Vec<(String, String, bool, bool, bool, bool)>, Vec<ConfigImageDependency>, Vec<String>)> = HashMap::new();
+        let mut collections: HashMap<String, (Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>, Vec<String>)> = HashMap::new();
         let mut options: HashMap<String, Vec<String>> = HashMap::new();
         let mut global_pkgs: Vec<String> = Vec::new();
+        let mut global_post_install: Option<ConfigPostInstall> = None;
+
+        let (mut files, children) = load_files(path.as_ref())?;
 
-        let mut recipes_deps = parse_file(path, &mut id_counter, &mut global_env, &mut collections, &mut options, &mut global_pkgs)?;
+        let mut inputs = ConfigInputs::default();
+        for file in files.iter().flatten().flatten() {
+            let (path, size, mtime, hash) = &file.source;
+            inputs.files.insert(path.clone(), (*size, *mtime, *hash));
+            for directive in file.directives.iter().flatten() {
+                if let ConfigDirective::Import(_, pattern, imports) = directive {
+                    inputs.imports.insert(pattern.clone(), imports.clone());
+                }
+            }
+        }
+
+        let mut recipes_deps = merge_file(
+            &mut files,
+            &children,
+            0,
+            &mut id_counter,
+            &mut global_env,
+            &mut collections,
+            &mut options,
+            &mut global_pkgs,
+            &mut global_post_install,
+        )?;
+
+        if let Some(scope) = scope {
+            recipes_deps = scope_recipes(recipes_deps, &collections, scope);
+        }
+
+        // Apply global post-install defaults to packages and tools
+        if let Some(global_post_install) = &global_post_install {
+            for recipe in recipes_deps.iter_mut() {
+                if let ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) = &mut recipe.0.namespace {
+                    let post_install = &mut common.post_install;
+                    post_install.strip = post_install.strip.or(global_post_install.strip);
+                    post_install.compress_man = post_install.compress_man.or(global_post_install.compress_man);
+                    if post_install.prune.is_none() {
+                        post_install.prune = global_post_install.prune.clone();
+                    }
+                }
+            }
+        }
 
         for recipe in recipes_deps.iter_mut() {
             match &mut recipe.0.namespace {
@@ -178,63 +347,67 @@ impl Config {
             }
         }
 
+        // Every collection is flattened at most once, recipes copy the flattened dependencies in the same order the old stack based expansion produced
+        let mut flattened: HashMap<String, (Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>)> = HashMap::new();
         for recipe in recipes_deps.iter_mut() {
-            let mut to_append = recipe.2.clone();
-            while let Some(collection) = to_append.pop() {
-                if !collections.contains_key(&collection) {
+            for collection in recipe.2.iter().rev() {
+                if !collections.contains_key(collection) {
                     bail!("Unknown collection `{}` dependency on `{}`", collection, recipe.0);
                 }
 
-                let collection = &collections[&collection];
-                recipe.1.append(&mut collection.0.clone());
-                recipe.0.image_dependencies.append(&mut collection.1.clone());
-                to_append.append(&mut collection.2.clone());
+                flatten_collection(collection, &collections, &mut flattened, &mut Vec::new())?;
+                let (deps, image_deps) = &flattened[collection];
+                recipe.1.extend_from_slice(deps);
+                recipe.0.image_dependencies.extend_from_slice(image_deps);
             }
         }
 
-        let mut dependency_map: HashMap<ConfigRecipeId, Vec<ConfigRecipeDependency>> = HashMap::new();
+        let mut recipe_index: HashMap<(&str, &str), usize> = HashMap::with_capacity(recipes_deps.len());
+        let mut duplicates: Vec<bool> = Vec::with_capacity(recipes_deps.len());
+        for (index, recipe) in recipes_deps.iter().enumerate() {
+            let key = (recipe.0.namespace.name(), recipe.0.name.as_str());
+            duplicates.push(recipe_index.contains_key(&key));
+            recipe_index.entry(key).or_insert(index);
+        }
+
+        let mut dependency_map: Vec<Vec<ConfigRecipeDependency>> = Vec::with_capacity(recipes_deps.len());
         for recipe in recipes_deps.iter() {
-            let mut deps: Vec<ConfigRecipeDependency> = Vec::new();
+            let mut deps: Vec<ConfigRecipeDependency> = Vec::with_capacity(recipe.1.len());
 
             for dep in recipe.1.iter() {
-                let mut found = false;
-                for dep_recipe in recipes_deps.iter() {
-                    if dep_recipe.0.name != dep.1 {
-                        continue;
-                    }
+                let dep_recipe = match recipe_index.get(&(dep.0.as_str(), dep.1.as_str())) {
+                    None => bail!("Unknown dependency `{}/{}`", dep.0, dep.1),
+                    Some(index) => &recipes_deps[*index].0,
+                };
 
-                    if !match dep_recipe.0.namespace {
-                        ConfigNamespace::Source(_) => dep.0 == "source",
-                        ConfigNamespace::Custom(_) => dep.0 == "custom",
-                        ConfigNamespace::Package(_) => dep.0 == "package",
-                        ConfigNamespace::Tool(_) => dep.0 == "tool",
-                    } {
-                        continue;
-                    }
+                if dep.3 && !matches!(dep_recipe.namespace, ConfigNamespace::Source(_)) {
+                    bail!("Mutable modifier only valid for sources, used on non-source in recipe `{}`", recipe.0);
+                }
 
-                    if dep.3 && !matches!(dep_recipe.0.namespace, ConfigNamespace::Source(_)) {
-                        bail!("Mutable modifier only valid for sources, used on non-source in recipe `{}`", recipe.0);
+                if let Some(output) = &dep.6 {
+                    if !dep_recipe.has_output(output) {
+                        bail!("Unknown output `{}` of `{}` used in recipe `{}`", output, dep_recipe, recipe.0);
                     }
-
-                    deps.push(ConfigRecipeDependency {
-                        recipe_id: dep_recipe.0.id,
-                        runtime: dep.2,
-                        mutable: dep.3,
-                        loose: dep.4,
-                        optional: dep.5,
-                    });
-                    found = true;
-                    break;
                 }
 
-                if !found {
-                    bail!("Unknown dependency `{}/{}`", dep.0, dep.1);
-                }
+                deps.push(ConfigRecipeDependency {
+                    recipe_id: dep_recipe.id,
+                    runtime: dep.2,
+                    mutable: dep.3,
+                    loose: dep.4,
+                    optional: dep.5,
+                    output: dep.6.clone(),
+                });
             }
 
-            dependency_map.insert(recipe.0.id, deps);
+            dependency_map.push(deps);
         }
 
+        let recipe_ids: HashMap<String, ConfigRecipeId> = recipe_index
+            .iter()
+            .map(|((namespace, name), index)| (format!("{}/{}", namespace, name), recipes_deps[*index].0.id))
+            .collect();
+
         for option in &options {
             for ch in option.0.chars() {
                 if !ch.is_alphanumeric() {
@@ -247,8 +420,8 @@ impl Config {
             }
         }
 
-        let mut recipes: HashMap<ConfigRecipeId, ConfigRecipe> = HashMap::new();
-        for recipe in recipes_deps.into_iter() {
+        let mut recipes: Vec<ConfigRecipe> = Vec::with_capacity(recipes_deps.len());
+        for (recipe, duplicate) in recipes_deps.into_iter().zip(duplicates) {
             for option in recipe.0.used_options.iter() {
                 if !options.contains_key(option.0) {
                     bail!("Recipe `{}` uses unknown option `{}`", recipe.0, option.0);
@@ -263,262 +436,759 @@ impl Config {
                 }
             }
 
-            for recipe_other in recipes.iter() {
-                if recipe_other.1.namespace.to_string() != recipe.0.namespace.to_string() {
-                    continue;
-                }
-
-                if recipe_other.1.name != recipe.0.name {
-                    continue;
-                }
-
+            if duplicate {
                 bail!("Recipe `{}` defined more than once", recipe.0.name);
             }
 
-            recipes.insert(recipe.0.id, recipe.0);
+            // Ids are handed out in merge order, which is also the order of `recipes_deps`
+            debug_assert_eq!(recipe.0.id as usize, recipes.len());
+            recipes.push(recipe.0);
         }
 
-        let mut options_map: HashMap<ConfigRecipeId, BTreeSet<String>> = HashMap::new();
-        for recipe in recipes.iter() {
-            resolve_inherited_options(&mut options_map, &recipes, &dependency_map, *recipe.0);
-        }
+        let mut options: Vec<(String, Vec<String>)> = options.into_iter().collect();
+        options.sort_by(|a, b| a.0.cmp(&b.0));
+        let (option_names, options): (Vec<String>, Vec<Vec<String>>) = options.into_iter().unzip();
+
+        let option_words = option_names.len().div_ceil(64);
+        let options_map = resolve_inherited_options(&recipes, &dependency_map, &option_names, option_words);
 
-        Ok(Rc::new(Config {
+        let config = Config {
             global_env,
             recipes,
+            recipe_ids,
             dependency_map,
-            options_map,
+            option_names,
             options,
+            options_map,
+            option_words,
             global_pkgs,
-        }))
+        };
+
+        // A single archive cannot stand in for every option variant of a recipe, including the variants its dependencies introduce
+        for recipe in &config.recipes {
+            if let ConfigNamespace::Package(ConfigRecipeCommon { prebuilt: Some(_), .. })
+            | ConfigNamespace::Tool(ConfigRecipeCommon { prebuilt: Some(_), .. })
+            | ConfigNamespace::Custom(ConfigRecipeCommon { prebuilt: Some(_), .. }) = &recipe.namespace
+            {
+                if let Some(option) = config.recipe_options(recipe.id).next() {
+                    bail!("Recipe `{}` cannot have a prebuilt, it is built with the option `{}`", recipe, option);
+                }
+            }
+        }
+
+        Ok((config, inputs))
+    }
+
+    pub fn recipe_id(&self, namespace: &str, name: &str) -> Option<ConfigRecipeId> {
+        self.recipe_ids.get(&format!("{}/{}", namespace, name)).copied()
+    }
+
+    pub fn recipe(&self, recipe_id: ConfigRecipeId) -> &ConfigRecipe {
+        &self.recipes[recipe_id as usize]
+    }
+
+    pub fn dependencies(&self, recipe_id: ConfigRecipeId) -> &[ConfigRecipeDependency] {
+        &self.dependency_map[recipe_id as usize]
+    }
+
+    pub fn option_id(&self, option: &str) -> Option<ConfigOptionId> {
+        self.option_names.binary_search_by(|name| name.as_str().cmp(option)).ok().map(|id| id as ConfigOptionId)
+    }
+
+    // Options used by the recipe or any of its dependencies, in sorted order
+    pub fn recipe_options(&self, recipe_id: ConfigRecipeId) -> impl Iterator<Item = &str> {
+        let bits = &self.options_map[recipe_id as usize * self.option_words..(recipe_id as usize + 1) * self.option_words];
+        self.option_names
+            .iter()
+            .enumerate()
+            .filter(|(bit, _)| bits[bit / 64] & (1 << (bit % 64)) != 0)
+            .map(|(_, name)| name.as_str())
+    }
+
+    pub fn recipe_has_option(&self, recipe_id: ConfigRecipeId, option: &str) -> bool {
+        match self.option_id(option) {
+            None => false,
+            Some(bit) => self.options_map[recipe_id as usize * self.option_words + bit as usize / 64] & (1 << (bit % 64)) != 0,
+        }
+    }
+
+    // The serialized fields of a recipe that its hash covers. The base fields concatenate to the serialized recipe as it was before post_install,
+    // outputs and prebuilts existed, so recipes that leave those at their defaults keep their hash. Those fields are only hashed when set, prefixed by their name.
+    // The check script only decides whether the recipe passes its tests, editing it does not change what the recipe installs.
+    pub fn recipe_hash_fields(&self, recipe_id: ConfigRecipeId) -> Result<Vec<(&'static str, Vec<u8>)>> {
+        fn field(name: &'static str, value: &impl Serialize) -> Result<(&'static str, Vec<u8>)> {
+            Ok((name, postcard::to_allocvec(value).with_context(|| format!("Failed to serialize recipe field `{}`", name))?))
+        }
+
+        let recipe = self.recipe(recipe_id);
+        let mut fields = Vec::new();
+        match &recipe.namespace {
+            ConfigNamespace::Source(source) => {
+                // Enum variants are serialized as their index
+                fields.push(field("namespace", &0_u32)?);
+                fields.push(field("url", &source.url)?);
+                fields.push(field("patch", &source.patch)?);
+                fields.push(field("kind", &source.kind)?);
+                fields.push(field("regenerate", &source.regenerate)?);
+            }
+            ConfigNamespace::Custom(common) | ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) => {
+                let variant: u32 = match &recipe.namespace {
+                    ConfigNamespace::Custom(_) => 1,
+                    ConfigNamespace::Package(_) => 2,
+                    _ => 3,
+                };
+                fields.push(field("namespace", &variant)?);
+                fields.push(field("always_clean", &common.always_clean)?);
+                fields.push(field("configure", &common.configure)?);
+                fields.push(field("build", &common.build)?);
+                fields.push(field("install", &common.install)?);
+            }
+        }
+        fields.push(field("name", &recipe.name)?);
+        // Sorted, the iteration order of the map differs between runs
+        fields.push(field("options", &BTreeMap::from_iter(recipe.used_options.iter()))?);
+        fields.push(field("image_dependencies", &recipe.image_dependencies)?);
+
+        if let ConfigNamespace::Custom(common) | ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) = &recipe.namespace {
+            if common.post_install != ConfigPostInstall::default() {
+                fields.push(field("post_install", &("post_install", &common.post_install))?);
+            }
+            if !common.outputs.is_empty() {
+                fields.push(field("outputs", &("outputs", &common.outputs))?);
+            }
+            if let Some(prebuilt) = &common.prebuilt {
+                fields.push(field("prebuilt", &("prebuilt", prebuilt))?);
+            }
+        }
+        Ok(fields)
+    }
+
+    // Hashes the recipe definition together with its dependency edges, the state of local sources is up to the caller to add
+    pub fn recipe_hasher(&self, recipe_id: ConfigRecipeId) -> Result<Hasher> {
+        let mut hasher = Hasher::new();
+        for (_, data) in self.recipe_hash_fields(recipe_id)? {
+            hasher.update(&data);
+        }
+
+        for dep in self.dependencies(recipe_id) {
+            hasher.update(dep.modifiers().as_bytes());
+
+            let dep_recipe = self.recipe(dep.recipe_id);
+            hasher.update(dep_recipe.to_string().as_bytes());
+        }
+
+        Ok(hasher)
     }
 }
 
-fn resolve_inherited_options(
-    options_map: &mut HashMap<ConfigRecipeId, BTreeSet<String>>,
-    recipes: &HashMap<ConfigRecipeId, ConfigRecipe>,
-    dependency_map: &HashMap<ConfigRecipeId, Vec<ConfigRecipeDependency>>,
-    recipe_id: ConfigRecipeId,
-) -> BTreeSet<String> {
-    if let Some(value) = options_map.get(&recipe_id) {
-        return value.clone();
+// Keeps the recipes reachable from the `namespace/name` selectors in `scope` and renumbers them densely in their original order.
+// Unknown selectors and dependencies are skipped here, the latter are reported when the kept recipes are resolved.
+fn scope_recipes(
+    recipes_deps: Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<String>)>,
+    collections: &HashMap<String, (Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>, Vec<String>)>,
+    scope: &[String],
+) -> Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<String>)> {
+    // Duplicate definitions are all kept so the duplicate check still sees them
+    let mut recipe_index: HashMap<(&str, &str), Vec<usize>> = HashMap::with_capacity(recipes_deps.len());
+    for (index, recipe) in recipes_deps.iter().enumerate() {
+        recipe_index.entry((recipe.0.namespace.name(), recipe.0.name.as_str())).or_default().push(index);
     }
 
-    let mut inherited_opts: BTreeSet<String> = BTreeSet::from_iter(recipes[&recipe_id].used_options.iter().map(|v| v.0.clone()).collect::<Vec<String>>());
-    for dep in &dependency_map[&recipe_id] {
-        inherited_opts.append(&mut resolve_inherited_options(options_map, recipes, dependency_map, dep.recipe_id));
+    let mut reachable: Vec<bool> = vec![false; recipes_deps.len()];
+    let mut visited_collections: Vec<&str> = Vec::new();
+    let mut pending: Vec<(&str, &str)> = scope.iter().filter_map(|selector| selector.split_once('/')).collect();
+    let mut pending_collections: Vec<&str> = Vec::new();
+    loop {
+        if let Some(collection) = pending_collections.pop() {
+            if visited_collections.contains(&collection) {
+                continue;
+            }
+            visited_collections.push(collection);
+
+            if let Some((deps, _, nested)) = collections.get(collection) {
+                pending.extend(deps.iter().map(|dep| (dep.0.as_str(), dep.1.as_str())));
+                pending_collections.extend(nested.iter().map(|nested| nested.as_str()));
+            }
+            continue;
+        }
+
+        let key = match pending.pop() {
+            None => break,
+            Some(key) => key,
+        };
+
+        for index in recipe_index.get(&key).into_iter().flatten() {
+            if reachable[*index] {
+                continue;
+            }
+            reachable[*index] = true;
+
+            let recipe = &recipes_deps[*index];
+            pending.extend(recipe.1.iter().map(|dep| (dep.0.as_str(), dep.1.as_str())));
+            pending_collections.extend(recipe.2.iter().map(|collection| collection.as_str()));
+        }
     }
 
-    options_map.insert(recipe_id, inherited_opts.clone());
+    let mut scoped = Vec::new();
+    for (mut recipe, reachable) in recipes_deps.into_iter().zip(reachable) {
+        if !reachable {
+            continue;
+        }
 
-    return inherited_opts;
+        recipe.0.id = scoped.len() as ConfigRecipeId;
+        scoped.push(recipe);
+    }
+    scoped
 }
 
-fn parse_file(
-    path: impl AsRef<Path>,
-    id_counter: &mut ConfigRecipeId,
-    global_env: &mut HashMap<String, String>,
-    collections: &mut HashMap<String, (Vec<(String, String, bool, bool, bool, bool)>, Vec<ConfigImageDependency>, Vec<String>)>,
-    options: &mut HashMap<String, Vec<String>>,
-    global_pkgs: &mut Vec<String>,
-) -> Result<Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool)>, Vec<String>)>> {
-    let data: String = read_to_string(&path).context("Config read failed")?;
+fn flatten_collection(
+    name: &str,
+    collections: &HashMap<String, (Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>, Vec<String>)>,
+    flattened: &mut HashMap<String, (Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>)>,
+    visiting: &mut Vec<String>,
+) -> Result<()> {
+    if flattened.contains_key(name) {
+        return Ok(());
+    }
 
-    let tokens = &mut lexer::lex(data.as_str())?;
+    if visiting.iter().any(|collection| collection == name) {
+        bail!("Collection `{}` includes itself", name);
+    }
+    visiting.push(name.to_string());
 
-    let mut definitions: Vec<ConfigFragment> = Vec::new();
-    let mut directives: Vec<ConfigFragment> = Vec::new();
-    for frag in parse_config(tokens)? {
-        match frag {
-            ConfigFragment::Directive { name: _, value: _ } => directives.push(frag),
-            frag => definitions.push(expect_frag!(frag, ConfigFragment::Definition { key: _, value: _ } => frag)),
+    let (deps, image_deps, nested) = &collections[name];
+    let (mut deps, mut image_deps) = (deps.clone(), image_deps.clone());
+    for collection in nested.iter().rev() {
+        if !collections.contains_key(collection) {
+            bail!("Unknown collection `{}` dependency on collection `{}`", collection, name);
         }
+
+        flatten_collection(collection, collections, flattened, visiting)?;
+        deps.extend_from_slice(&flattened[collection].0);
+        image_deps.extend_from_slice(&flattened[collection].1);
     }
 
-    let parse_dependencies = |dependencies: &Vec<ConfigFragment>, helpstr: String| -> Result<(Vec<(String, String, bool, bool, bool, bool)>, Vec<ConfigImageDependency>, Vec<String>)> {
-        let mut recipe_deps: Vec<(String, String, bool, bool, bool, bool)> = Vec::new();
-        let mut image_deps: Vec<ConfigImageDependency> = Vec::new();
-        let mut collection_deps: Vec<String> = Vec::new();
+    visiting.pop();
+    flattened.insert(name.to_string(), (deps, image_deps));
+    Ok(())
+}
 
-        for dependency in dependencies {
-            let mut runtime = false;
-            let mut mutable = false;
-            let mut loose = false;
-            let mut optional = false;
-
-            let mut dep = dependency;
-            loop {
-                dep = match dep {
-                    ConfigFragment::Unary { operation: '*', value: frag } => {
-                        if runtime {
-                            bail!("Unary `*` defined more than once for dependency in {}", helpstr)
-                        }
-                        runtime = true;
-                        frag.deref()
+// Options are resolved as bitsets in dependency order, so shared dependencies are only merged once per edge
+fn resolve_inherited_options(recipes: &Vec<ConfigRecipe>, dependency_map: &Vec<Vec<ConfigRecipeDependency>>, option_names: &Vec<String>, words: usize) -> Vec<u64> {
+    let mut bitsets: Vec<u64> = vec![0; recipes.len() * words];
+    let mut visited: Vec<bool> = vec![false; recipes.len()];
+    let mut resolved: Vec<bool> = vec![false; recipes.len()];
+    let mut stack: Vec<(ConfigRecipeId, bool)> = Vec::new();
+    for root in 0..recipes.len() as ConfigRecipeId {
+        stack.push((root, false));
+        while let Some((recipe_id, expanded)) = stack.pop() {
+            let index = recipe_id as usize;
+            if expanded {
+                for option in recipes[index].used_options.keys() {
+                    let bit = option_names.binary_search(option).expect("option validated before resolution");
+                    bitsets[index * words + bit / 64] |= 1 << (bit % 64);
+                }
+                for dep in &dependency_map[index] {
+                    let dep_index = dep.recipe_id as usize;
+                    if !resolved[dep_index] {
+                        continue;
                     }
-                    ConfigFragment::Unary { operation: '%', value: frag } => {
-                        if mutable {
-                            bail!("Unary `%` defined more than once for dependency in {}", helpstr)
-                        }
-                        mutable = true;
-                        frag.deref()
+                    for word in 0..words {
+                        bitsets[index * words + word] |= bitsets[dep_index * words + word];
                     }
-                    ConfigFragment::Unary { operation: '!', value: frag } => {
-                        if loose {
-                            bail!("Unary `!` defined more than once for dependency in {}", helpstr)
-                        }
-                        loose = true;
-                        frag.deref()
-                    }
-                    ConfigFragment::Unary { operation: '?', value: frag } => {
-                        if optional {
-                            bail!("Unary `?` defined more than once for dependency in {}", helpstr)
+                }
+                resolved[index] = true;
+                continue;
+            }
+
+            if visited[index] {
+                continue;
+            }
+            visited[index] = true;
+
+            stack.push((recipe_id, true));
+            for dep in &dependency_map[index] {
+                if !visited[dep.recipe_id as usize] {
+                    stack.push((dep.recipe_id, false));
+                }
+            }
+        }
+    }
+    bitsets
+}
+
+struct ConfigFile {
+    source: (PathBuf, u64, (i64, i64), [u8; 32]),
+    directives: Vec<Result<ConfigDirective>>,
+    recipes: Result<Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<String>)>>,
+}
+
+enum ConfigDirective {
+    Import(String, String, Vec<PathBuf>),
+    Env(String, String),
+    Collection(String, (Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>, Vec<String>)),
+    Option(String, Vec<String>),
+    GlobalPkg(Vec<String>),
+    PostInstall(ConfigPostInstall),
+}
+
+// Loads the root config and everything it imports, one import level at a time with the files of a level parsed in parallel.
+// Files are stored in discovery order, the imports of a file occupy a contiguous run of slots starting at `children[file]`.
+fn load_files(path: &Path) -> Result<(Vec<Option<Result<ConfigFile>>>, Vec<usize>)> {
+    let mut paths: Vec<PathBuf> = vec![path.to_path_buf()];
+    let mut parents: Vec<Option<usize>> = vec![None];
+    let mut files: Vec<Option<Result<ConfigFile>>> = Vec::new();
+    let mut children: Vec<usize> = Vec::new();
+
+    let parallelism = available_parallelism().map(|v| v.get()).unwrap_or(1);
+    let mut level_start = 0;
+    while level_start < paths.len() {
+        let level_end = paths.len();
+        let level = &paths[level_start..level_end];
+
+        let chunk_size = level.len().div_ceil(parallelism).max(1);
+        let mut parsed = thread::scope(|scope| {
+            let mut handles = Vec::new();
+            for chunk in level.chunks(chunk_size) {
+                handles.push(scope.spawn(move || chunk.iter().map(|path| parse_file(path)).collect::<Vec<Result<ConfigFile>>>()));
+            }
+
+            let mut parsed = Vec::new();
+            for handle in handles {
+                parsed.append(&mut handle.join().expect("config parsing panicked"));
+            }
+            parsed
+        });
+
+        for (index, file) in (level_start..level_end).zip(parsed.iter_mut()) {
+            if import_cycle(&paths, &parents, index) {
+                *file = Err(anyhow!("Import cycle on `{}`", paths[index].to_string_lossy()));
+            }
+
+            children.push(paths.len());
+            if let Ok(file) = file {
+                for directive in &file.directives {
+                    if let Ok(ConfigDirective::Import(_, _, imports)) = directive {
+                        for import in imports {
+                            paths.push(import.clone());
+                            parents.push(Some(index));
                         }
-                        optional = true;
-                        frag.deref()
                     }
-                    _ => break,
-                };
+                }
             }
+        }
 
-            let (dep_namespace, dep_name) = expect_frag!(dep, ConfigFragment::RecipeRef {namespace, name} => (namespace, name));
-            match dep_namespace.as_str() {
-                "image" => {
-                    if mutable {
-                        bail!("Image dependency cannot be mutable (`{}` on {})", dep_name, helpstr);
-                    }
-                    if loose {
-                        bail!("Image dependency cannot be loose (`{}` on {})", dep_name, helpstr);
-                    }
-                    image_deps.push(ConfigImageDependency { package: dep_name.clone(), runtime })
+        files.extend(parsed.into_iter().map(Some));
+        level_start = level_end;
+    }
+
+    Ok((files, children))
+}
+
+fn import_cycle(paths: &[PathBuf], parents: &[Option<usize>], index: usize) -> bool {
+    let path = canonicalize(&paths[index]).unwrap_or(paths[index].clone());
+
+    let mut parent = parents[index];
+    while let Some(ancestor) = parent {
+        if canonicalize(&paths[ancestor]).unwrap_or(paths[ancestor].clone()) == path {
+            return true;
+        }
+        parent = parents[ancestor];
+    }
+    false
+}
+
+// Applies a loaded file and its imports in the original import order, this is where recipe ids are assigned
+fn merge_file(
+    files: &mut Vec<Option<Result<ConfigFile>>>,
+    children: &[usize],
+    index: usize,
+    id_counter: &mut ConfigRecipeId,
+    global_env: &mut HashMap<String, String>,
+    collections: &mut HashMap<String, (Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>, Vec<String>)>,
+    options: &mut HashMap<String, Vec<String>>,
+    global_pkgs: &mut Vec<String>,
+    global_post_install: &mut Option<ConfigPostInstall>,
+) -> Result<Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<String>)>> {
+    let file = files[index].take().expect("config file merged more than once")?;
+
+    let mut recipes_deps: Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<String>)> = Vec::new();
+    let mut child = children[index];
+    for directive in file.directives {
+        match directive? {
+            ConfigDirective::Import(value, _, imports) => {
+                for _ in imports {
+                    recipes_deps.append(
+                        &mut merge_file(files, children, child, id_counter, global_env, collections, options, global_pkgs, global_post_install)
+                            .with_context(|| format!("Failed to import \"{}\"", value))?,
+                    );
+                    child += 1;
+                }
+            }
+            ConfigDirective::Env(key, value) => {
+                global_env.insert(key, value);
+            }
+            ConfigDirective::Collection(name, dependencies) => {
+                collections.insert(name, dependencies);
+            }
+            ConfigDirective::Option(key, allowed_values) => {
+                if options.contains_key(&key) {
+                    bail!("Option `{}` defined more than once", key);
                 }
-                "collection" => {
-                    if mutable || runtime || loose {
-                        bail!("Cannot apply modifiers to collection dependencies (`{}` on {}`)", dep_name, helpstr);
+                options.insert(key, allowed_values);
+            }
+            ConfigDirective::GlobalPkg(pkgs) => {
+                for pkg in pkgs {
+                    if global_pkgs.contains(&pkg) {
+                        bail!("Global package `{}` declared more than once", pkg);
                     }
-                    collection_deps.push(dep_name.clone());
+                    global_pkgs.push(pkg);
+                }
+            }
+            ConfigDirective::PostInstall(post_install) => {
+                if global_post_install.is_some() {
+                    bail!("Global post_install defined more than once");
                 }
-                dep_namespace => recipe_deps.push((dep_namespace.to_string(), dep_name.clone(), runtime, mutable, loose, optional)),
+                *global_post_install = Some(post_install);
             }
         }
-        Ok((recipe_deps, image_deps, collection_deps))
+    }
+
+    for mut recipe in file.recipes? {
+        recipe.0.id = *id_counter;
+        *id_counter += 1;
+        recipes_deps.push(recipe);
+    }
+    Ok(recipes_deps)
+}
+
+// Reads and parses a single file without touching any global state so files can be parsed on any thread
+fn parse_file(path: &Path) -> Result<ConfigFile> {
+    // Stat before reading so a concurrent edit can never be recorded with the old contents
+    let meta = metadata(path).context("Config read failed")?;
+    let data: String = read_to_string(path).context("Config read failed")?;
+
+    let tokens = &mut lexer::lex(data.as_str()).with_context(|| format!("Failed to lex `{}`", path.to_string_lossy()))?;
+
+    // The fragments borrow from `data`, strings are only copied out once a recipe is materialized
+    let (arena, fragments) = parse_config(tokens).with_context(|| format!("Failed to parse `{}`", path.to_string_lossy()))?;
+
+    let mut definitions: Vec<&ConfigFragment> = Vec::new();
+    let mut directives: Vec<&ConfigFragment> = Vec::new();
+    for frag in fragments {
+        match arena.get(frag) {
+            frag @ ConfigFragment::Directive { name: _, value: _ } => directives.push(frag),
+            frag => definitions.push(expect_frag!(frag, ConfigFragment::Definition { key: _, value: _ } => frag)),
+        }
+    }
+
+    // Errors are kept in place so they surface in the same order as a serial walk of the imports would report them
+    let mut file = ConfigFile {
+        source: (path.to_path_buf(), meta.len(), (meta.mtime(), meta.mtime_nsec()), *blake3::hash(data.as_bytes()).as_bytes()),
+        directives: Vec::new(),
+        recipes: Ok(Vec::new()),
     };
+    for directive in directives {
+        let directive = parse_directive(&arena, path, directive);
+        let failed = directive.is_err();
+        file.directives.push(directive);
+        if failed {
+            return Ok(file);
+        }
+    }
 
-    let mut recipes_deps: Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool)>, Vec<String>)> = Vec::new();
-    for directive in directives.iter() {
-        let (name, value) = expect_frag!(directive, ConfigFragment::Directive{name, value} => (name, value));
+    file.recipes = parse_definitions(&arena, definitions);
+    Ok(file)
+}
 
-        match name.as_str() {
-            "import" => {
-                let value = expect_frag!(value.deref(), ConfigFragment::String(v) => v);
+fn parse_directive(arena: &ConfigArena, path: &Path, directive: &ConfigFragment) -> Result<ConfigDirective> {
+    let (name, value) = expect_frag!(directive, ConfigFragment::Directive{name, value} => (*name, arena.get(*value)));
 
-                match path.as_ref().parent() {
-                    Some(parent) => {
-                        for entry in glob(parent.join(value).to_str().unwrap())?.into_iter() {
-                            recipes_deps.append(&mut parse_file(entry?, id_counter, global_env, collections, options, global_pkgs).with_context(|| format!("Failed to import \"{}\"", value))?);
-                        }
+    Ok(match name {
+        "import" => {
+            let value = expect_frag!(value, ConfigFragment::String(v) => *v);
+
+            match path.parent() {
+                Some(parent) => {
+                    let pattern = parent.join(value).to_str().unwrap().to_string();
+                    let mut imports = Vec::new();
+                    for entry in glob(&pattern)?.into_iter() {
+                        imports.push(entry?);
                     }
-                    None => bail!("Failed to import \"{}\"", value),
+                    ConfigDirective::Import(value.to_string(), pattern, imports)
                 }
+                None => bail!("Failed to import \"{}\"", value),
+            }
+        }
+        "env" => {
+            let (op, left, right) = expect_frag!(value, ConfigFragment::Binary {operation, left, right} => (*operation, arena.get(*left), arena.get(*right)));
+            if op != '=' {
+                bail!("Unexpected binary operation `{}` in env directive", op);
             }
-            "env" => {
-                let (op, left, right) = expect_frag!(value.deref(), ConfigFragment::Binary {operation, left, right} => (operation, left, right));
-                if *op != '=' {
-                    bail!("Unexpected binary operation `{}` in env directive", op);
-                }
 
-                let key = expect_frag!(left.deref(), ConfigFragment::String(v) => v.to_string());
-                let value = expect_frag!(right.deref(), ConfigFragment::String(v) => v.to_string());
-                global_env.insert(key, value);
+            let key = expect_frag!(left, ConfigFragment::String(v) => v.to_string());
+            let value = expect_frag!(right, ConfigFragment::String(v) => v.to_string());
+            ConfigDirective::Env(key, value)
+        }
+        "collection" => {
+            let (op, left, right) = expect_frag!(value, ConfigFragment::Binary {operation, left, right} => (*operation, arena.get(*left), arena.get(*right)));
+            if op != '=' {
+                bail!("Unexpected binary operation `{}` in collection directive", op);
             }
-            "collection" => {
-                let (op, left, right) = expect_frag!(value.deref(), ConfigFragment::Binary {operation, left, right} => (operation, left, right));
-                if *op != '=' {
-                    bail!("Unexpected binary operation `{}` in collection directive", op);
-                }
 
-                let name = expect_frag!(left.deref(), ConfigFragment::Identifier(v) => v.to_string());
-                collections.insert(
-                    name.clone(),
-                    parse_dependencies(expect_frag!(right.deref(), ConfigFragment::List(v) => v), format!("collection `{}`", name))?,
-                );
+            let name = expect_frag!(left, ConfigFragment::Identifier(v) => v.to_string());
+            let dependencies = parse_dependencies(arena, expect_frag!(right, ConfigFragment::List(v) => *v), format!("collection `{}`", name))?;
+            ConfigDirective::Collection(name, dependencies)
+        }
+        "option" => {
+            let (op, left, right) = expect_frag!(value, ConfigFragment::Binary {operation, left, right} => (*operation, arena.get(*left), arena.get(*right)));
+            if op != '=' {
+                bail!("Unexpected binary operation `{}` in option directive", op);
+            }
+
+            let mut allowed_values: Vec<String> = Vec::new();
+            for value in arena.list(expect_frag!(right, ConfigFragment::List(v) => *v)) {
+                allowed_values.push(expect_frag!(value, ConfigFragment::String(v) => v.to_string()));
             }
-            "option" => {
-                let (op, left, right) = expect_frag!(value.deref(), ConfigFragment::Binary {operation, left, right} => (operation, left, right));
-                if *op != '=' {
-                    bail!("Unexpected binary operation `{}` in option directive", op);
-                }
 
-                let mut allowed_values: Vec<String> = Vec::new();
-                for value in expect_frag!(right.deref(), ConfigFragment::List(v) => v) {
-                    allowed_values.push(expect_frag!(value, ConfigFragment::String(v) => v.to_string()));
+            let key = expect_frag!(left, ConfigFragment::String(v) => v.to_string());
+            ConfigDirective::Option(key, allowed_values)
+        }
+        "global_pkg" => {
+            let pkgs = match value {
+                ConfigFragment::String(pkg) => vec![pkg.to_string()],
+                ConfigFragment::List(pkgs) => {
+                    let mut vec = Vec::new();
+                    for pkg in arena.list(*pkgs) {
+                        vec.push(expect_frag!(pkg, ConfigFragment::String(v) => v.to_string()));
+                    }
+                    vec
                 }
+                frag => bail!("Invalid frag `{}` passed to global_pkg", frag),
+            };
+            ConfigDirective::GlobalPkg(pkgs)
+        }
+        "post_install" => ConfigDirective::PostInstall(parse_post_install(arena, value).context("Invalid global post_install")?),
+        _ => bail!("Unknown directive `{}`", name),
+    })
+}
 
-                let key = expect_frag!(left.deref(), ConfigFragment::String(v) => v.to_string());
-                if options.contains_key(&key) {
-                    bail!("Option `{}` defined more than once", key);
+fn parse_dependencies(
+    arena: &ConfigArena,
+    dependencies: (u32, u32),
+    helpstr: String,
+) -> Result<(Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<ConfigImageDependency>, Vec<String>)> {
+    let mut recipe_deps: Vec<(String, String, bool, bool, bool, bool, Option<String>)> = Vec::new();
+    let mut image_deps: Vec<ConfigImageDependency> = Vec::new();
+    let mut collection_deps: Vec<String> = Vec::new();
+
+    for dependency in arena.list(dependencies) {
+        let mut runtime = false;
+        let mut mutable = false;
+        let mut loose = false;
+        let mut optional = false;
+
+        let mut dep = dependency;
+        loop {
+            dep = match dep {
+                ConfigFragment::Unary { operation: '*', value: frag } => {
+                    if runtime {
+                        bail!("Unary `*` defined more than once for dependency in {}", helpstr)
+                    }
+                    runtime = true;
+                    arena.get(*frag)
                 }
-                options.insert(key, allowed_values);
-            }
-            "global_pkg" => {
-                let pkgs = match value.deref() {
-                    ConfigFragment::String(pkg) => vec![pkg],
-                    ConfigFragment::List(pkgs) => {
-                        let mut vec = Vec::new();
-                        for pkg in pkgs {
-                            vec.push(expect_frag!(pkg, ConfigFragment::String(v) => v));
-                        }
-                        vec
+                ConfigFragment::Unary { operation: '%', value: frag } => {
+                    if mutable {
+                        bail!("Unary `%` defined more than once for dependency in {}", helpstr)
                     }
-                    frag => bail!("Invalid frag `{}` passed to global_pkg", frag),
-                };
-
-                for pkg in pkgs {
-                    if global_pkgs.contains(pkg) {
-                        bail!("Global package `{}` declared more than once", pkg);
+                    mutable = true;
+                    arena.get(*frag)
+                }
+                ConfigFragment::Unary { operation: '!', value: frag } => {
+                    if loose {
+                        bail!("Unary `!` defined more than once for dependency in {}", helpstr)
                     }
-                    global_pkgs.push(pkg.clone());
+                    loose = true;
+                    arena.get(*frag)
+                }
+                ConfigFragment::Unary { operation: '?', value: frag } => {
+                    if optional {
+                        bail!("Unary `?` defined more than once for dependency in {}", helpstr)
+                    }
+                    optional = true;
+                    arena.get(*frag)
+                }
+                _ => break,
+            };
+        }
+
+        let (dep_namespace, dep_name, dep_output) = expect_frag!(dep, ConfigFragment::RecipeRef {namespace, name, output} => (*namespace, *name, *output));
+        if dep_output.is_some() && (dep_namespace == "image" || dep_namespace == "collection" || dep_namespace == "source") {
+            bail!("Output selectors are only valid for package, tool, and custom dependencies (`{}` on {})", dep_name, helpstr);
+        }
+
+        match dep_namespace {
+            "image" => {
+                if mutable {
+                    bail!("Image dependency cannot be mutable (`{}` on {})", dep_name, helpstr);
+                }
+                if loose {
+                    bail!("Image dependency cannot be loose (`{}` on {})", dep_name, helpstr);
                 }
+                image_deps.push(ConfigImageDependency {
+                    package: dep_name.to_string(),
+                    runtime,
+                })
             }
-            _ => bail!("Unknown directive `{}`", name),
+            "collection" => {
+                if mutable || runtime || loose {
+                    bail!("Cannot apply modifiers to collection dependencies (`{}` on {}`)", dep_name, helpstr);
+                }
+                collection_deps.push(dep_name.to_string());
+            }
+            dep_namespace => recipe_deps.push((dep_namespace.to_string(), dep_name.to_string(), runtime, mutable, loose, optional, dep_output.map(|v| v.to_string()))),
         }
     }
+    Ok((recipe_deps, image_deps, collection_deps))
+}
+
+fn parse_definitions(arena: &ConfigArena, definitions: Vec<&ConfigFragment>) -> Result<Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<String>)>> {
+    let mut recipes: Vec<(ConfigRecipe, Vec<(String, String, bool, bool, bool, bool, Option<String>)>, Vec<String>)> = Vec::new();
+    for definition in definitions {
+        let (key, value) = expect_frag!(definition, ConfigFragment::Definition {key, value} => (arena.get(*key), arena.get(*value)));
+
+        let (namespace, name) = expect_frag!(key, ConfigFragment::RecipeRef {namespace, name, output: None} => (*namespace, *name));
+
+        // Fields are sorted into slots in one pass, namespace specific fields are rejected for other namespaces
+        let (namespace_config, dependencies, recipe_options) = match namespace {
+            "source" => {
+                let [dependencies, recipe_options, url, source_type, patch, regenerate, revision, b2sum] =
+                    take_fields(arena, value, ["dependencies", "options", "url", "type", "patch", "regenerate", "revision", "b2sum"])?;
+
+                let url = consume_field!(url, "url", ConfigFragment::String(v) => v.to_string());
+                let source_type = consume_field!(source_type, "type", ConfigFragment::String(v) => *v);
+                let patch = try_consume_field!(patch, ConfigFragment::String(v) => v.to_string());
+                let regenerate = try_consume_field!(regenerate, ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
+
+                let (kind, unused) = match source_type {
+                    "local" => (ConfigSourceKind::Local, [("revision", revision), ("b2sum", b2sum)]),
+                    "git" => (
+                        ConfigSourceKind::Git(consume_field!(revision, "revision", ConfigFragment::String(v) => v.to_string())),
+                        [("b2sum", b2sum), ("", None)],
+                    ),
+                    "tar.gz" => (
+                        ConfigSourceKind::TarGz(consume_field!(b2sum, "b2sum", ConfigFragment::String(v) => v.to_string())),
+                        [("revision", revision), ("", None)],
+                    ),
+                    "tar.xz" => (
+                        ConfigSourceKind::TarXz(consume_field!(b2sum, "b2sum", ConfigFragment::String(v) => v.to_string())),
+                        [("revision", revision), ("", None)],
+                    ),
+                    v => bail!("Unknown source type `{}`", v),
+                };
+                for (field, value) in unused {
+                    if value.is_some() {
+                        bail!("Unknown field `{}`", field);
+                    }
+                }
 
-    for definition in definitions.iter() {
-        let (key, value) = expect_frag!(definition, ConfigFragment::Definition {key, value} => (key, value));
+                (ConfigNamespace::Source(ConfigRecipeSource { url, kind, patch, regenerate }), dependencies, recipe_options)
+            }
+            "package" | "tool" | "custom" => {
+                let [dependencies, recipe_options, configure, build, install, check, always_clean, outputs_field, post_install, prebuilt] = take_fields(
+                    arena,
+                    value,
+                    [
+                        "dependencies",
+                        "options",
+                        "configure",
+                        "build",
+                        "install",
+                        "check",
+                        "always_clean",
+                        "outputs",
+                        "post_install",
+                        "prebuilt",
+                    ],
+                )?;
+
+                let configure = try_consume_field!(configure, ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
+                let build = try_consume_field!(build, ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
+                let install = try_consume_field!(install, ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
+                let check = try_consume_field!(check, ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
+                let always_clean = try_consume_field!(always_clean, ConfigFragment::String(str) => *str);
+                let mut outputs: BTreeMap<String, Vec<String>> = BTreeMap::new();
+                if let Some(fields) = try_consume_field!(outputs_field, ConfigFragment::Object(v) => *v) {
+                    for (output, patterns) in arena.object(fields) {
+                        if output == "runtime" || output == "debug" {
+                            bail!("Output `{}` is reserved (recipe `{}/{}`)", output, namespace, name);
+                        }
 
-        let (namespace, name) = expect_frag!(key.as_ref(), ConfigFragment::RecipeRef {namespace, name} => (namespace, name));
+                        let mut output_patterns = Vec::new();
+                        for pattern in arena.list(expect_frag!(patterns, ConfigFragment::List(v) => *v)) {
+                            let pattern = expect_frag!(pattern, ConfigFragment::String(v) => *v);
+                            Pattern::new(pattern).with_context(|| format!("Invalid pattern `{}` for output `{}`", pattern, output))?;
+                            output_patterns.push(pattern.to_string());
+                        }
+                        outputs.insert(output.to_string(), output_patterns);
+                    }
+                }
 
-        let mut consumable_fields: HashMap<&String, (&Box<ConfigFragment>, bool)> = HashMap::new();
-        for field in expect_frag!(value.as_ref(), ConfigFragment::Object(fields) => fields) {
-            consumable_fields.insert(field.0, (field.1, false));
-        }
+                let post_install = match try_consume_field!(post_install, frag @ ConfigFragment::Object(_) => frag) {
+                    None => ConfigPostInstall::default(),
+                    Some(frag) => parse_post_install(arena, frag).with_context(|| format!("Invalid post_install in recipe `{}/{}`", namespace, name))?,
+                };
 
-        let mut deps: Vec<(String, String, bool, bool, bool, bool)> = Vec::new();
+                let prebuilt = match try_consume_field!(prebuilt, frag @ ConfigFragment::Object(_) => frag) {
+                    None => None,
+                    Some(frag) => Some(parse_prebuilt(arena, frag).with_context(|| format!("Invalid prebuilt in recipe `{}/{}`", namespace, name))?),
+                };
+
+                let common = ConfigRecipeCommon {
+                    always_clean: parse_bool_string(always_clean)?,
+                    configure,
+                    build,
+                    install,
+                    check,
+                    post_install,
+                    outputs,
+                    prebuilt,
+                };
+
+                let namespace_config = match namespace {
+                    "package" => ConfigNamespace::Package(common),
+                    "tool" => ConfigNamespace::Tool(common),
+                    "custom" => ConfigNamespace::Custom(common),
+                    _ => bail!("Invalid namespace `{}`", namespace),
+                };
+                (namespace_config, dependencies, recipe_options)
+            }
+            namespace => bail!("Invalid namespace `{}`", namespace),
+        };
+
+        let mut deps: Vec<(String, String, bool, bool, bool, bool, Option<String>)> = Vec::new();
         let mut image_deps: Vec<ConfigImageDependency> = Vec::new();
         let mut collection_deps: Vec<String> = Vec::new();
 
-        match try_consume_field!(&mut consumable_fields, "dependencies", ConfigFragment::List(v) => v) {
-            Some(recipe_deps) => {
-                let mut parse_res = parse_dependencies(recipe_deps, format!("recipe `{}/{}`", namespace, name))?;
-                deps.append(&mut parse_res.0);
-                image_deps.append(&mut parse_res.1);
-                collection_deps.append(&mut parse_res.2);
-            }
-            None => {}
+        if let Some(recipe_deps) = try_consume_field!(dependencies, ConfigFragment::List(v) => *v) {
+            let mut parse_res = parse_dependencies(arena, recipe_deps, format!("recipe `{}/{}`", namespace, name))?;
+            deps.append(&mut parse_res.0);
+            image_deps.append(&mut parse_res.1);
+            collection_deps.append(&mut parse_res.2);
         }
 
         let mut used_options: HashMap<String, Option<Vec<String>>> = HashMap::new();
-        if let Some(options) = try_consume_field!(&mut consumable_fields, "options", ConfigFragment::List(v) => v) {
-            for option in options {
+        if let Some(recipe_options) = try_consume_field!(recipe_options, ConfigFragment::List(v) => *v) {
+            for option in arena.list(recipe_options) {
                 let (option, allowed_values) = match option {
-                    ConfigFragment::String(option) => (option.clone(), None),
+                    ConfigFragment::String(option) => (option.to_string(), None),
                     ConfigFragment::Binary { operation: '=', left, right } => {
-                        let option = expect_frag!(left.as_ref(), ConfigFragment::String(left) => left.clone());
-                        let right = expect_frag!(right.as_ref(), ConfigFragment::List(right) => right);
+                        let option = expect_frag!(arena.get(*left), ConfigFragment::String(left) => left.to_string());
+                        let right = expect_frag!(arena.get(*right), ConfigFragment::List(right) => *right);
                         let mut allowed_values = Vec::new();
-                        for v in right {
-                            allowed_values.push(expect_frag!(v, ConfigFragment::String(v) => v.clone()));
+                        for v in arena.list(right) {
+                            allowed_values.push(expect_frag!(v, ConfigFragment::String(v) => v.to_string()));
                         }
 
                         (option, Some(allowed_values))
@@ -529,77 +1199,19 @@ fn parse_file(
                 if used_options.contains_key(&option) {
                     bail!("Recipe `{}` uses option `{}` more than once", namespace, name);
                 }
-                used_options.insert(option.clone(), allowed_values);
+                used_options.insert(option, allowed_values);
             }
         }
 
         let recipe = ConfigRecipe {
-            id: *id_counter,
-            name: name.clone(),
+            id: 0,
+            name: name.to_string(),
             image_dependencies: image_deps,
             used_options,
-            namespace: match namespace.as_str() {
-                "source" => {
-                    let url = consume_field!(&mut consumable_fields, "url", ConfigFragment::String(v) => v.to_string());
-                    let source_type = consume_field!(&mut consumable_fields, "type", ConfigFragment::String(v) => v.to_string());
-                    let patch = try_consume_field!(&mut consumable_fields, "patch", ConfigFragment::String(v) => v.to_string());
-                    let regenerate = try_consume_field!(&mut consumable_fields, "regenerate", ConfigFragment::CodeBlock {lang, code} => (lang.to_string(), code.to_string()));
-
-                    let kind = match source_type.as_str() {
-                        "local" => ConfigSourceKind::Local,
-                        "git" => ConfigSourceKind::Git(consume_field!(&mut consumable_fields, "revision", ConfigFragment::String(v) => v.to_string())),
-                        "tar.gz" => ConfigSourceKind::TarGz(consume_field!(&mut consumable_fields, "b2sum", ConfigFragment::String(v) => v.to_string())),
-                        "tar.xz" => ConfigSourceKind::TarXz(consume_field!(&mut consumable_fields, "b2sum", ConfigFragment::String(v) => v.to_string())),
-                        v => bail!("Unknown source type `{}`", v),
-                    };
-
-                    ConfigNamespace::Source(ConfigRecipeSource {
-                        url,
-                        kind,
-                        patch,
-                        regenerate: match regenerate {
-                            None => None,
-                            Some(regenerate) => Some(ConfigCodeBlock {
-                                lang: regenerate.0,
-                                code: regenerate.1,
-                            }),
-                        },
-                    })
-                }
-                "package" | "tool" | "custom" => {
-                    let configure = try_consume_field!(&mut consumable_fields, "configure", ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
-                    let build = try_consume_field!(&mut consumable_fields, "build", ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
-                    let install = try_consume_field!(&mut consumable_fields, "install", ConfigFragment::CodeBlock {lang, code} => ConfigCodeBlock {lang: lang.to_string(), code: code.to_string()});
-                    let always_clean = try_consume_field!(&mut consumable_fields, "always_clean", ConfigFragment::String(str) => str);
-
-                    let common = ConfigRecipeCommon {
-                        always_clean: parse_bool_string(always_clean)?,
-                        configure,
-                        build,
-                        install,
-                    };
-
-                    match namespace.as_str() {
-                        "package" => ConfigNamespace::Package(common),
-                        "tool" => ConfigNamespace::Tool(common),
-                        "custom" => ConfigNamespace::Custom(common),
-                        _ => bail!("Invalid namespace `{}`", namespace),
-                    }
-                }
-                namespace => bail!("Invalid namespace `{}`", namespace),
-            },
+            namespace: namespace_config,
         };
 
-        *id_counter += 1;
-
-        for field in consumable_fields {
-            if field.1 .1 {
-                continue;
-            }
-            bail!("Unknown field `{}`", field.0);
-        }
-
-        recipes_deps.push((recipe, deps, collection_deps));
+        recipes.push((recipe, deps, collection_deps));
     }
-    return Ok(recipes_deps);
+    Ok(recipes)
 }
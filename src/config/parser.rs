@@ -1,39 +1,46 @@
-use std::{
-    collections::HashMap,
-    fmt::{Display, Formatter},
-};
+use std::fmt::{Display, Formatter};
 
 use thiserror::Error;
 
-use super::lexer::Token;
+use super::lexer::{Span, Token};
 
 #[derive(Error, Debug)]
 pub enum ParserError {
     #[error("Unexpected end of file")]
     UnexpectedEOF,
 
-    #[error("Unexpected token `{0}`")]
-    UnexpectedToken(Token),
+    #[error("Unexpected token `{token}` at {span}")]
+    UnexpectedToken { token: String, span: Span },
 
-    #[error("Redefined object key `{0}`")]
-    DuplicateObjectKey(String),
+    #[error("Redefined object key `{key}` at {span}")]
+    DuplicateObjectKey { key: String, span: Span },
 }
 
+pub type FragmentId = u32;
+
+// Fragments reference their children by index into the arena, lists and objects are (start, length) ranges into the shared item and field vectors
 #[derive(Debug)]
-pub enum ConfigFragment {
-    Identifier(String),
-    Directive { name: String, value: Box<ConfigFragment> },
-    Definition { key: Box<ConfigFragment>, value: Box<ConfigFragment> },
-    Object(HashMap<String, Box<ConfigFragment>>),
-    String(String),
-    List(Vec<ConfigFragment>),
-    RecipeRef { namespace: String, name: String },
-    CodeBlock { lang: String, code: String },
-    Unary { operation: char, value: Box<ConfigFragment> },
-    Binary { operation: char, left: Box<ConfigFragment>, right: Box<ConfigFragment> },
+pub enum ConfigFragment<'a> {
+    Identifier(&'a str),
+    Directive { name: &'a str, value: FragmentId },
+    Definition { key: FragmentId, value: FragmentId },
+    Object((u32, u32)),
+    String(&'a str),
+    List((u32, u32)),
+    RecipeRef { namespace: &'a str, name: &'a str, output: Option<&'a str> },
+    CodeBlock { lang: &'a str, code: &'a str },
+    Unary { operation: char, value: FragmentId },
+    Binary { operation: char, left: FragmentId, right: FragmentId },
+}
+
+// All fragments of a parse live in three flat vectors that are dropped together
+pub struct ConfigArena<'a> {
+    fragments: Vec<ConfigFragment<'a>>,
+    items: Vec<FragmentId>,
+    fields: Vec<(&'a str, FragmentId)>,
 }
 
-impl Display for ConfigFragment {
+impl Display for ConfigFragment<'_> {
     fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
         match &self {
             Self::Identifier(value) => write!(f, "Identifier({})", value),
@@ -42,7 +49,12 @@ impl Display for ConfigFragment {
             Self::Object(_) => write!(f, "Object(...)"),
             Self::String(str) => write!(f, "String({})", str),
             Self::List(_) => write!(f, "List(...)"),
-            Self::RecipeRef { namespace, name } => write!(f, "RecipeRef({}/{})", namespace, name),
+            Self::RecipeRef { namespace, name, output: None } => write!(f, "RecipeRef({}/{})", namespace, name),
+            Self::RecipeRef {
+                namespace,
+                name,
+                output: Some(output),
+            } => write!(f, "RecipeRef({}/{}:{})", namespace, name, output),
             Self::CodeBlock { lang, code: _ } => write!(f, "CodeBlock({})", lang),
             Self::Unary { operation, value: _ } => write!(f, "Unary({})", operation),
             Self::Binary { operation, left: _, right: _ } => write!(f, "Binary({})", operation),
@@ -50,11 +62,37 @@ impl Display for ConfigFragment {
     }
 }
 
+impl<'a> ConfigArena<'a> {
+    pub fn get(&self, id: FragmentId) -> &ConfigFragment<'a> {
+        &self.fragments[id as usize]
+    }
+
+    pub fn list(&self, range: (u32, u32)) -> impl Iterator<Item = &ConfigFragment<'a>> {
+        self.items[range.0 as usize..(range.0 + range.1) as usize].iter().map(|id| self.get(*id))
+    }
+
+    pub fn object(&self, range: (u32, u32)) -> impl Iterator<Item = (&'a str, &ConfigFragment<'a>)> {
+        self.fields[range.0 as usize..(range.0 + range.1) as usize].iter().map(|(key, id)| (*key, self.get(*id)))
+    }
+
+    fn push(&mut self, fragment: ConfigFragment<'a>) -> FragmentId {
+        self.fragments.push(fragment);
+        (self.fragments.len() - 1) as FragmentId
+    }
+}
+
+struct Parser<'t, 'a> {
+    tokens: &'t mut Vec<(Token<'a>, Span)>,
+    arena: ConfigArena<'a>,
+    item_stack: Vec<FragmentId>,
+    field_stack: Vec<(&'a str, FragmentId)>,
+}
+
 macro_rules! expect {
     ($vec:expr, $pat:pat => $val:expr) => {
         match $vec.pop() {
-            Some($pat) => $val,
-            Some(frag) => return Err(ParserError::UnexpectedToken(frag)),
+            Some(($pat, _)) => $val,
+            Some((token, span)) => return Err(ParserError::UnexpectedToken { token: token.to_string(), span }),
             None => return Err(ParserError::UnexpectedEOF),
         }
     };
@@ -63,114 +101,148 @@ macro_rules! expect {
 macro_rules! try_expect {
     ($vec:expr, $pat:pat => $val:expr) => {
         match $vec.last() {
-            Some($pat) => $vec.pop(),
+            Some(($pat, _)) => $vec.pop(),
             _ => None,
         }
     };
 }
 
-pub fn parse_config(tokens: &mut Vec<Token>) -> Result<Vec<ConfigFragment>, ParserError> {
-    let mut top_level_fragments: Vec<ConfigFragment> = Vec::new();
-    while !tokens.is_empty() {
-        match tokens.last() {
-            Some(Token::Directive(_)) => top_level_fragments.push(parse_directive(tokens)?),
-            _ => top_level_fragments.push(parse_definition(tokens)?),
+pub fn parse_config<'a>(tokens: &mut Vec<(Token<'a>, Span)>) -> Result<(ConfigArena<'a>, Vec<FragmentId>), ParserError> {
+    // Tokens are a good upper bound for the amount of fragments
+    let mut parser = Parser {
+        arena: ConfigArena {
+            fragments: Vec::with_capacity(tokens.len()),
+            items: Vec::new(),
+            fields: Vec::new(),
+        },
+        tokens,
+        item_stack: Vec::new(),
+        field_stack: Vec::new(),
+    };
+
+    let mut top_level_fragments: Vec<FragmentId> = Vec::new();
+    while !parser.tokens.is_empty() {
+        match parser.tokens.last() {
+            Some((Token::Directive(_), _)) => top_level_fragments.push(parser.parse_directive()?),
+            _ => top_level_fragments.push(parser.parse_definition()?),
         }
     }
-    Ok(top_level_fragments)
-}
-
-fn parse_definition(tokens: &mut Vec<Token>) -> Result<ConfigFragment, ParserError> {
-    Ok(ConfigFragment::Definition {
-        key: Box::new(parse_value(tokens)?),
-        value: Box::new(parse_value(tokens)?),
-    })
+    Ok((parser.arena, top_level_fragments))
 }
 
-fn parse_directive(tokens: &mut Vec<Token>) -> Result<ConfigFragment, ParserError> {
-    let name = expect!(tokens, Token::Directive(id) => id);
-    Ok(ConfigFragment::Directive {
-        name,
-        value: Box::new(parse_value(tokens)?),
-    })
-}
+impl<'t, 'a> Parser<'t, 'a> {
+    fn parse_definition(&mut self) -> Result<FragmentId, ParserError> {
+        let key = self.parse_value()?;
+        let value = self.parse_value()?;
+        Ok(self.arena.push(ConfigFragment::Definition { key, value }))
+    }
 
-fn parse_value(tokens: &mut Vec<Token>) -> Result<ConfigFragment, ParserError> {
-    let mut frag = parse_primary(tokens)?;
-    loop {
-        if try_expect!(tokens, Token::Symbol('=') => ()).is_none() {
-            return Ok(frag);
-        }
-        frag = ConfigFragment::Binary {
-            operation: '=',
-            left: Box::new(frag),
-            right: Box::new(parse_primary(tokens)?),
-        }
+    fn parse_directive(&mut self) -> Result<FragmentId, ParserError> {
+        let name = expect!(self.tokens, Token::Directive(id) => id);
+        let value = self.parse_value()?;
+        Ok(self.arena.push(ConfigFragment::Directive { name, value }))
     }
-}
 
-fn parse_primary(tokens: &mut Vec<Token>) -> Result<ConfigFragment, ParserError> {
-    match tokens.last() {
-        Some(Token::Symbol('[')) => parse_list(tokens),
-        Some(Token::Symbol('{')) => parse_object(tokens),
-        Some(Token::Symbol('*') | Token::Symbol('%') | Token::Symbol('!') | Token::Symbol('?')) => parse_unary(tokens),
-        Some(Token::Identifier(_)) => {
-            let left = expect!(tokens, Token::Identifier(v) => v);
-            if try_expect!(tokens, Token::Symbol('/') => ()).is_some() {
-                let recipe = expect!(tokens, Token::Identifier(v) => v);
-                return Ok(ConfigFragment::RecipeRef { namespace: left, name: recipe });
+    fn parse_value(&mut self) -> Result<FragmentId, ParserError> {
+        let mut frag = self.parse_primary()?;
+        loop {
+            if try_expect!(self.tokens, Token::Symbol('=') => ()).is_none() {
+                return Ok(frag);
             }
-            Ok(ConfigFragment::Identifier(left))
+            let right = self.parse_primary()?;
+            frag = self.arena.push(ConfigFragment::Binary { operation: '=', left: frag, right });
         }
-        Some(Token::String(_)) => Ok(ConfigFragment::String(expect!(tokens, Token::String(v) => v))),
-        Some(Token::CodeBlock { code: _, lang: _ }) => Ok(expect!(tokens, Token::CodeBlock{lang, code} => ConfigFragment::CodeBlock { lang, code })),
-        Some(_) => Err(ParserError::UnexpectedToken(tokens.pop().unwrap())),
-        None => Err(ParserError::UnexpectedEOF),
     }
-}
 
-fn parse_object(tokens: &mut Vec<Token>) -> Result<ConfigFragment, ParserError> {
-    expect!(tokens, Token::Symbol('{') => ());
+    fn parse_primary(&mut self) -> Result<FragmentId, ParserError> {
+        let frag = match self.tokens.last() {
+            Some((Token::Symbol('['), _)) => return self.parse_list(),
+            Some((Token::Symbol('{'), _)) => return self.parse_object(),
+            Some((Token::Symbol('*') | Token::Symbol('%') | Token::Symbol('!') | Token::Symbol('?'), _)) => return self.parse_unary(),
+            Some((Token::Identifier(_), _)) => {
+                let left = expect!(self.tokens, Token::Identifier(v) => v);
+                if try_expect!(self.tokens, Token::Symbol('/') => ()).is_some() {
+                    let recipe = expect!(self.tokens, Token::Identifier(v) => v);
+                    let mut output = None;
+                    if try_expect!(self.tokens, Token::Symbol(':') => ()).is_some() {
+                        output = Some(expect!(self.tokens, Token::Identifier(v) => v));
+                    }
+                    ConfigFragment::RecipeRef {
+                        namespace: left,
+                        name: recipe,
+                        output,
+                    }
+                } else {
+                    ConfigFragment::Identifier(left)
+                }
+            }
+            Some((Token::String(_), _)) => ConfigFragment::String(expect!(self.tokens, Token::String(v) => v)),
+            Some((Token::CodeBlock { code: _, lang: _ }, _)) => expect!(self.tokens, Token::CodeBlock{lang, code} => ConfigFragment::CodeBlock { lang, code }),
+            Some(_) => {
+                let (token, span) = self.tokens.pop().unwrap();
+                return Err(ParserError::UnexpectedToken { token: token.to_string(), span });
+            }
+            None => return Err(ParserError::UnexpectedEOF),
+        };
+        Ok(self.arena.push(frag))
+    }
 
-    let mut values = HashMap::<String, Box<ConfigFragment>>::new();
-    while try_expect!(tokens, Token::Symbol('}') => ()).is_none() {
-        let key = expect!(tokens, Token::Identifier(v) => v);
-        expect!(tokens, Token::Symbol(':') => ());
+    fn parse_object(&mut self) -> Result<FragmentId, ParserError> {
+        expect!(self.tokens, Token::Symbol('{') => ());
+
+        // Nested objects push onto the same stack, each object only moves its own fields into the arena
+        let stack_start = self.field_stack.len();
+        while try_expect!(self.tokens, Token::Symbol('}') => ()).is_none() {
+            let (key, key_span) = match self.tokens.pop() {
+                Some((Token::Identifier(key), span)) => (key, span),
+                Some((token, span)) => return Err(ParserError::UnexpectedToken { token: token.to_string(), span }),
+                None => return Err(ParserError::UnexpectedEOF),
+            };
+            expect!(self.tokens, Token::Symbol(':') => ());
+
+            let value = self.parse_value()?;
+            match self.field_stack[stack_start..].iter_mut().find(|field| field.0 == key) {
+                Some(field) if key == "dependencies" => field.1 = value,
+                Some(_) => return Err(ParserError::DuplicateObjectKey { key: key.to_string(), span: key_span }),
+                None => self.field_stack.push((key, value)),
+            }
 
-        if values.insert(key.clone(), Box::new(parse_value(tokens)?)).is_some() && key != "dependencies" {
-            return Err(ParserError::DuplicateObjectKey(key));
+            try_expect!(self.tokens, Token::Symbol(',') => ());
         }
 
-        try_expect!(tokens, Token::Symbol(',') => ());
+        let start = self.arena.fields.len() as u32;
+        self.arena.fields.extend(self.field_stack.drain(stack_start..));
+        let len = self.arena.fields.len() as u32 - start;
+        Ok(self.arena.push(ConfigFragment::Object((start, len))))
     }
 
-    Ok(ConfigFragment::Object(values))
-}
+    fn parse_unary(&mut self) -> Result<FragmentId, ParserError> {
+        let operation = match self.tokens.pop() {
+            Some((Token::Symbol('*'), _)) => '*',
+            Some((Token::Symbol('%'), _)) => '%',
+            Some((Token::Symbol('!'), _)) => '!',
+            Some((Token::Symbol('?'), _)) => '?',
+            Some((token, span)) => return Err(ParserError::UnexpectedToken { token: token.to_string(), span }),
+            None => return Err(ParserError::UnexpectedEOF),
+        };
 
-fn parse_unary(tokens: &mut Vec<Token>) -> Result<ConfigFragment, ParserError> {
-    let operation = match tokens.pop() {
-        Some(Token::Symbol('*')) => '*',
-        Some(Token::Symbol('%')) => '%',
-        Some(Token::Symbol('!')) => '!',
-        Some(Token::Symbol('?')) => '?',
-        Some(tok) => return Err(ParserError::UnexpectedToken(tok)),
-        None => return Err(ParserError::UnexpectedEOF),
-    };
+        let value = self.parse_value()?;
+        Ok(self.arena.push(ConfigFragment::Unary { operation, value }))
+    }
 
-    return Ok(ConfigFragment::Unary {
-        operation,
-        value: Box::new(parse_value(tokens)?),
-    });
-}
+    fn parse_list(&mut self) -> Result<FragmentId, ParserError> {
+        expect!(self.tokens, Token::Symbol('[') => ());
 
-fn parse_list(tokens: &mut Vec<Token>) -> Result<ConfigFragment, ParserError> {
-    expect!(tokens, Token::Symbol('[') => ());
+        let stack_start = self.item_stack.len();
+        while try_expect!(self.tokens, Token::Symbol(']') => ()).is_none() {
+            let value = self.parse_value()?;
+            self.item_stack.push(value);
+            try_expect!(self.tokens, Token::Symbol(',') => ());
+        }
 
-    let mut values = Vec::<ConfigFragment>::new();
-    while try_expect!(tokens, Token::Symbol(']') => ()).is_none() {
-        values.push(parse_value(tokens)?);
-        try_expect!(tokens, Token::Symbol(',') => ());
+        let start = self.arena.items.len() as u32;
+        self.arena.items.extend(self.item_stack.drain(stack_start..));
+        let len = self.arena.items.len() as u32 - start;
+        Ok(self.arena.push(ConfigFragment::List((start, len))))
     }
-
-    Ok(ConfigFragment::List(values))
 }
@@ -0,0 +1,305 @@
+use std::{
+    collections::BTreeMap,
+    fmt::Display,
+    fs::File,
+    io::Write,
+    os::fd::BorrowedFd,
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Mutex,
+    },
+    time::{Instant, SystemTime, UNIX_EPOCH},
+};
+
+use anyhow::{Context, Result};
+use nix::sys::{
+    resource::{getrusage, Usage, UsageWho},
+    time::TimeValLike,
+};
+use serde::Serialize;
+
+use crate::{history, metrics, status, trace};
+
+// Newline delimited JSON events describing the progress of a run, meant for dashboards and other tools that would otherwise scrape the log.
+// Every line is written and flushed as soon as it happens.
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static EVENTS: Mutex<Option<EventSink>> = Mutex::new(None);
+
+struct EventSink {
+    file: File,
+    start: Instant,
+    started: u64,
+    finished: u64,
+    failed: u64,
+    up_to_date: u64,
+}
+
+#[derive(Serialize)]
+#[serde(tag = "event", rename_all = "snake_case")]
+pub enum Event<'a> {
+    RecipeQueued {
+        recipe: &'a str,
+    },
+    RecipeUpToDate {
+        recipe: &'a str,
+        reason: &'a str,
+    },
+    RecipeStarted {
+        recipe: &'a str,
+        options: &'a BTreeMap<String, String>,
+    },
+    RecipeFinished {
+        recipe: &'a str,
+        duration_ms: u64,
+        size: u64,
+    },
+    RecipeFailed {
+        recipe: &'a str,
+    },
+    StageStarted {
+        recipe: &'a str,
+        stage: &'a str,
+    },
+    StageFinished {
+        recipe: &'a str,
+        stage: &'a str,
+        duration_ms: u64,
+        user_time_ms: i64,
+        system_time_ms: i64,
+    },
+    StageFailed {
+        recipe: &'a str,
+        stage: &'a str,
+        duration_ms: u64,
+        log_path: Option<&'a Path>,
+    },
+    CacheHit {
+        cache: &'a str,
+    },
+    CacheMiss {
+        cache: &'a str,
+    },
+    Download {
+        what: &'a str,
+        bytes: u64,
+    },
+    DepcacheAssembled {
+        bytes: u64,
+        duration_ms: u64,
+    },
+    ContainerFinished {
+        command: &'a str,
+        duration_ms: u64,
+        success: bool,
+    },
+    Summary {
+        success: bool,
+        duration_ms: u64,
+        started: u64,
+        finished: u64,
+        failed: u64,
+        up_to_date: u64,
+    },
+}
+
+#[derive(Serialize)]
+struct EventLine<'a> {
+    timestamp_ms: u128,
+    #[serde(flatten)]
+    event: &'a Event<'a>,
+}
+
+// Targets are either a file path or an already open file descriptor written as `fd:<n>`
+pub fn enable(target: &str) -> Result<()> {
+    let file = match target.strip_prefix("fd:") {
+        Some(fd) => {
+            let fd = fd.parse::<i32>().with_context(|| format!("Invalid events file descriptor `{}`", fd))?;
+            // The descriptor belongs to whoever opened it, a duplicate is written to and closed instead
+            let fd = unsafe { BorrowedFd::borrow_raw(fd) };
+            File::from(fd.try_clone_to_owned().context("Failed to duplicate events file descriptor")?)
+        }
+        None => File::create(target).with_context(|| format!("Failed to create events file `{}`", target))?,
+    };
+
+    *EVENTS.lock().unwrap() = Some(EventSink {
+        file,
+        start: Instant::now(),
+        started: 0,
+        finished: 0,
+        failed: 0,
+        up_to_date: 0,
+    });
+    ENABLED.store(true, Ordering::Relaxed);
+    Ok(())
+}
+
+// Metrics, history and the status area are built from the events, so events are also produced when only those are enabled
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed) || metrics::enabled() || history::enabled() || status::enabled()
+}
+
+// Whether anything reports resource usage, history and the status area do not so every build would pay for measuring it otherwise
+pub fn measured() -> bool {
+    ENABLED.load(Ordering::Relaxed) || metrics::enabled()
+}
+
+pub fn emit(event: Event) {
+    if !enabled() {
+        return;
+    }
+
+    metrics::record(&event);
+    history::record(&event);
+    status::record(&event);
+
+    let mut events = EVENTS.lock().unwrap();
+    let sink = match events.as_mut() {
+        None => return,
+        Some(sink) => sink,
+    };
+
+    match event {
+        Event::RecipeStarted { .. } => sink.started += 1,
+        Event::RecipeFinished { .. } => sink.finished += 1,
+        Event::RecipeFailed { .. } => sink.failed += 1,
+        Event::RecipeUpToDate { .. } => sink.up_to_date += 1,
+        _ => {}
+    }
+
+    let line = EventLine {
+        timestamp_ms: SystemTime::now().duration_since(UNIX_EPOCH).map(|time| time.as_millis()).unwrap_or(0),
+        event: &event,
+    };
+
+    // A consumer going away should not fail the build
+    let mut data = match serde_json::to_vec(&line) {
+        Err(_) => return,
+        Ok(data) => data,
+    };
+    data.push(b'\n');
+    let _ = sink.file.write_all(&data);
+}
+
+// Emits the closing summary and stops emitting events
+pub fn finish(success: bool) {
+    let (duration_ms, started, finished, failed, up_to_date) = match EVENTS.lock().unwrap().as_ref() {
+        None => return,
+        Some(sink) => (sink.start.elapsed().as_millis() as u64, sink.started, sink.finished, sink.failed, sink.up_to_date),
+    };
+
+    emit(Event::Summary {
+        success,
+        duration_ms,
+        started,
+        finished,
+        failed,
+        up_to_date,
+    });
+
+    ENABLED.store(false, Ordering::Relaxed);
+    *EVENTS.lock().unwrap() = None;
+}
+
+// A recipe or stage in progress, dropping one without calling `finish` reports it as failed
+pub struct RecipeProgress {
+    recipe: String,
+    start: Instant,
+    finished: bool,
+}
+
+// Stages are traced as well, so one guard covers both the event stream and the trace
+pub struct StageProgress<'a> {
+    recipe: String,
+    stage: &'a str,
+    log_path: Option<&'a Path>,
+    start: Instant,
+    usage: Option<Usage>,
+    finished: bool,
+    _span: trace::Span,
+}
+
+pub fn recipe(recipe: impl Display, options: &BTreeMap<String, String>) -> RecipeProgress {
+    let recipe = if enabled() { recipe.to_string() } else { String::new() };
+    emit(Event::RecipeStarted { recipe: &recipe, options });
+
+    RecipeProgress {
+        recipe,
+        start: Instant::now(),
+        finished: false,
+    }
+}
+
+pub fn stage<'a>(recipe: impl Display, stage: &'a str, log_path: Option<&'a Path>) -> StageProgress<'a> {
+    let recipe = if enabled() { recipe.to_string() } else { String::new() };
+    emit(Event::StageStarted { recipe: &recipe, stage });
+
+    StageProgress {
+        recipe,
+        stage,
+        log_path,
+        start: Instant::now(),
+        usage: if measured() { getrusage(UsageWho::RUSAGE_CHILDREN).ok() } else { None },
+        finished: false,
+        _span: trace::span("stage", stage),
+    }
+}
+
+impl RecipeProgress {
+    pub fn finish(mut self, size: u64) {
+        self.finished = true;
+        emit(Event::RecipeFinished {
+            recipe: &self.recipe,
+            duration_ms: self.start.elapsed().as_millis() as u64,
+            size,
+        });
+    }
+}
+
+impl Drop for RecipeProgress {
+    fn drop(&mut self) {
+        if !self.finished {
+            emit(Event::RecipeFailed { recipe: &self.recipe });
+        }
+    }
+}
+
+impl StageProgress<'_> {
+    pub fn finish(mut self) {
+        self.finished = true;
+        if !enabled() {
+            return;
+        }
+
+        // Child usage only grows, the difference is what the containers of this stage used.
+        // The peak resident size is left out, for children it is the largest seen over the whole run rather than this stage.
+        let (user_time_ms, system_time_ms) = match (&self.usage, self.usage.and_then(|_| getrusage(UsageWho::RUSAGE_CHILDREN).ok())) {
+            (Some(before), Some(after)) => (
+                (after.user_time() - before.user_time()).num_milliseconds(),
+                (after.system_time() - before.system_time()).num_milliseconds(),
+            ),
+            _ => (0, 0),
+        };
+
+        emit(Event::StageFinished {
+            recipe: &self.recipe,
+            stage: self.stage,
+            duration_ms: self.start.elapsed().as_millis() as u64,
+            user_time_ms,
+            system_time_ms,
+        });
+    }
+}
+
+impl Drop for StageProgress<'_> {
+    fn drop(&mut self) {
+        if !self.finished {
+            emit(Event::StageFailed {
+                recipe: &self.recipe,
+                stage: self.stage,
+                duration_ms: self.start.elapsed().as_millis() as u64,
+                log_path: self.log_path,
+            });
+        }
+    }
+}
@@ -0,0 +1,320 @@
+use std::{
+    collections::{BTreeMap, HashMap, VecDeque},
+    fs::{exists, metadata, rename, File, OpenOptions},
+    io::{BufRead, BufReader, Write},
+    path::{Path, PathBuf},
+    process,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Mutex,
+    },
+    time::{SystemTime, UNIX_EPOCH},
+};
+
+use anyhow::{Context, Result};
+use bytesize::ByteSize;
+use log::warn;
+use memchr::memmem;
+use serde::{Deserialize, Serialize};
+
+use crate::{events::Event, util::get_timestamp};
+
+// Every recipe build is appended as one JSON line to the history log in the cache, unlike the recipe state it is never overwritten.
+// Like metrics the records are assembled from events, but only from fields that are free to collect since every build records history.
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static HISTORY: Mutex<Option<History>> = Mutex::new(None);
+
+// Builds are compared against the median of this many previous successful builds
+pub const WINDOW: usize = 10;
+
+// Once the log grows past this it is moved aside when the next build starts, only that one previous generation is kept
+const ROTATE_BYTES: u64 = 4 * 1024 * 1024;
+
+struct History {
+    path: PathBuf,
+    building: BTreeMap<String, HistoryRecord>,
+    recorded: Vec<HistoryRecord>,
+    next_id: u64,
+}
+
+#[derive(Serialize, Deserialize, Clone)]
+pub struct HistoryRecord {
+    // Unique per record, records from before ids were recorded have an empty one
+    #[serde(default)]
+    pub id: String,
+    pub timestamp: u64,
+    pub recipe: String,
+    pub options: BTreeMap<String, String>,
+    pub success: bool,
+    pub duration_ms: u64,
+    pub size: u64,
+    pub stages: Vec<HistoryStage>,
+}
+
+#[derive(Serialize, Deserialize, Clone)]
+pub struct HistoryStage {
+    pub stage: String,
+    pub success: bool,
+    pub duration_ms: u64,
+}
+
+pub fn enable(path: impl AsRef<Path>) {
+    let path = path.as_ref();
+    if metadata(path).is_ok_and(|meta| meta.len() > ROTATE_BYTES) {
+        if let Err(err) = rename(path, rotated_path(path)) {
+            warn!("Failed to rotate build history: {}", err);
+        }
+    }
+
+    *HISTORY.lock().unwrap() = Some(History {
+        path: path.to_path_buf(),
+        building: BTreeMap::new(),
+        recorded: Vec::new(),
+        next_id: 0,
+    });
+    ENABLED.store(true, Ordering::Relaxed);
+}
+
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+pub fn record(event: &Event) {
+    let mut history = HISTORY.lock().unwrap();
+    let history = match history.as_mut() {
+        None => return,
+        Some(history) => history,
+    };
+
+    match event {
+        Event::RecipeStarted { recipe, options } => {
+            let id = history.new_id();
+            history.building.insert(
+                recipe.to_string(),
+                HistoryRecord {
+                    id,
+                    timestamp: get_timestamp().unwrap_or(0),
+                    recipe: recipe.to_string(),
+                    options: (*options).clone(),
+                    success: false,
+                    duration_ms: 0,
+                    size: 0,
+                    stages: Vec::new(),
+                },
+            );
+        }
+        Event::StageFinished { recipe, stage, duration_ms, .. } => {
+            if let Some(record) = history.building.get_mut(*recipe) {
+                record.stages.push(HistoryStage {
+                    stage: stage.to_string(),
+                    success: true,
+                    duration_ms: *duration_ms,
+                });
+            }
+        }
+        Event::StageFailed { recipe, stage, duration_ms, .. } => {
+            if let Some(record) = history.building.get_mut(*recipe) {
+                record.stages.push(HistoryStage {
+                    stage: stage.to_string(),
+                    success: false,
+                    duration_ms: *duration_ms,
+                });
+            }
+        }
+        Event::RecipeFinished { recipe, duration_ms, size } => {
+            if let Some(mut record) = history.building.remove(*recipe) {
+                record.success = true;
+                record.duration_ms = *duration_ms;
+                record.size = *size;
+                history.append(record);
+            }
+        }
+        Event::RecipeFailed { recipe } => {
+            if let Some(record) = history.building.remove(*recipe) {
+                history.append(record);
+            }
+        }
+        _ => {}
+    }
+}
+
+impl History {
+    // The start time and pid tell runs apart, the counter tells the records of one run apart
+    fn new_id(&mut self) -> String {
+        let nanos = SystemTime::now().duration_since(UNIX_EPOCH).map(|time| time.as_nanos()).unwrap_or(0);
+        self.next_id += 1;
+        format!("{:x}-{:x}-{}", nanos, process::id(), self.next_id)
+    }
+
+    fn append(&mut self, record: HistoryRecord) {
+        // Losing a history record should never fail a build
+        if let Err(err) = append_record(&self.path, &record) {
+            warn!("Failed to record build history: {}", err);
+        }
+        self.recorded.push(record);
+    }
+}
+
+fn append_record(path: &Path, record: &HistoryRecord) -> Result<()> {
+    let mut line = serde_json::to_vec(record).context("Failed to serialize history record")?;
+    line.push(b'\n');
+
+    let mut file = OpenOptions::new().create(true).append(true).open(path).context("Failed to open history log")?;
+    file.write_all(&line).context("Failed to append to history log")
+}
+
+// Records appended during this run
+pub fn recorded() -> Vec<HistoryRecord> {
+    match HISTORY.lock().unwrap().as_ref() {
+        None => Vec::new(),
+        Some(history) => history.recorded.clone(),
+    }
+}
+
+pub fn rotated_path(path: &Path) -> PathBuf {
+    path.with_extension("1.jsonl")
+}
+
+// Visits every line of the log, oldest first, without holding more than one line in memory
+fn read_lines(path: &Path, mut visit: impl FnMut(&[u8])) -> Result<()> {
+    for path in [rotated_path(path), path.to_path_buf()] {
+        if !exists(&path)? {
+            continue;
+        }
+
+        let mut reader = BufReader::new(File::open(&path).context("Failed to open history log")?);
+        let mut line = Vec::new();
+        loop {
+            line.clear();
+            if reader.read_until(b'\n', &mut line).context("Failed to read history log")? == 0 {
+                break;
+            }
+            visit(&line);
+        }
+    }
+    Ok(())
+}
+
+// Reads every record of a recipe variant, oldest first
+pub fn read_history(path: impl AsRef<Path>, recipe: &str, options: &BTreeMap<String, String>) -> Result<Vec<HistoryRecord>> {
+    let mut records = Vec::new();
+    read_lines(path.as_ref(), |line| {
+        // Cheap prefilter before parsing, the recipe name always appears verbatim
+        if memmem::find(line, recipe.as_bytes()).is_none() {
+            return;
+        }
+
+        if let Ok(record) = serde_json::from_slice::<HistoryRecord>(line) {
+            if record.recipe == recipe && &record.options == options {
+                records.push(record);
+            }
+        }
+    })?;
+    Ok(records)
+}
+
+// The median duration of the recent successful builds of every given recipe variant.
+// The log is read in a single pass that only keeps the durations of the last window of builds per variant.
+pub fn expected_durations(path: impl AsRef<Path>, variants: &[(String, BTreeMap<String, String>)]) -> Result<Vec<Option<u64>>> {
+    #[derive(Deserialize)]
+    struct Entry {
+        recipe: String,
+        options: BTreeMap<String, String>,
+        success: bool,
+        duration_ms: u64,
+    }
+
+    let mut by_recipe: HashMap<&str, Vec<usize>> = HashMap::new();
+    for (index, (recipe, _)) in variants.iter().enumerate() {
+        by_recipe.entry(recipe).or_default().push(index);
+    }
+
+    let mut durations: Vec<VecDeque<u64>> = vec![VecDeque::new(); variants.len()];
+    read_lines(path.as_ref(), |line| {
+        let entry = match serde_json::from_slice::<Entry>(line) {
+            Ok(entry) if entry.success => entry,
+            _ => return,
+        };
+
+        for index in by_recipe.get(entry.recipe.as_str()).into_iter().flatten() {
+            if variants[*index].1 == entry.options {
+                durations[*index].push_back(entry.duration_ms);
+                if durations[*index].len() > WINDOW {
+                    durations[*index].pop_front();
+                }
+            }
+        }
+    })?;
+
+    Ok(durations.into_iter().map(|durations| median(durations.into())).collect())
+}
+
+// The records of a variant logged before the given one, which is itself expected to be in the log
+pub fn previous_records(path: impl AsRef<Path>, record: &HistoryRecord) -> Result<Vec<HistoryRecord>> {
+    let mut records = read_history(path, &record.recipe, &record.options)?;
+    let position = records.iter().rposition(|previous| previous.id == record.id).unwrap_or(records.len());
+    records.truncate(position);
+    Ok(records)
+}
+
+pub fn median(mut values: Vec<u64>) -> Option<u64> {
+    if values.is_empty() {
+        return None;
+    }
+
+    values.sort_unstable();
+    let middle = values.len() / 2;
+    match values.len() % 2 {
+        0 => Some((values[middle - 1] + values[middle]) / 2),
+        _ => Some(values[middle]),
+    }
+}
+
+// Compares a build against the median of the successful builds before it, returns a description of every metric that grew beyond the threshold
+pub fn regressions(record: &HistoryRecord, previous: &[HistoryRecord], window: usize, threshold: f64) -> Vec<String> {
+    let previous: Vec<&HistoryRecord> = previous.iter().filter(|previous| previous.success).rev().take(window).collect();
+    if !record.success || previous.is_empty() {
+        return Vec::new();
+    }
+
+    let mut metrics: Vec<(String, u64, Vec<u64>, bool)> = vec![
+        (String::from("duration"), record.duration_ms, previous.iter().map(|previous| previous.duration_ms).collect(), false),
+        (String::from("size"), record.size, previous.iter().map(|previous| previous.size).collect(), true),
+    ];
+    for stage in &record.stages {
+        let durations = previous
+            .iter()
+            .filter_map(|previous| previous.stages.iter().find(|previous_stage| previous_stage.stage == stage.stage))
+            .map(|previous_stage| previous_stage.duration_ms)
+            .collect();
+        metrics.push((format!("{} duration", stage.stage), stage.duration_ms, durations, false));
+    }
+
+    let mut regressions = Vec::new();
+    for (metric, value, previous_values, is_size) in metrics {
+        let median = match median(previous_values) {
+            None | Some(0) => continue,
+            Some(median) => median,
+        };
+
+        let ratio = value as f64 / median as f64;
+        if ratio > threshold {
+            regressions.push(format!(
+                "{} is {:.2}x the median of the last {} build(s) ({} vs {})",
+                metric,
+                ratio,
+                previous.len(),
+                format_value(value, is_size),
+                format_value(median, is_size)
+            ));
+        }
+    }
+    regressions
+}
+
+pub fn format_value(value: u64, is_size: bool) -> String {
+    match is_size {
+        true => ByteSize(value).to_string(),
+        false => format!("{:.1}s", value as f64 / 1000.0),
+    }
+}
@@ -0,0 +1,13 @@
+// The modules that do not depend on the command contexts, the binary and the benchmarks are built on top of them
+pub mod access;
+pub mod cache;
+pub mod config;
+pub mod events;
+pub mod history;
+pub mod metrics;
+pub mod rootfs;
+pub mod runtime;
+pub mod session;
+pub mod status;
+pub mod trace;
+pub mod util;
@@ -8,13 +8,16 @@ use std::{
     fs::{exists, read_dir, read_to_string, remove_dir},
     io,
     num::NonZero,
-    path::Path,
+    path::{absolute, Path, PathBuf},
     process::exit,
     rc::Rc,
+    sync::OnceLock,
     thread::available_parallelism,
+    time::Duration,
 };
 
 use anyhow::{bail, Context, Result};
+use blake3::Hash;
 use bytesize::ByteSize;
 use chrono::DateTime;
 use clap::{value_parser, Args, CommandFactory, Parser, Subcommand};
@@ -25,25 +28,29 @@ use nix::{
         kill, signal, SigHandler,
         Signal::{self, SIGKILL},
     },
-    unistd::{chdir, Gid, Pid, Uid},
+    unistd::{chdir, write, Gid, Pid, Uid},
 };
 use owo_colors::{OwoColorize, Style};
 use which::which;
 
-use cache::Cache;
+use chariot::{access, cache, config, events, history, metrics, rootfs, runtime, session, status, trace, util};
+
+use cache::{cache_metadata_files, cache_migration_plan, Cache};
 use config::{Config, ConfigNamespace, ConfigRecipeId};
+use events::Event;
+use pack::PackFormat;
 use rootfs::RootFS;
-use runtime::{Mount, RuntimeConfig};
+use runtime::{CpuPlacer, Mount, RuntimeConfig, SessionRequest};
 use util::force_rm;
 
 use crate::{recipe::RecipeState, util::force_rm_contents};
 
-mod cache;
-mod config;
+mod outputs;
+mod pack;
+mod post_install;
+mod prebuilt;
 mod recipe;
-mod rootfs;
-mod runtime;
-mod util;
+mod why;
 
 #[derive(Parser)]
 #[command(version, next_line_help = true)]
@@ -57,6 +64,9 @@ struct ChariotOptions {
     #[arg(long, help = "override default rootfs version", default_value = "20250401T023134Z")]
     rootfs_version: String,
 
+    #[arg(long, help = "use a local, already initialized rootfs archive instead of downloading the rootfs")]
+    rootfs_archive: Option<String>,
+
     #[arg(long, help = "dont acquire lockfile, use with care")]
     no_lockfile: bool,
 
@@ -66,6 +76,15 @@ struct ChariotOptions {
     #[arg(long = "option", short = 'o', value_parser = keyvalue_opt_validate, help = "user defined options", global = true)]
     option: Vec<(String, String)>,
 
+    #[arg(long, help = "write a chrome trace of the run to a file", global = true)]
+    trace: Option<String>,
+
+    #[arg(long, help = "stream json events of the run to a file or file descriptor (eg. fd:3)", global = true)]
+    events: Option<String>,
+
+    #[arg(long, help = "write a prometheus textfile of build and cache metrics at the end of the run", global = true)]
+    metrics: Option<String>,
+
     #[command(subcommand)]
     command: MainCommand,
 }
@@ -78,12 +97,33 @@ enum MainCommand {
     #[command(about = "execute a command within the container")]
     Exec(ExecOptions),
 
+    #[command(about = "open a shell in a persistent container session")]
+    Shell(ExecOptions),
+
+    #[command(about = "manage persistent container sessions")]
+    Session {
+        #[command(subcommand)]
+        command: SessionCommand,
+    },
+
+    #[command(about = "pack the runtime closure of package(s) into an archive or filesystem image")]
+    Pack(PackOptions),
+
+    #[command(about = "validate the entire config")]
+    Check,
+
     #[command(about = "purge recipes no longer in config")]
     Purge,
 
     #[command(about = "list recipes in cache")]
     List,
 
+    #[command(about = "migrate the cache to the format of this chariot")]
+    Migrate {
+        #[arg(long, help = "only show the migrations and what would be backed up")]
+        dry_run: bool,
+    },
+
     #[command(about = "wipe (delete) various parts of the chariot cache")]
     Wipe {
         #[command(subcommand)]
@@ -108,6 +148,21 @@ enum MainCommand {
         raw: bool,
     },
 
+    #[command(about = "explain why recipe(s) would be rebuilt")]
+    Why {
+        #[arg(help = "recipe to explain")]
+        recipe: String,
+    },
+
+    #[command(about = "show the build history of a recipe")]
+    History {
+        #[arg(help = "recipe to show history for")]
+        recipe: String,
+
+        #[arg(long, short, help = "number of builds to show", default_value_t = 10)]
+        limit: usize,
+    },
+
     #[command(about = "print logs")]
     Logs {
         #[arg(help = "recipe whos logs to print")]
@@ -140,6 +195,27 @@ struct BuildOptions {
 
     #[arg(long, help = "don't build dependencies even if they changed")]
     ignore_changes: bool,
+
+    #[arg(long, help = "skip the check stage of recipes")]
+    skip_checks: bool,
+
+    #[arg(long, help = "build recipes from their scripts even if they have a prebuilt")]
+    skip_prebuilts: bool,
+
+    #[arg(long, help = "build recipes from their scripts when their prebuilt does not match its checksum instead of failing")]
+    allow_prebuilt_mismatch: bool,
+
+    #[arg(long, help = "pin recipe containers to a cpu list (eg. 0-7,16-23) or to NUMA nodes (numa)")]
+    cpu_affinity: Option<String>,
+
+    #[arg(long, help = "profile the processes in the containers of passed recipes")]
+    profile: bool,
+
+    #[arg(long, help = "report dependencies of passed recipes whose files were never opened")]
+    trace_access: bool,
+
+    #[arg(long, value_name = "RATIO", num_args = 0..=1, default_missing_value = "1.5", help = "warn about recipes that built slower or larger than RATIO times their history median")]
+    compare_history: Option<f64>,
 }
 
 #[derive(Args)]
@@ -171,10 +247,46 @@ struct ExecOptions {
     #[arg(long, help = "set current working directory")]
     cwd: Option<String>,
 
+    #[arg(long, help = "run in a persistent session, which is started with the other options when it is not running (shell defaults to `default`)")]
+    session: Option<String>,
+
+    #[arg(long, help = "seconds a session stays alive without running commands", default_value_t = 1800)]
+    idle_timeout: u64,
+
     #[arg(help = "command(s) to execute")]
     command: Vec<String>,
 }
 
+#[derive(Args)]
+struct PackOptions {
+    #[arg(help = "package(s) to pack, optionally selecting an output (eg. package/zlib:runtime)")]
+    recipes: Vec<String>,
+
+    #[arg(long, short, help = "format of the archive or image", value_enum, default_value_t = PackFormat::TarZst)]
+    format: PackFormat,
+
+    #[arg(long, help = "path to write the archive or image to")]
+    output: String,
+
+    #[arg(long, short = 'j', help = "threads of parallelism for compression", default_value_t = available_parallelism().unwrap())]
+    parallelism: NonZero<usize>,
+
+    #[arg(long, help = "size of ext2 images (eg. 512MiB), sized to fit by default")]
+    size: Option<ByteSize>,
+}
+
+#[derive(Subcommand)]
+enum SessionCommand {
+    #[command(about = "list sessions")]
+    List,
+
+    #[command(about = "stop a session")]
+    Stop {
+        #[arg(help = "session to stop", default_value_t = String::from("default"))]
+        name: String,
+    },
+}
+
 #[derive(Subcommand)]
 enum WipeKind {
     #[command(about = "wipe the entire chariot cache")]
@@ -186,6 +298,9 @@ enum WipeKind {
     #[command(about = "wipe the proc cache")]
     ProcCache,
 
+    #[command(about = "wipe the metadata backups taken before cache migrations")]
+    Backups,
+
     #[command(about = "wipe recipe(s)")]
     Recipe {
         #[arg(long, help = "wipe all recipes")]
@@ -201,6 +316,9 @@ pub struct ChariotContext {
     pub rootfs: Rc<RootFS>,
     pub config: Rc<Config>,
     pub effective_options: BTreeMap<String, String>,
+    pub recipe_paths: Vec<PathBuf>,
+    // Recipe hashes only depend on the config and files outside the cache, so they are computed once per run
+    pub recipe_hashes: RefCell<Vec<Option<Hash>>>,
     pub verbose: bool,
 }
 
@@ -211,6 +329,16 @@ pub struct ChariotBuildContext {
     pub chosen_recipes: Vec<ConfigRecipeId>,
     pub clean_build: bool,
     pub ignore_changes: bool,
+    pub cpu_placer: Option<CpuPlacer>,
+    pub skip_checks: bool,
+    pub skip_prebuilts: bool,
+    pub allow_prebuilt_mismatch: bool,
+    pub profile: bool,
+    pub trace_access: bool,
+    pub pending_checks: RefCell<Vec<ConfigRecipeId>>,
+    // A recipe reached through several dependents is only reported once
+    pub queued_recipes: RefCell<BTreeSet<ConfigRecipeId>>,
+    pub up_to_date_recipes: RefCell<BTreeSet<ConfigRecipeId>>,
 }
 
 struct ChariotLogger;
@@ -230,7 +358,7 @@ impl Log for ChariotLogger {
         }
         .bold();
 
-        eprintln!("{} | {}", record.level().style(level_style), record.args());
+        status::print_line(&format!("{} | {}", record.level().style(level_style), record.args()));
     }
 
     fn flush(&self) {}
@@ -255,15 +383,23 @@ fn mount_opt_validate(s: &str) -> Result<(String, String, bool), String> {
     }
 }
 
+// Formatted up front, the handler can only write it out
+static SIGINT_MESSAGE: OnceLock<String> = OnceLock::new();
+
+// Only async-signal-safe calls, the logger takes locks the interrupted thread may be holding
 extern "C" fn handle_sigint(_: nix::libc::c_int) {
-    info!("Terminated chariot process ({})", Pid::this());
-    kill(Pid::from_raw(0), SIGKILL).expect("Failed to kill process group");
-    exit(0)
+    status::interrupt();
+    if let Some(message) = SIGINT_MESSAGE.get() {
+        let _ = write(io::stderr(), message.as_bytes());
+    }
+    let _ = kill(Pid::from_raw(0), SIGKILL);
+    unsafe { nix::libc::_exit(0) }
 }
 
 static LOGGER: ChariotLogger = ChariotLogger;
 
 fn main() {
+    let _ = SIGINT_MESSAGE.set(format!("{} | Terminated chariot process ({})\n", Level::Info.style(Style::new().green().bold()), Pid::this()));
     unsafe { signal(Signal::SIGINT, SigHandler::Handler(handle_sigint)) }.unwrap();
 
     log::set_logger(&LOGGER).map(|_| log::set_max_level(LevelFilter::Info)).expect("Failed to initialize logger");
@@ -289,6 +425,43 @@ fn run_main() -> Result<()> {
         return Ok(());
     }
 
+    // The trace path is resolved up front as chariot changes into the config directory
+    let trace_path = match &opts.trace {
+        None => None,
+        Some(path) => Some(absolute(path).context("Failed to resolve trace path")?),
+    };
+    if trace_path.is_some() {
+        trace::enable();
+    }
+
+    if let Some(target) = &opts.events {
+        events::enable(target)?;
+    }
+
+    let metrics_path = match &opts.metrics {
+        None => None,
+        Some(path) => Some(absolute(path).context("Failed to resolve metrics path")?),
+    };
+    if metrics_path.is_some() {
+        metrics::enable();
+    }
+
+    let mut result = run(opts);
+    status::finish();
+    events::finish(result.is_ok());
+    if let Some(trace_path) = trace_path {
+        result = result.and(trace::write_trace(trace_path));
+    }
+    // Metrics are a side channel, failing to write them does not fail the run
+    if let Some(metrics_path) = metrics_path {
+        if let Err(err) = metrics::write_metrics(metrics_path) {
+            warn!("Failed to write metrics: {:#}", err);
+        }
+    }
+    result
+}
+
+fn run(opts: ChariotOptions) -> Result<()> {
     // Ensure program dependencies
     which("wget").context("Chariot requires wget")?;
     which("bsdtar").context("Chariot requires bsdtar")?;
@@ -300,9 +473,31 @@ fn run_main() -> Result<()> {
         Some(config_dir) => config_dir,
     };
 
+    // Resolved before changing into the config directory
+    let rootfs_archive = match &opts.rootfs_archive {
+        None => None,
+        Some(path) => Some(absolute(path).context("Failed to resolve rootfs archive path")?),
+    };
+
     // Change directory to config directory
     chdir(config_dir).with_context(|| format!("Failed to chdir into config directory `{}`", config_dir.to_str().unwrap()))?;
 
+    // Running sessions are used without loading the config or locking the cache
+    let session_request = session_request(&opts.command);
+    if let Some((name, request)) = &session_request {
+        if session::run(Path::new(&opts.cache), name, request)? {
+            return Ok(());
+        }
+    }
+
+    if let MainCommand::Session { command } = &opts.command {
+        return session(Path::new(&opts.cache), command);
+    }
+
+    if let MainCommand::Migrate { dry_run: true } = &opts.command {
+        return migrate_dry_run(Path::new(&opts.cache));
+    }
+
     // Parse development overrides
     let mut overrides = HashMap::new();
     let overrides_path = config_dir.join(".chariot-overrides");
@@ -317,11 +512,28 @@ fn run_main() -> Result<()> {
         }
     }
 
+    // Initialize cache
+    let cache = Cache::init(opts.cache, !opts.no_lockfile).context("Failed to initialize chariot cache")?;
+    metrics::set_cache_path(cache.path());
+
+    // Initializing the cache migrates it
+    if let MainCommand::Migrate { dry_run: _ } = &opts.command {
+        info!("Cache is up to date");
+        return Ok(());
+    }
+
     // Parse config
-    let config = match config_file.file_name() {
+    let config_span = trace::span("config", "load config");
+    let (config, config_cached) = match config_file.file_name() {
         None => bail!("Failed to resolve config filename"),
-        Some(name) => Config::parse(Path::new(name), overrides).context("Failed to parse chariot config")?,
+        Some(name) => Config::load(Path::new(name), overrides, config_scope(&opts.command), cache.path_config_cache()).context("Failed to parse chariot config")?,
     };
+    events::emit(match config_cached {
+        true => Event::CacheHit { cache: "config" },
+        false => Event::CacheMiss { cache: "config" },
+    });
+
+    drop(config_span);
 
     // Parse options
     let mut raw_options: Vec<(String, String)> = opts.option;
@@ -334,11 +546,10 @@ fn run_main() -> Result<()> {
 
     let mut effective_options: BTreeMap<String, String> = BTreeMap::new();
     for (key, value) in raw_options {
-        if !config.options.contains_key(&key) {
-            bail!("User option `{}` is not defined in the config", key);
-        }
-
-        let allowed_values = &config.options[&key];
+        let allowed_values = match config.option_id(&key) {
+            None => bail!("User option `{}` is not defined in the config", key),
+            Some(option_id) => &config.options[option_id as usize],
+        };
         if !allowed_values.contains(&value) {
             bail!("User option `{}` does not allow the value `{}`. List of allowed values: {:?}", key, value, allowed_values)
         }
@@ -346,7 +557,7 @@ fn run_main() -> Result<()> {
         effective_options.insert(key, value);
     }
 
-    for (key, values) in &config.options {
+    for (key, values) in config.option_names.iter().zip(&config.options) {
         if effective_options.contains_key(key) {
             continue;
         }
@@ -354,20 +565,30 @@ fn run_main() -> Result<()> {
         effective_options.insert(key.clone(), values[0].clone());
     }
 
-    // Initialize cache
-    let cache = Cache::init(opts.cache, !opts.no_lockfile).context("Failed to initialize chariot cache")?;
+    if let MainCommand::Check = opts.command {
+        info!("Config is valid, {} recipe(s) and {} option(s)", config.recipes.len(), config.options.len());
+        return Ok(());
+    }
 
     // Initialize RootFS
     let mut global_packages = config.global_pkgs.clone();
     global_packages.append(&mut Vec::from_iter(rootfs::DEFAULT_PACKAGES.iter().map(|pkg| pkg.to_string())));
 
+    let rootfs_span = trace::span("rootfs", "initialize rootfs");
     let rootfs = cache
         .clone()
-        .rootfs_init(String::from(opts.rootfs_version), BTreeSet::from_iter(global_packages), opts.verbose)
+        .rootfs_init(String::from(opts.rootfs_version), rootfs_archive, BTreeSet::from_iter(global_packages), opts.verbose)
         .context("Failed to initialize rootfs")?;
+    drop(rootfs_span);
 
     // Setup context
+    let paths_span = trace::span("config", "resolve recipe paths");
+    let recipe_paths = ChariotContext::resolve_recipe_paths(&cache, &config, &effective_options);
+    drop(paths_span);
+
     let context = ChariotContext {
+        recipe_hashes: RefCell::new(vec![None; recipe_paths.len()]),
+        recipe_paths,
         cache,
         config,
         rootfs,
@@ -377,7 +598,7 @@ fn run_main() -> Result<()> {
 
     // Subcommands
     match opts.command {
-        MainCommand::Exec(exec_opts) => exec(context, exec_opts),
+        MainCommand::Exec(exec_opts) | MainCommand::Shell(exec_opts) => exec(context, exec_opts, session_request),
         MainCommand::Build(build_opts) => build(
             ChariotBuildContext {
                 common: context,
@@ -386,32 +607,62 @@ fn run_main() -> Result<()> {
                 clean_build: build_opts.clean,
                 ignore_changes: build_opts.ignore_changes,
                 chosen_recipes: Vec::new(),
+                cpu_placer: match build_opts.cpu_affinity {
+                    None => None,
+                    Some(spec) => Some(CpuPlacer::new(&spec).context("Failed to setup cpu affinity")?),
+                },
+                skip_checks: build_opts.skip_checks,
+                skip_prebuilts: build_opts.skip_prebuilts,
+                allow_prebuilt_mismatch: build_opts.allow_prebuilt_mismatch,
+                profile: build_opts.profile,
+                trace_access: build_opts.trace_access,
+                pending_checks: RefCell::new(Vec::new()),
+                queued_recipes: RefCell::new(BTreeSet::new()),
+                up_to_date_recipes: RefCell::new(BTreeSet::new()),
             },
             build_opts.recipes,
+            build_opts.compare_history,
         ),
+        MainCommand::Pack(pack_opts) => pack(context, pack_opts),
+        MainCommand::Check | MainCommand::Session { command: _ } | MainCommand::Migrate { dry_run: _ } => Ok(()),
         MainCommand::Purge => purge(context),
         MainCommand::List => list(context),
         MainCommand::Wipe { kind } => wipe(context, kind),
         MainCommand::Path { recipe, raw } => path(context, recipe, raw),
         MainCommand::Hash { recipe, raw } => hash(context, recipe, raw),
+        MainCommand::Why { recipe } => why(context, recipe),
+        MainCommand::History { recipe, limit } => history(context, recipe, limit),
         MainCommand::Logs { recipe, kind } => logs(context, recipe, kind),
         MainCommand::Completions { shell: _ } => Ok(()),
     }
 }
 
-fn resolve_recipe(config: &Config, namespace: &str, name: &str) -> Option<ConfigRecipeId> {
-    for (_, recipe) in &config.recipes {
-        if recipe.namespace.to_string() != namespace {
-            continue;
-        }
-
-        if recipe.name != name {
-            continue;
-        }
-
-        return Some(recipe.id);
+// Commands working on a few recipes only evaluate the closure of those, commands covering the whole tree get the full config
+fn config_scope(command: &MainCommand) -> Option<Vec<String>> {
+    match command {
+        MainCommand::Build(build_opts) => Some(build_opts.recipes.clone()),
+        MainCommand::Exec(exec_opts) | MainCommand::Shell(exec_opts) => Some(exec_opts.dependency.iter().chain(&exec_opts.recipe_context).cloned().collect()),
+        MainCommand::Pack(pack_opts) => Some(
+            pack_opts
+                .recipes
+                .iter()
+                .map(|recipe| match recipe.split_once(":") {
+                    None => recipe.clone(),
+                    Some((selector, _)) => selector.to_string(),
+                })
+                .collect(),
+        ),
+        MainCommand::Path { recipe, raw: _ }
+        | MainCommand::Hash { recipe, raw: _ }
+        | MainCommand::Why { recipe }
+        | MainCommand::History { recipe, limit: _ }
+        | MainCommand::Logs { recipe, kind: _ } => Some(vec![recipe.clone()]),
+        MainCommand::Wipe {
+            kind: WipeKind::Recipe { recipes, all: false },
+        } => Some(recipes.clone()),
+        MainCommand::Wipe { kind: _ } | MainCommand::Session { command: _ } | MainCommand::Migrate { dry_run: _ } => Some(Vec::new()),
+        MainCommand::Check | MainCommand::Purge | MainCommand::List | MainCommand::Completions { shell: _ } => None,
     }
-    return None;
 }
 
 fn resolve_recipe_from_selector(config: &Config, recipe_selector: &String) -> Option<ConfigRecipeId> {
@@ -420,7 +671,7 @@ fn resolve_recipe_from_selector(config: &Config, recipe_selector: &String) -> Op
         Some(selector) => selector,
     };
 
-    resolve_recipe(config, namespace, name)
+    config.recipe_id(namespace, name)
 }
 
 fn walk_cached_recipes(context: &ChariotContext, callback: impl Fn(&str, &str, &BTreeMap<&str, &str>, &RecipeState) -> Result<bool>) -> Result<()> {
@@ -495,7 +746,64 @@ fn options_string(opts: &BTreeMap<&str, &str>) -> Option<String> {
     return Some(opt_strings.join(", "));
 }
 
-fn exec(context: ChariotContext, exec_opts: ExecOptions) -> Result<()> {
+// Exec with a session and shell run their command in a session, this is the session name and the request to send to it
+fn session_request(command: &MainCommand) -> Option<(String, SessionRequest)> {
+    let (exec_opts, name, args) = match command {
+        MainCommand::Exec(exec_opts) => (
+            exec_opts,
+            exec_opts.session.clone()?,
+            vec![String::from("bash"), String::from("-e"), String::from("-c"), exec_opts.command.join(" ")],
+        ),
+        MainCommand::Shell(exec_opts) => (
+            exec_opts,
+            exec_opts.session.clone().unwrap_or(String::from("default")),
+            match exec_opts.command.is_empty() {
+                true => vec![String::from("bash")],
+                false => vec![String::from("bash"), String::from("-c"), exec_opts.command.join(" ")],
+            },
+        ),
+        _ => return None,
+    };
+
+    let request = SessionRequest {
+        args,
+        env: exec_opts.env.clone(),
+        cwd: exec_opts.cwd.clone(),
+        stop: false,
+    };
+    Some((name, request))
+}
+
+fn session(cache_path: &Path, command: &SessionCommand) -> Result<()> {
+    match command {
+        SessionCommand::List => {
+            let sessions = session::list(cache_path)?;
+            if sessions.is_empty() {
+                info!("No sessions");
+            }
+            for (name, running) in sessions {
+                match running {
+                    true => info!("{}", name),
+                    false => info!("{} (not running)", name),
+                }
+            }
+        }
+        SessionCommand::Stop { name } => match session::stop(cache_path, name)? {
+            true => info!("Stopped session `{}`", name),
+            false => info!("Session `{}` is not running", name),
+        },
+    }
+    Ok(())
+}
+
+fn exec(context: ChariotContext, exec_opts: ExecOptions, session_request: Option<(String, SessionRequest)>) -> Result<()> {
+    // Another chariot may have started the session while this one waited for the cache lock
+    if let Some((name, request)) = &session_request {
+        if session::run(&context.cache.path(), name, request)? {
+            return Ok(());
+        }
+    }
+
     let cmd = exec_opts.command.join(" ");
 
     let mut extra_deps = Vec::new();
@@ -538,10 +846,20 @@ fn exec(context: ChariotContext, exec_opts: ExecOptions) -> Result<()> {
         });
     }
 
-    runtime_config.run_shell(cmd.as_str()).with_context(|| format!("Failed to execute command `{}`", cmd))
+    match session_request {
+        None => runtime_config.run_shell(cmd.as_str()).with_context(|| format!("Failed to execute command `{}`", cmd)),
+        Some((name, request)) => {
+            session::start(&context.cache, &name, runtime_config, Duration::from_secs(exec_opts.idle_timeout)).with_context(|| format!("Failed to start session `{}`", name))?;
+            info!("Started session `{}`", name);
+            if !session::run(&context.cache.path(), &name, &request)? {
+                bail!("Session `{}` stopped before running the command", name);
+            }
+            Ok(())
+        }
+    }
 }
 
-fn build(mut context: ChariotBuildContext, recipes: Vec<String>) -> Result<()> {
+fn build(mut context: ChariotBuildContext, recipes: Vec<String>, compare_history: Option<f64>) -> Result<()> {
     // Resolve recipe IDs
     let mut chosen_recipes: Vec<ConfigRecipeId> = Vec::new();
     for recipe in recipes {
@@ -553,6 +871,9 @@ fn build(mut context: ChariotBuildContext, recipes: Vec<String>) -> Result<()> {
 
     context.chosen_recipes = chosen_recipes;
 
+    // Every build is recorded, comparing against the history is opt in
+    history::enable(context.common.cache.path_history());
+
     let invalidated_recipes: RefCell<Vec<ConfigRecipeId>> = RefCell::new(Vec::new());
     let attempted_recipes: RefCell<Vec<ConfigRecipeId>> = RefCell::new(Vec::new());
 
@@ -562,8 +883,16 @@ fn build(mut context: ChariotBuildContext, recipes: Vec<String>) -> Result<()> {
     }
     invalidated_recipes.borrow_mut().dedup();
 
+    // Verbose builds stream container output to the terminal, a status area would only get in the way
+    if !context.common.verbose {
+        match build_plan(&context.common, &context.chosen_recipes, context.skip_prebuilts) {
+            Ok(plan) => status::enable(plan),
+            Err(err) => warn!("Failed to plan build, progress is not shown: {}", err),
+        }
+    }
+
     for recipe_id in invalidated_recipes.borrow().iter() {
-        let recipe = &context.common.config.recipes[recipe_id];
+        let recipe = &context.common.config.recipe(*recipe_id);
         if attempted_recipes.borrow().contains(&recipe.id) {
             continue;
         }
@@ -574,9 +903,93 @@ fn build(mut context: ChariotBuildContext, recipes: Vec<String>) -> Result<()> {
             .context("Build failed")?;
     }
 
+    context.recipe_checks_process().context("Checks failed")?;
+
+    if let Some(threshold) = compare_history {
+        let history_path = context.common.cache.path_history();
+
+        let mut regressed = false;
+        for record in history::recorded() {
+            let previous = history::previous_records(&history_path, &record)?;
+            for regression in history::regressions(&record, &previous, history::WINDOW, threshold) {
+                warn!("Recipe `{}` regressed: {}", record.recipe, regression);
+                regressed = true;
+            }
+        }
+
+        if !regressed {
+            info!("No regressions against the build history");
+        }
+    }
+
     Ok(())
 }
 
+// Every recipe the build will visit, whether it is expected to be rebuilt and how long it took historically
+fn build_plan(context: &ChariotContext, roots: &[ConfigRecipeId], skip_prebuilts: bool) -> Result<Vec<(String, bool, Option<u64>)>> {
+    let mut closure: Vec<ConfigRecipeId> = Vec::new();
+    let mut visited = vec![false; context.config.recipes.len()];
+    let mut stack = roots.to_vec();
+    while let Some(recipe_id) = stack.pop() {
+        if visited[recipe_id as usize] {
+            continue;
+        }
+        visited[recipe_id as usize] = true;
+
+        closure.push(recipe_id);
+        let uses_prebuilt = context.recipe_uses_prebuilt(recipe_id, skip_prebuilts)?;
+        stack.extend(context.recipe_needed_dependencies(recipe_id, uses_prebuilt).map(|dep| dep.recipe_id));
+    }
+
+    // Only staleness is needed here, the hashes computed along the way are reused when the recipes are processed
+    let mut stale = vec![false; context.config.recipes.len()];
+    for (recipe_id, _) in context.recipe_rebuild_causes(roots, false, skip_prebuilts)? {
+        stale[recipe_id as usize] = true;
+    }
+
+    let stale_variants: Vec<(String, BTreeMap<String, String>)> = closure
+        .iter()
+        .filter(|recipe_id| stale[**recipe_id as usize])
+        .map(|recipe_id| (context.config.recipe(*recipe_id).to_string(), context.recipe_effective_options(*recipe_id)))
+        .collect();
+    let mut expected = match stale_variants.is_empty() {
+        true => Vec::new(),
+        false => history::expected_durations(context.cache.path_history(), &stale_variants)?,
+    }
+    .into_iter();
+
+    Ok(closure
+        .into_iter()
+        .map(|recipe_id| match stale[recipe_id as usize] {
+            true => (context.config.recipe(recipe_id).to_string(), true, expected.next().flatten()),
+            false => (context.config.recipe(recipe_id).to_string(), false, None),
+        })
+        .collect())
+}
+
+fn pack(context: ChariotContext, pack_opts: PackOptions) -> Result<()> {
+    let mut roots = Vec::new();
+    for recipe in &pack_opts.recipes {
+        let (selector, output) = match recipe.split_once(":") {
+            None => (recipe.clone(), None),
+            Some((selector, output)) => (selector.to_string(), Some(output.to_string())),
+        };
+
+        match resolve_recipe_from_selector(&context.config, &selector) {
+            None => bail!("Unknown recipe `{}`", recipe),
+            Some(recipe_id) => roots.push((recipe_id, output)),
+        }
+    }
+
+    if roots.is_empty() {
+        bail!("No recipes to pack");
+    }
+
+    context
+        .pack(roots, pack_opts.format, Path::new(&pack_opts.output), pack_opts.parallelism, pack_opts.size.map(|size| size.as_u64()))
+        .context("Failed to pack")
+}
+
 fn list(context: ChariotContext) -> Result<()> {
     info!("Listing all recipes found in cache");
     eprintln!("{} - Recipe in cache", "■".green());
@@ -588,19 +1001,7 @@ fn list(context: ChariotContext) -> Result<()> {
     walk_cached_recipes(&context, |namespace, name, opts, state| {
         let mut line = String::new();
 
-        let mut id = None;
-        for (_, recipe) in &context.config.recipes {
-            if recipe.namespace.to_string() != namespace {
-                continue;
-            }
-
-            if recipe.name != name {
-                continue;
-            }
-
-            id = Some(recipe.id);
-            break;
-        }
+        let id = context.config.recipe_id(namespace, name);
 
         let mut recipe_style = Style::new().green();
         if !state.intact || state.invalidated {
@@ -609,10 +1010,9 @@ fn list(context: ChariotContext) -> Result<()> {
         match id {
             None => recipe_style = Style::new().red(),
             Some(id) => {
-                let recipe_opts = &context.config.options_map[&id];
                 let mut matching = 0;
                 for (option, _) in opts {
-                    if !recipe_opts.contains(&option.to_string()) {
+                    if !context.config.recipe_has_option(id, option) {
                         break;
                     }
 
@@ -639,6 +1039,10 @@ fn list(context: ChariotContext) -> Result<()> {
             line.push_str(format!(" | {}", timestamp.format("%y/%m/%d %H:%M:%S").magenta()).as_str());
         }
 
+        if state.prebuilt.is_some() {
+            line.push_str(" | prebuilt");
+        }
+
         eprintln!("{}", line);
 
         Ok(false)
@@ -647,11 +1051,28 @@ fn list(context: ChariotContext) -> Result<()> {
     Ok(())
 }
 
+fn migrate_dry_run(cache_path: &Path) -> Result<()> {
+    let (version, plan) = cache_migration_plan(cache_path)?;
+    if plan.is_empty() {
+        info!("Cache is up to date");
+        return Ok(());
+    }
+
+    info!("Cache is at version {}, migrating would run:", version);
+    for (target, description, _) in plan {
+        info!("  version {}: {}", target, description);
+    }
+
+    let files = cache_metadata_files(cache_path).context("Failed to collect cache metadata")?;
+    info!("{} metadata file(s) would be backed up to `{}`", files.len(), cache_path.join("backups").to_string_lossy());
+    Ok(())
+}
+
 fn purge(context: ChariotContext) -> Result<()> {
     info!("Purging recipes...");
 
     walk_cached_recipes(&context, |namespace, name, opts, state| {
-        let recipe_id = resolve_recipe(&context.config, namespace, name);
+        let recipe_id = context.config.recipe_id(namespace, name);
 
         let recipe_path = context.cache.path_recipe(namespace, name, opts);
 
@@ -670,18 +1091,16 @@ fn purge(context: ChariotContext) -> Result<()> {
             Some(recipe_id) => recipe_id,
         };
 
-        let recipe_opts = &context.config.options_map[&recipe_id];
-
         let mut matching = 0;
         for (option, _) in opts {
-            if !recipe_opts.contains(&option.to_string()) {
+            if !context.config.recipe_has_option(recipe_id, option) {
                 break;
             }
 
             matching += 1;
         }
 
-        if recipe_opts.len() != matching {
+        if context.config.recipe_options(recipe_id).count() != matching {
             let mut opts_str = String::new();
             if let Some(str) = options_string(opts) {
                 opts_str = format!(" [{}]", str);
@@ -714,6 +1133,7 @@ fn wipe(context: ChariotContext, kind: WipeKind) -> Result<()> {
         WipeKind::Cache => force_rm(context.cache.path()).context("Failed to wipe cache")?,
         WipeKind::Rootfs => context.cache.rootfs_wipe().context("Failed to wipe rootfs")?,
         WipeKind::ProcCache => force_rm(context.cache.path_proc_caches()).context("Failed to wipe proc cache")?,
+        WipeKind::Backups => force_rm(context.cache.path_backups()).context("Failed to wipe cache backups")?,
         WipeKind::Recipe { recipes, all } => {
             if all {
                 force_rm(context.cache.path_recipes()).context("Failed to wipe all recipes")?;
@@ -725,7 +1145,7 @@ fn wipe(context: ChariotContext, kind: WipeKind) -> Result<()> {
                     Some(recipe_id) => recipe_id,
                     None => continue,
                 };
-                force_rm(context.path_recipe(recipe_id)).with_context(|| format!("Failed to wipe recipe `{}`", context.config.recipes[&recipe_id]))?;
+                force_rm(context.path_recipe(recipe_id)).with_context(|| format!("Failed to wipe recipe `{}`", context.config.recipe(recipe_id)))?;
             }
         }
     }
@@ -739,7 +1159,7 @@ fn path(context: ChariotContext, recipe: String, raw: bool) -> Result<()> {
         None => bail!("Unknown recipe `{}`", recipe),
     };
 
-    let recipe_path = context.path_recipe(recipe_id).join(match context.config.recipes[&recipe_id].namespace {
+    let recipe_path = context.path_recipe(recipe_id).join(match context.config.recipe(recipe_id).namespace {
         ConfigNamespace::Source(_) => "src",
         ConfigNamespace::Package(_) | ConfigNamespace::Tool(_) | ConfigNamespace::Custom(_) => "install",
     });
@@ -770,6 +1190,97 @@ fn hash(context: ChariotContext, recipe: String, raw: bool) -> Result<()> {
     Ok(())
 }
 
+fn why(context: ChariotContext, recipe: String) -> Result<()> {
+    let recipe_id = match resolve_recipe_from_selector(&context.config, &recipe) {
+        Some(recipe_id) => recipe_id,
+        None => bail!("Unknown recipe `{}`", recipe),
+    };
+
+    let causes = context.recipe_rebuild_causes(&[recipe_id], true, false).context("Failed to explain recipe")?;
+    if causes.is_empty() {
+        info!("Recipe `{}` and its dependencies are up to date", context.config.recipe(recipe_id));
+        return Ok(());
+    }
+
+    for (recipe_id, recipe_causes) in causes {
+        info!("Recipe `{}` would be rebuilt:", context.config.recipe(recipe_id));
+        for cause in recipe_causes {
+            info!("- {}", cause);
+        }
+    }
+
+    Ok(())
+}
+
+fn history(context: ChariotContext, recipe: String, limit: usize) -> Result<()> {
+    let recipe_id = match resolve_recipe_from_selector(&context.config, &recipe) {
+        Some(recipe_id) => recipe_id,
+        None => bail!("Unknown recipe `{}`", recipe),
+    };
+
+    let recipe = context.config.recipe(recipe_id).to_string();
+    let records = history::read_history(context.cache.path_history(), &recipe, &context.recipe_effective_options(recipe_id))?;
+    if records.is_empty() {
+        info!("No build history for recipe `{}`", recipe);
+        return Ok(());
+    }
+
+    info!("Build history of `{}`, {} build(s) recorded", recipe, records.len());
+    for record in records.iter().skip(records.len().saturating_sub(limit)) {
+        let mut line = String::new();
+        match record.success {
+            true => line.push_str(format!("{}", "■".green()).as_str()),
+            false => line.push_str(format!("{}", "■".red()).as_str()),
+        }
+
+        if let Some(timestamp) = DateTime::from_timestamp_secs(record.timestamp as i64) {
+            line.push_str(format!(" {}", timestamp.format("%y/%m/%d %H:%M:%S").magenta()).as_str());
+        }
+
+        line.push_str(format!(" | {}", history::format_value(record.duration_ms, false).blue()).as_str());
+        if record.success {
+            line.push_str(format!(" | {}", history::format_value(record.size, true).blue()).as_str());
+        }
+
+        let stages: Vec<String> = record
+            .stages
+            .iter()
+            .map(|stage| format!("{} {}", stage.stage, history::format_value(stage.duration_ms, false)))
+            .collect();
+        if !stages.is_empty() {
+            line.push_str(format!(" | {}", stages.join(", ")).as_str());
+        }
+
+        eprintln!("{}", line);
+    }
+
+    let successful: Vec<&history::HistoryRecord> = records.iter().filter(|record| record.success).rev().take(history::WINDOW).collect();
+    let (median_duration, median_size) = match (
+        history::median(successful.iter().map(|record| record.duration_ms).collect()),
+        history::median(successful.iter().map(|record| record.size).collect()),
+    ) {
+        (Some(duration), Some(size)) => (duration, size),
+        _ => return Ok(()),
+    };
+
+    info!(
+        "Median of the last {} successful build(s): {}, {}",
+        successful.len(),
+        history::format_value(median_duration, false),
+        history::format_value(median_size, true)
+    );
+
+    let latest = successful[0];
+    if median_duration > 0 {
+        info!("Latest successful build took {:.2}x the median duration", latest.duration_ms as f64 / median_duration as f64);
+    }
+    if median_size > 0 {
+        info!("Latest successful build is {:.2}x the median size", latest.size as f64 / median_size as f64);
+    }
+
+    Ok(())
+}
+
 fn logs(context: ChariotContext, recipe: String, kind: String) -> Result<()> {
     match resolve_recipe_from_selector(&context.config, &recipe) {
         Some(recipe_id) => {
@@ -0,0 +1,277 @@
+use std::{
+    collections::BTreeMap,
+    fmt::Write,
+    fs::{exists, metadata, read_dir, read_to_string, rename, write},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Mutex,
+    },
+};
+
+use anyhow::{Context, Result};
+use log::warn;
+
+use crate::events::Event;
+
+// Aggregates the event stream of a run into a Prometheus textfile, meant for the node exporter textfile collector.
+// Metrics only see events, so anything worth graphing has to be emitted as an event first.
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static METRICS: Mutex<Option<Metrics>> = Mutex::new(None);
+
+const CONTAINER_BUCKETS: [f64; 9] = [0.1, 0.5, 1.0, 5.0, 30.0, 60.0, 300.0, 1800.0, 3600.0];
+
+#[derive(Default)]
+struct Metrics {
+    cache_path: Option<PathBuf>,
+    recipe_seconds: BTreeMap<String, f64>,
+    recipe_bytes: BTreeMap<String, u64>,
+    stage_seconds: BTreeMap<(String, String), f64>,
+    stage_cpu_seconds: BTreeMap<(String, String), f64>,
+    recipes_failed: u64,
+    cache_lookups: BTreeMap<(String, bool), u64>,
+    depcache_bytes: u64,
+    depcache_seconds: f64,
+    downloaded_bytes: u64,
+    container_buckets: [u64; CONTAINER_BUCKETS.len()],
+    container_seconds: f64,
+    container_runs: u64,
+    container_failures: u64,
+}
+
+pub fn enable() {
+    *METRICS.lock().unwrap() = Some(Metrics::default());
+    ENABLED.store(true, Ordering::Relaxed);
+}
+
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+// Disk usage is reported per cache category, which needs to know where the cache lives
+pub fn set_cache_path(path: impl AsRef<Path>) {
+    if let Some(metrics) = METRICS.lock().unwrap().as_mut() {
+        metrics.cache_path = Some(path.as_ref().to_path_buf());
+    }
+}
+
+pub fn record(event: &Event) {
+    let mut metrics = METRICS.lock().unwrap();
+    let metrics = match metrics.as_mut() {
+        None => return,
+        Some(metrics) => metrics,
+    };
+
+    match event {
+        Event::RecipeUpToDate { .. } => *metrics.cache_lookups.entry((String::from("state"), true)).or_default() += 1,
+        Event::RecipeStarted { .. } => *metrics.cache_lookups.entry((String::from("state"), false)).or_default() += 1,
+        Event::RecipeFinished { recipe, duration_ms, size } => {
+            metrics.recipe_seconds.insert(recipe.to_string(), *duration_ms as f64 / 1000.0);
+            metrics.recipe_bytes.insert(recipe.to_string(), *size);
+        }
+        Event::RecipeFailed { .. } => metrics.recipes_failed += 1,
+        Event::StageFinished {
+            recipe,
+            stage,
+            duration_ms,
+            user_time_ms,
+            system_time_ms,
+            ..
+        } => {
+            let key = (recipe.to_string(), stage.to_string());
+            metrics.stage_seconds.insert(key.clone(), *duration_ms as f64 / 1000.0);
+            metrics.stage_cpu_seconds.insert(key, (user_time_ms + system_time_ms) as f64 / 1000.0);
+        }
+        Event::CacheHit { cache } => *metrics.cache_lookups.entry((cache.to_string(), true)).or_default() += 1,
+        Event::CacheMiss { cache } => *metrics.cache_lookups.entry((cache.to_string(), false)).or_default() += 1,
+        Event::DepcacheAssembled { bytes, duration_ms } => {
+            metrics.depcache_bytes += bytes;
+            metrics.depcache_seconds += *duration_ms as f64 / 1000.0;
+        }
+        Event::Download { bytes, .. } => metrics.downloaded_bytes += bytes,
+        Event::ContainerFinished { duration_ms, success, .. } => {
+            let seconds = *duration_ms as f64 / 1000.0;
+            for (bucket, bound) in CONTAINER_BUCKETS.iter().enumerate() {
+                if seconds <= *bound {
+                    metrics.container_buckets[bucket] += 1;
+                }
+            }
+            metrics.container_seconds += seconds;
+            metrics.container_runs += 1;
+            if !success {
+                metrics.container_failures += 1;
+            }
+        }
+        _ => {}
+    }
+}
+
+// Written to a temporary file first so a collector never scrapes a partial file
+pub fn write_metrics(path: impl AsRef<Path>) -> Result<()> {
+    let metrics = match METRICS.lock().unwrap().take() {
+        None => return Ok(()),
+        Some(metrics) => metrics,
+    };
+    ENABLED.store(false, Ordering::Relaxed);
+
+    let mut out = String::new();
+
+    family(&mut out, "chariot_recipe_build_seconds", "gauge", "Duration of the last build of a recipe in this run");
+    for (recipe, seconds) in &metrics.recipe_seconds {
+        sample(&mut out, "chariot_recipe_build_seconds", &[("recipe", recipe)], *seconds);
+    }
+
+    family(&mut out, "chariot_recipe_size_bytes", "gauge", "Size of a recipe built in this run");
+    for (recipe, bytes) in &metrics.recipe_bytes {
+        sample(&mut out, "chariot_recipe_size_bytes", &[("recipe", recipe)], *bytes as f64);
+    }
+
+    family(&mut out, "chariot_stage_seconds", "gauge", "Duration of a recipe stage in this run");
+    for ((recipe, stage), seconds) in &metrics.stage_seconds {
+        sample(&mut out, "chariot_stage_seconds", &[("recipe", recipe), ("stage", stage)], *seconds);
+    }
+
+    family(
+        &mut out,
+        "chariot_stage_cpu_seconds",
+        "gauge",
+        "User and system CPU time used by the containers of a recipe stage in this run",
+    );
+    for ((recipe, stage), seconds) in &metrics.stage_cpu_seconds {
+        sample(&mut out, "chariot_stage_cpu_seconds", &[("recipe", recipe), ("stage", stage)], *seconds);
+    }
+
+    family(&mut out, "chariot_recipes_failed_total", "counter", "Recipes that failed to build in this run");
+    sample(&mut out, "chariot_recipes_failed_total", &[], metrics.recipes_failed as f64);
+
+    family(&mut out, "chariot_cache_lookups_total", "counter", "Cache lookups by cache and result");
+    for ((cache, hit), count) in &metrics.cache_lookups {
+        sample(
+            &mut out,
+            "chariot_cache_lookups_total",
+            &[("cache", cache), ("result", if *hit { "hit" } else { "miss" })],
+            *count as f64,
+        );
+    }
+
+    family(&mut out, "chariot_cache_hit_ratio", "gauge", "Share of cache lookups that hit");
+    let mut caches: BTreeMap<&str, (u64, u64)> = BTreeMap::new();
+    for ((cache, hit), count) in &metrics.cache_lookups {
+        let entry = caches.entry(cache).or_default();
+        if *hit {
+            entry.0 += count;
+        }
+        entry.1 += count;
+    }
+    for (cache, (hits, total)) in caches {
+        sample(&mut out, "chariot_cache_hit_ratio", &[("cache", cache)], hits as f64 / total as f64);
+    }
+
+    family(&mut out, "chariot_depcache_bytes_total", "counter", "Recorded size of the recipes installed into dependency caches");
+    sample(&mut out, "chariot_depcache_bytes_total", &[], metrics.depcache_bytes as f64);
+    family(&mut out, "chariot_depcache_seconds_total", "counter", "Time spent assembling dependency caches");
+    sample(&mut out, "chariot_depcache_seconds_total", &[], metrics.depcache_seconds);
+
+    family(&mut out, "chariot_downloaded_bytes_total", "counter", "Bytes of source archives and rootfs downloaded");
+    sample(&mut out, "chariot_downloaded_bytes_total", &[], metrics.downloaded_bytes as f64);
+
+    family(&mut out, "chariot_container_run_seconds", "histogram", "Wall time of container runs, from spawn to exit");
+    for (bucket, bound) in CONTAINER_BUCKETS.iter().enumerate() {
+        sample(
+            &mut out,
+            "chariot_container_run_seconds_bucket",
+            &[("le", &format!("{:?}", bound))],
+            metrics.container_buckets[bucket] as f64,
+        );
+    }
+    sample(&mut out, "chariot_container_run_seconds_bucket", &[("le", "+Inf")], metrics.container_runs as f64);
+    sample(&mut out, "chariot_container_run_seconds_sum", &[], metrics.container_seconds);
+    sample(&mut out, "chariot_container_run_seconds_count", &[], metrics.container_runs as f64);
+
+    family(&mut out, "chariot_container_failures_total", "counter", "Container runs that exited unsuccessfully");
+    sample(&mut out, "chariot_container_failures_total", &[], metrics.container_failures as f64);
+
+    if let Some(cache_path) = &metrics.cache_path {
+        family(
+            &mut out,
+            "chariot_cache_disk_usage_bytes",
+            "gauge",
+            "Disk usage of the cache by category, recipes report the size recorded in their state",
+        );
+        match cache_usage(cache_path) {
+            Err(err) => warn!("Failed to collect cache disk usage: {}", err),
+            Ok(usage) => {
+                for (category, bytes) in usage {
+                    sample(&mut out, "chariot_cache_disk_usage_bytes", &[("category", &category)], bytes as f64);
+                }
+            }
+        }
+    }
+
+    let tmp_path = path.as_ref().with_extension("tmp");
+    write(&tmp_path, out).context("Failed to write metrics")?;
+    rename(&tmp_path, &path).context("Failed to move metrics into place")
+}
+
+// Only uses sizes that are known without walking the cache, the rootfs and per process caches are left out for that reason
+fn cache_usage(cache_path: &Path) -> Result<Vec<(String, u64)>> {
+    let mut usage = Vec::new();
+    if let Ok(meta) = metadata(cache_path.join("config.bin")) {
+        usage.push((String::from("config"), meta.len()));
+    }
+
+    let recipes_path = cache_path.join("recipes");
+    if exists(&recipes_path)? {
+        for namespace in read_dir(&recipes_path).context("Failed to read recipes dir")? {
+            let namespace = namespace?;
+            let mut bytes = 0;
+            for recipe in read_dir(namespace.path()).context("Failed to read recipes dir")? {
+                bytes += recorded_size(&recipe?.path())?;
+            }
+            usage.push((format!("recipes/{}", namespace.file_name().to_string_lossy()), bytes));
+        }
+    }
+    Ok(usage)
+}
+
+// Reads the size field of the recipe state, option variants of a recipe live below `opt/<option>/<value>`
+fn recorded_size(recipe_path: &Path) -> Result<u64> {
+    let state_path = recipe_path.join("state.toml");
+    if exists(&state_path)? {
+        let state = read_to_string(&state_path).context("Failed to read recipe state")?;
+        let state = state.parse::<toml::Table>().context("Failed to parse recipe state")?;
+        return Ok(state.get("size").and_then(|size| size.as_integer()).unwrap_or(0) as u64);
+    }
+
+    let mut bytes = 0;
+    let options_path = recipe_path.join("opt");
+    if exists(&options_path)? {
+        for option in read_dir(&options_path).context("Failed to read recipe options dir")? {
+            for value in read_dir(option?.path()).context("Failed to read recipe options dir")? {
+                bytes += recorded_size(&value?.path())?;
+            }
+        }
+    }
+    Ok(bytes)
+}
+
+fn family(out: &mut String, name: &str, kind: &str, help: &str) {
+    let _ = writeln!(out, "# HELP {} {}", name, help);
+    let _ = writeln!(out, "# TYPE {} {}", name, kind);
+}
+
+fn sample(out: &mut String, name: &str, labels: &[(&str, &str)], value: f64) {
+    out.push_str(name);
+    if !labels.is_empty() {
+        out.push('{');
+        for (i, (label, value)) in labels.iter().enumerate() {
+            if i > 0 {
+                out.push(',');
+            }
+            let value = value.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+            let _ = write!(out, "{}=\"{}\"", label, value);
+        }
+        out.push('}');
+    }
+    let _ = writeln!(out, " {}", value);
+}
@@ -0,0 +1,181 @@
+use std::{
+    collections::BTreeMap,
+    ffi::OsStr,
+    fs::{create_dir_all, exists, read, read_dir, read_link, write, File},
+    io,
+    os::unix::ffi::OsStrExt,
+    path::{Path, PathBuf},
+};
+
+use anyhow::{Context, Result};
+use blake3::Hasher;
+use glob::Pattern;
+
+use crate::{
+    config::{ConfigNamespace, ConfigRecipeId},
+    recipe::{RecipeOutputState, RecipeState},
+    util::{copy_path, force_rm},
+    ChariotContext,
+};
+
+impl ChariotContext {
+    // Splits the install tree into the declared outputs, files not claimed by any output belong to `runtime`
+    pub fn recipe_outputs_split(&self, recipe_id: ConfigRecipeId, previous_outputs: &BTreeMap<String, RecipeOutputState>, timestamp: u64) -> Result<BTreeMap<String, RecipeOutputState>> {
+        let recipe = &self.config.recipe(recipe_id);
+        let recipe_path = self.path_recipe(recipe_id);
+
+        let manifests_path = recipe_path.join("outputs");
+        force_rm(&manifests_path).context("Failed to clean output manifests")?;
+
+        let output_names = recipe.output_names();
+        if output_names.is_empty() {
+            return Ok(BTreeMap::new());
+        }
+
+        let declared_outputs = match &recipe.namespace {
+            ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) | ConfigNamespace::Custom(common) => &common.outputs,
+            ConfigNamespace::Source(_) => return Ok(BTreeMap::new()),
+        };
+
+        let mut patterns: Vec<(&String, Vec<Pattern>)> = Vec::new();
+        for (output, output_patterns) in declared_outputs {
+            let mut compiled = Vec::new();
+            for pattern in output_patterns {
+                compiled.push(Pattern::new(pattern).with_context(|| format!("Invalid pattern `{}` for output `{}`", pattern, output))?);
+            }
+            patterns.push((output, compiled));
+        }
+
+        let mut manifests: BTreeMap<String, Vec<PathBuf>> = BTreeMap::from_iter(output_names.iter().map(|output| (output.clone(), Vec::new())));
+
+        let mut entries = Vec::new();
+        collect_entries(&recipe_path.join("install"), Path::new(""), &mut entries).context("Failed to walk install dir")?;
+        for entry in entries {
+            let mut claimed = false;
+            for (output, output_patterns) in &patterns {
+                if output_patterns.iter().any(|pattern| pattern.matches_path(&entry)) {
+                    manifests.get_mut(*output).unwrap().push(entry.clone());
+                    claimed = true;
+                }
+            }
+
+            if !claimed {
+                manifests.get_mut("runtime").unwrap().push(entry);
+            }
+        }
+
+        if let Some(debug_manifest) = manifests.get_mut("debug") {
+            let debug_path = recipe_path.join("debug");
+            if exists(&debug_path)? {
+                collect_entries(&debug_path, Path::new(""), debug_manifest).context("Failed to walk debug dir")?;
+            }
+        }
+
+        create_dir_all(&manifests_path).context("Failed to create output manifests dir")?;
+
+        let mut outputs = BTreeMap::new();
+        for (output, manifest) in manifests {
+            let root = match output.as_str() {
+                "debug" => recipe_path.join("debug"),
+                _ => recipe_path.join("install"),
+            };
+
+            let mut hasher = Hasher::new();
+            let mut manifest_data: Vec<u8> = Vec::new();
+            for entry in &manifest {
+                manifest_data.extend_from_slice(entry.as_os_str().as_bytes());
+                manifest_data.push(0);
+
+                hasher.update(entry.as_os_str().as_bytes());
+                hasher.update(&[0]);
+
+                let path = root.join(entry);
+                match read_link(&path) {
+                    Ok(target) => {
+                        hasher.update(b"l");
+                        hasher.update(target.as_os_str().as_bytes());
+                    }
+                    Err(_) => {
+                        hasher.update(b"f");
+                        let mut file = File::open(&path).with_context(|| format!("Failed to open `{}`", path.to_string_lossy()))?;
+                        io::copy(&mut file, &mut hasher).with_context(|| format!("Failed to hash `{}`", path.to_string_lossy()))?;
+                    }
+                }
+            }
+
+            write(manifests_path.join(output.clone() + ".list"), manifest_data).context("Failed to write output manifest")?;
+
+            let hash = hasher.finalize().to_string();
+            let changed = match previous_outputs.get(&output) {
+                Some(previous) if previous.hash == hash => previous.changed,
+                _ => timestamp,
+            };
+            outputs.insert(output, RecipeOutputState { hash, changed });
+        }
+
+        Ok(outputs)
+    }
+
+    pub fn recipe_output_changed(&self, recipe_id: ConfigRecipeId, output: &str) -> Result<Option<u64>> {
+        let state = match RecipeState::read(&self.path_recipe(recipe_id))? {
+            None => return Ok(None),
+            Some(state) => state,
+        };
+
+        Ok(state.outputs.get(output).map(|output| output.changed))
+    }
+
+    // Returns the root an output is relative to and the entries of its manifest
+    pub fn recipe_output_manifest(&self, recipe_id: ConfigRecipeId, output: &str) -> Result<(PathBuf, Vec<PathBuf>)> {
+        let recipe_path = self.path_recipe(recipe_id);
+        let root = match output {
+            "debug" => recipe_path.join("debug"),
+            _ => recipe_path.join("install"),
+        };
+
+        let manifest_path = recipe_path.join("outputs").join(output.to_string() + ".list");
+        let manifest = read(&manifest_path).with_context(|| format!("Failed to read output manifest `{}`", manifest_path.to_string_lossy()))?;
+
+        let mut entries = Vec::new();
+        for entry in manifest.split(|b| *b == 0) {
+            if entry.is_empty() {
+                continue;
+            }
+            entries.push(PathBuf::from(OsStr::from_bytes(entry)));
+        }
+
+        Ok((root, entries))
+    }
+
+    pub fn install_recipe_output(&self, recipe_id: ConfigRecipeId, output: &str, strip_prefix: &Path, dest: &Path) -> Result<()> {
+        let (root, entries) = self.recipe_output_manifest(recipe_id, output)?;
+        for entry in entries {
+            let relative = match entry.strip_prefix(strip_prefix) {
+                Ok(relative) => relative,
+                Err(_) => continue,
+            };
+
+            copy_path(root.join(&entry), dest.join(relative)).with_context(|| format!("Failed to install `{}` of output `{}`", entry.to_string_lossy(), output))?;
+        }
+
+        Ok(())
+    }
+}
+
+fn collect_entries(root: &Path, dir: &Path, entries: &mut Vec<PathBuf>) -> Result<()> {
+    let mut dir_entries = Vec::new();
+    for entry in read_dir(root.join(dir)).with_context(|| format!("Failed to read directory `{}`", root.join(dir).to_string_lossy()))? {
+        dir_entries.push(entry?);
+    }
+    dir_entries.sort_by_key(|entry| entry.file_name());
+
+    for entry in dir_entries {
+        let path = dir.join(entry.file_name());
+        if entry.file_type()?.is_dir() {
+            collect_entries(root, &path, entries)?;
+            continue;
+        }
+        entries.push(path);
+    }
+    Ok(())
+}
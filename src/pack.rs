@@ -0,0 +1,303 @@
+use std::{
+    collections::{BTreeMap, BTreeSet},
+    env,
+    fs::{create_dir_all, read_dir, read_link, symlink_metadata, write},
+    num::NonZero,
+    os::unix::{ffi::OsStrExt, fs::PermissionsExt},
+    path::{absolute, Path, PathBuf},
+    process::{Command, Stdio},
+};
+
+use anyhow::{bail, Context, Result};
+use blake3::Hasher;
+use clap::ValueEnum;
+use log::{info, warn};
+
+use crate::{
+    config::{ConfigNamespace, ConfigRecipeId},
+    recipe::RecipeState,
+    runtime::{Mount, OutputConfig, RuntimeConfig},
+    util::force_rm,
+    ChariotContext,
+};
+
+#[derive(Clone, Copy, ValueEnum)]
+pub enum PackFormat {
+    #[value(name = "tar.zst")]
+    TarZst,
+    Cpio,
+    Ext2,
+}
+
+enum PackEntry {
+    Directory { mode: u32 },
+    File { mode: u32, size: u64, source: PathBuf },
+    Symlink { target: PathBuf },
+}
+
+impl ChariotContext {
+    // Packs the runtime closure of packages straight from the recipe install dirs, the archive is driven by an mtree manifest so no merged sysroot is created
+    pub fn pack(&self, roots: Vec<(ConfigRecipeId, Option<String>)>, format: PackFormat, output: &Path, parallelism: NonZero<usize>, size: Option<u64>) -> Result<()> {
+        let mut closure: Vec<(ConfigRecipeId, Option<String>)> = Vec::new();
+        for (recipe_id, recipe_output) in roots {
+            let recipe = &self.config.recipe(recipe_id);
+            if !matches!(recipe.namespace, ConfigNamespace::Package(_)) {
+                bail!("Only package recipes can be packed, `{}` is not a package", recipe);
+            }
+
+            if let Some(recipe_output) = &recipe_output {
+                if !recipe.has_output(recipe_output) {
+                    bail!("Recipe `{}` has no output `{}`", recipe, recipe_output);
+                }
+            }
+
+            self.pack_closure(recipe_id, recipe_output, &mut closure);
+        }
+
+        let mut entries: BTreeMap<PathBuf, PackEntry> = BTreeMap::new();
+        for (recipe_id, recipe_output) in &closure {
+            let recipe = &self.config.recipe(*recipe_id);
+            let recipe_path = self.path_recipe(*recipe_id);
+
+            match RecipeState::read(&recipe_path).context("Failed to read recipe state")? {
+                Some(state) if state.intact => {}
+                _ => bail!("Recipe `{}` is not built, build it before packing", recipe),
+            }
+
+            let (root, prefix, paths) = match recipe_output.as_deref() {
+                None => {
+                    let root = recipe_path.join("install");
+                    let mut paths = Vec::new();
+                    collect_tree(&root, Path::new(""), &mut paths).with_context(|| format!("Failed to walk install dir of `{}`", recipe))?;
+                    (root, PathBuf::new(), paths)
+                }
+                Some(recipe_output) => {
+                    let (root, paths) = self.recipe_output_manifest(*recipe_id, recipe_output)?;
+                    let prefix = match recipe_output {
+                        "debug" => Path::new("usr").join("lib").join("debug"),
+                        _ => PathBuf::new(),
+                    };
+                    (root, prefix, paths)
+                }
+            };
+
+            let root = absolute(&root).context("Failed to resolve recipe path")?;
+            for path in paths {
+                pack_add_entry(&mut entries, &root, &prefix, &path).with_context(|| format!("Failed to pack `{}` of `{}`", path.to_string_lossy(), recipe))?;
+            }
+        }
+
+        let timestamp = match env::var("SOURCE_DATE_EPOCH") {
+            Ok(epoch) => epoch.parse::<u64>().context("Invalid SOURCE_DATE_EPOCH")?,
+            Err(_) => 0,
+        };
+
+        // Entries are emitted sorted with fixed ownership, timestamps, and inode numbers to keep the archive reproducible
+        let mut manifest = String::from("#mtree\n");
+        let mut content_size = 0;
+        for (inode, (path, entry)) in entries.iter().enumerate() {
+            let common = format!("./{} uid=0 gid=0 time={} nlink=1 inode={}", mtree_escape(path.as_os_str().as_bytes()), timestamp, inode + 1);
+            match entry {
+                PackEntry::Directory { mode } => manifest.push_str(&format!("{} type=dir mode={:04o}\n", common, mode)),
+                PackEntry::File { mode, size, source } => {
+                    content_size += size.div_ceil(4096) * 4096;
+                    manifest.push_str(&format!("{} type=file mode={:04o} contents={}\n", common, mode, mtree_escape(source.as_os_str().as_bytes())));
+                }
+                PackEntry::Symlink { target } => manifest.push_str(&format!("{} type=link mode=0777 link={}\n", common, mtree_escape(target.as_os_str().as_bytes()))),
+            }
+        }
+
+        let pack_path = self.cache.path_pack();
+        force_rm(&pack_path).context("Failed to clean pack dir")?;
+        create_dir_all(pack_path.join("cwd")).context("Failed to create pack dir")?;
+
+        let manifest_path = pack_path.join("manifest.mtree");
+        write(&manifest_path, &manifest).context("Failed to write pack manifest")?;
+
+        let output = absolute(output).context("Failed to resolve output path")?;
+        if let Some(parent) = output.parent() {
+            create_dir_all(parent).context("Failed to create output directory")?;
+        }
+
+        info!("Packing {} entries from {} recipe(s) into `{}`", entries.len(), closure.len(), output.to_string_lossy());
+
+        let archive_path = match format {
+            PackFormat::Ext2 => pack_path.join("image.tar"),
+            _ => output.clone(),
+        };
+
+        let mut bsdtar = Command::new("bsdtar");
+        bsdtar.current_dir(pack_path.join("cwd")).args(["-c", "-f"]).arg(&archive_path);
+        match format {
+            PackFormat::TarZst => bsdtar.args(["--zstd", "--options"]).arg(format!("zstd:threads={}", parallelism)),
+            PackFormat::Cpio => bsdtar.args(["--format", "newc"]),
+            PackFormat::Ext2 => &mut bsdtar,
+        };
+        let res = bsdtar
+            .arg(format!("@{}", manifest_path.to_string_lossy()))
+            .stdout(match self.verbose {
+                true => Stdio::inherit(),
+                false => Stdio::piped(),
+            })
+            .output()
+            .context("Failed to run bsdtar")?;
+        if !res.status.success() {
+            bail!("Failed to create archive: {}", String::from_utf8(res.stderr).unwrap_or(String::from("Failed to parse stderr")));
+        }
+
+        if let PackFormat::Ext2 = format {
+            // Leave a quarter of slack on top of the block aligned contents for metadata
+            let size = match size {
+                Some(size) => size,
+                None => (content_size + entries.len() as u64 * 4096) * 5 / 4 + 16 * 1024 * 1024,
+            };
+
+            // Derive the filesystem uuid and directory hash seed from the manifest instead of randomizing them
+            let mut hasher = Hasher::new();
+            hasher.update(manifest.as_bytes());
+            let hash = hasher.finalize().to_string();
+            let uuid = format!("{}-{}-{}-{}-{}", &hash[0..8], &hash[8..12], &hash[12..16], &hash[16..20], &hash[20..32]);
+
+            let (output_dir, output_name) = match (output.parent(), output.file_name()) {
+                (Some(output_dir), Some(output_name)) => (output_dir, output_name),
+                _ => bail!("Invalid output path `{}`", output.to_string_lossy()),
+            };
+
+            // Populating from a tarball needs a newer mke2fs than most hosts ship, so it runs in the rootfs
+            RuntimeConfig::new(self.rootfs.subset(BTreeSet::from([String::from("e2fsprogs")])).context("Failed to get rootfs subset")?)
+                .set_output_config(OutputConfig { quiet: !self.verbose, log_path: None })
+                .add_mount(Mount::new(&pack_path, "/chariot/pack").read_only())
+                .add_mount(Mount::new(output_dir, "/chariot/output"))
+                .add_env_var(String::from("E2FSPROGS_FAKE_TIME"), timestamp.to_string())
+                .run(vec![
+                    String::from("mke2fs"),
+                    String::from("-q"),
+                    String::from("-F"),
+                    String::from("-t"),
+                    String::from("ext2"),
+                    String::from("-b"),
+                    String::from("4096"),
+                    String::from("-N"),
+                    (entries.len() + 256).to_string(),
+                    String::from("-U"),
+                    uuid.clone(),
+                    String::from("-E"),
+                    format!("root_owner=0:0,hash_seed={}", uuid),
+                    String::from("-d"),
+                    String::from("/chariot/pack/image.tar"),
+                    Path::new("/chariot/output").join(output_name).to_string_lossy().to_string(),
+                    format!("{}k", size.div_ceil(1024)),
+                ])
+                .context("Failed to create ext2 image")?;
+        }
+
+        force_rm(&pack_path).context("Failed to clean pack dir")?;
+
+        info!("Packed `{}`", output.to_string_lossy());
+
+        Ok(())
+    }
+
+    fn pack_closure(&self, recipe_id: ConfigRecipeId, output: Option<String>, closure: &mut Vec<(ConfigRecipeId, Option<String>)>) {
+        let key = (recipe_id, output);
+        if closure.contains(&key) || closure.contains(&(recipe_id, None)) {
+            return;
+        }
+        closure.push(key);
+
+        for dependency in self.config.dependencies(recipe_id) {
+            if !dependency.runtime {
+                continue;
+            }
+
+            let recipe = &self.config.recipe(dependency.recipe_id);
+            if !matches!(recipe.namespace, ConfigNamespace::Package(_)) {
+                continue;
+            }
+
+            let options_valid = recipe.used_options.iter().all(|(option, valid_values)| match valid_values {
+                None => true,
+                Some(valid_values) => valid_values.contains(&self.effective_options[option]),
+            });
+            if !options_valid {
+                assert!(dependency.optional);
+                continue;
+            }
+
+            self.pack_closure(dependency.recipe_id, dependency.output.clone(), closure);
+        }
+    }
+}
+
+fn pack_add_entry(entries: &mut BTreeMap<PathBuf, PackEntry>, root: &Path, prefix: &Path, path: &Path) -> Result<()> {
+    let dest = prefix.join(path);
+
+    for ancestor in dest.ancestors().skip(1) {
+        if ancestor.as_os_str().is_empty() || entries.contains_key(ancestor) {
+            continue;
+        }
+
+        let mode = match ancestor.strip_prefix(prefix) {
+            Ok(relative) if !relative.as_os_str().is_empty() => symlink_metadata(root.join(relative))?.permissions().mode() & 0o7777,
+            _ => 0o755,
+        };
+        entries.insert(ancestor.to_path_buf(), PackEntry::Directory { mode });
+    }
+
+    let source = root.join(path);
+    let meta = symlink_metadata(&source)?;
+    let entry = if meta.is_dir() {
+        PackEntry::Directory {
+            mode: meta.permissions().mode() & 0o7777,
+        }
+    } else if meta.is_symlink() {
+        PackEntry::Symlink { target: read_link(&source)? }
+    } else if meta.is_file() {
+        PackEntry::File {
+            mode: meta.permissions().mode() & 0o7777,
+            size: meta.len(),
+            source,
+        }
+    } else {
+        warn!("Unsupported file type on path `{}` skipping...", dest.to_string_lossy());
+        return Ok(());
+    };
+
+    match (entries.get(&dest), &entry) {
+        (None, _) => {
+            entries.insert(dest, entry);
+        }
+        (Some(PackEntry::Directory { .. }), PackEntry::Directory { .. }) => {}
+        (Some(PackEntry::File { source: existing, .. }), PackEntry::File { source, .. }) if existing == source => {}
+        (Some(PackEntry::Symlink { target: existing }), PackEntry::Symlink { target }) if existing == target => {}
+        (Some(_), _) => warn!("Pack conflict on path `{}` skipping...", dest.to_string_lossy()),
+    }
+
+    Ok(())
+}
+
+fn collect_tree(root: &Path, dir: &Path, paths: &mut Vec<PathBuf>) -> Result<()> {
+    for entry in read_dir(root.join(dir)).with_context(|| format!("Failed to read directory `{}`", root.join(dir).to_string_lossy()))? {
+        let entry = entry?;
+        let path = dir.join(entry.file_name());
+        let is_dir = entry.file_type()?.is_dir();
+
+        paths.push(path.clone());
+        if is_dir {
+            collect_tree(root, &path, paths)?;
+        }
+    }
+    Ok(())
+}
+
+fn mtree_escape(data: &[u8]) -> String {
+    let mut escaped = String::new();
+    for byte in data {
+        match byte {
+            b'\\' | b'#' | b'=' => escaped.push_str(&format!("\\{:03o}", byte)),
+            b'!'..=b'~' => escaped.push(*byte as char),
+            _ => escaped.push_str(&format!("\\{:03o}", byte)),
+        }
+    }
+    escaped
+}
@@ -0,0 +1,264 @@
+use std::{
+    fs::{create_dir_all, exists, read_dir, read_link, remove_file, write, File},
+    io::Read,
+    os::unix::fs::symlink,
+    path::{Component, Path, PathBuf},
+    thread,
+};
+
+use anyhow::{Context, Result};
+use glob::Pattern;
+use log::info;
+
+use crate::{
+    config::ConfigPostInstall,
+    runtime::{Mount, OutputConfig, RuntimeConfig},
+    util::force_rm,
+    ChariotBuildContext,
+};
+
+enum PostInstallAction {
+    None,
+    Strip,
+    StripDebug,
+    Compress,
+}
+
+impl ChariotBuildContext {
+    pub fn recipe_post_install(&self, runtime_config: &mut RuntimeConfig, recipe_path: &Path, post_install: &ConfigPostInstall) -> Result<()> {
+        let install_path = recipe_path.join("install");
+
+        let mut pruned = 0;
+        if let Some(prune) = &post_install.prune {
+            let mut patterns = Vec::new();
+            for pattern in prune {
+                patterns.push(Pattern::new(pattern).with_context(|| format!("Invalid prune pattern `{}`", pattern))?);
+            }
+
+            pruned = prune_tree(&install_path, &install_path, &patterns).context("Failed to prune install dir")?;
+        }
+
+        let strip = post_install.strip == Some(true);
+        let compress_man = post_install.compress_man == Some(true);
+        if !strip && !compress_man {
+            if pruned > 0 {
+                info!("Post-install pruned {} path(s)", pruned);
+            }
+            return Ok(());
+        }
+
+        let mut files: Vec<PathBuf> = Vec::new();
+        let mut man_links: Vec<PathBuf> = Vec::new();
+        collect_files(&install_path, Path::new(""), &mut files, &mut man_links).context("Failed to walk install dir")?;
+
+        // Classify files in parallel, this reads the header of every file in the install tree
+        let chunk_size = files.len().div_ceil(self.parallelism.get()).max(1);
+        let actions = thread::scope(|scope| -> Result<Vec<PostInstallAction>> {
+            let mut handles = Vec::new();
+            for chunk in files.chunks(chunk_size) {
+                let install_path = &install_path;
+                handles.push(scope.spawn(move || -> Result<Vec<PostInstallAction>> {
+                    let mut actions = Vec::new();
+                    for file in chunk {
+                        actions.push(classify_file(install_path, file, strip, compress_man)?);
+                    }
+                    Ok(actions)
+                }));
+            }
+
+            let mut actions = Vec::new();
+            for handle in handles {
+                actions.append(&mut handle.join().expect("post-install classification panicked")?);
+            }
+            Ok(actions)
+        })?;
+
+        let mut strip_list: Vec<u8> = Vec::new();
+        let mut strip_debug_list: Vec<u8> = Vec::new();
+        let mut compress_list: Vec<u8> = Vec::new();
+        let (mut stripped, mut compressed) = (0, 0);
+        for (file, action) in files.iter().zip(actions) {
+            let list = match action {
+                PostInstallAction::None => continue,
+                PostInstallAction::Strip => {
+                    stripped += 1;
+                    &mut strip_list
+                }
+                PostInstallAction::StripDebug => {
+                    stripped += 1;
+                    &mut strip_debug_list
+                }
+                PostInstallAction::Compress => {
+                    compressed += 1;
+                    &mut compress_list
+                }
+            };
+
+            list.extend_from_slice(file.as_os_str().as_encoded_bytes());
+            list.push(0);
+        }
+
+        let lists_path = recipe_path.join("post_install");
+        force_rm(&lists_path).context("Failed to clean post-install dir")?;
+        create_dir_all(&lists_path).context("Failed to create post-install dir")?;
+        write(lists_path.join("strip.list"), strip_list).context("Failed to write strip list")?;
+        write(lists_path.join("strip_debug.list"), strip_debug_list).context("Failed to write strip list")?;
+        write(lists_path.join("compress.list"), compress_list).context("Failed to write compress list")?;
+
+        let debug_path = recipe_path.join("debug");
+        create_dir_all(&debug_path).context("Failed to create debug dir")?;
+
+        runtime_config.output_config = Some(OutputConfig {
+            quiet: !self.common.verbose,
+            log_path: Some(recipe_path.join("logs").join("post_install.log")),
+        });
+        runtime_config.mounts.push(Mount::new(&lists_path, "/chariot/post_install").read_only());
+        runtime_config.mounts.push(Mount::new(&debug_path, "/chariot/debug"));
+
+        // Debug info is split out into the debug dir before stripping, xargs fans the work out across files
+        runtime_config
+            .run_shell(
+                r#"
+                cd /chariot/install
+                strip_files() {
+                    xargs -0 -r -P "$PARALLELISM" -n 16 sh -ec '
+                        mode="$0"
+                        for file; do
+                            mkdir -p "/chariot/debug/$(dirname "$file")"
+                            ${OBJCOPY:-objcopy} --only-keep-debug "$file" "/chariot/debug/$file.debug"
+                            ${STRIP:-strip} "$mode" --remove-section=.gnu_debuglink "$file"
+                            ${OBJCOPY:-objcopy} --add-gnu-debuglink="/chariot/debug/$file.debug" "$file"
+                        done
+                    ' "$1" < "$2"
+                }
+                strip_files --strip-unneeded /chariot/post_install/strip.list
+                strip_files --strip-debug /chariot/post_install/strip_debug.list
+                xargs -0 -r -P "$PARALLELISM" -n 32 gzip -9nf < /chariot/post_install/compress.list
+                "#,
+            )
+            .context("Failed to run post-install")?;
+
+        runtime_config.mounts.truncate(runtime_config.mounts.len() - 2);
+        force_rm(&lists_path).context("Failed to clean post-install dir")?;
+
+        // Retarget man page symlinks to the compressed pages
+        if compress_man {
+            for link in man_links {
+                let link_path = install_path.join(&link);
+                let target = read_link(&link_path).with_context(|| format!("Failed to read link `{}`", link_path.to_string_lossy()))?;
+                if target.extension().is_some_and(|ext| ext == "gz") {
+                    continue;
+                }
+
+                let mut compressed_target = target.clone().into_os_string();
+                compressed_target.push(".gz");
+                let compressed_target = PathBuf::from(compressed_target);
+
+                let resolved_target = match compressed_target.strip_prefix("/") {
+                    Ok(relative) => install_path.join(relative),
+                    Err(_) => link_path.parent().unwrap().join(&compressed_target),
+                };
+                if !exists(&resolved_target)? {
+                    continue;
+                }
+
+                let mut compressed_link = link_path.clone().into_os_string();
+                compressed_link.push(".gz");
+
+                remove_file(&link_path).with_context(|| format!("Failed to remove link `{}`", link_path.to_string_lossy()))?;
+                symlink(&compressed_target, &compressed_link).with_context(|| format!("Failed to symlink `{}`", link_path.to_string_lossy()))?;
+            }
+        }
+
+        info!("Post-install stripped {} file(s), compressed {} page(s), pruned {} path(s)", stripped, compressed, pruned);
+
+        Ok(())
+    }
+}
+
+fn prune_tree(root: &Path, dir: &Path, patterns: &Vec<Pattern>) -> Result<u64> {
+    let mut pruned = 0;
+    for entry in read_dir(dir).with_context(|| format!("Failed to read directory `{}`", dir.to_string_lossy()))? {
+        let entry = entry?;
+        let path = entry.path();
+        let relative_path = path.strip_prefix(root)?;
+
+        if patterns.iter().any(|pattern| pattern.matches_path(relative_path)) {
+            force_rm(&path)?;
+            pruned += 1;
+            continue;
+        }
+
+        if entry.file_type()?.is_dir() {
+            pruned += prune_tree(root, &path, patterns)?;
+        }
+    }
+    Ok(pruned)
+}
+
+fn collect_files(root: &Path, dir: &Path, files: &mut Vec<PathBuf>, man_links: &mut Vec<PathBuf>) -> Result<()> {
+    for entry in read_dir(root.join(dir)).with_context(|| format!("Failed to read directory `{}`", root.join(dir).to_string_lossy()))? {
+        let entry = entry?;
+        let file_type = entry.file_type()?;
+        let path = dir.join(entry.file_name());
+
+        if file_type.is_dir() {
+            collect_files(root, &path, files, man_links)?;
+        } else if file_type.is_symlink() {
+            if is_manual_page(&path) {
+                man_links.push(path);
+            }
+        } else if file_type.is_file() {
+            files.push(path);
+        }
+    }
+    Ok(())
+}
+
+fn is_manual_page(path: &Path) -> bool {
+    let components: Vec<Component> = path.components().collect();
+    let in_docs = components
+        .windows(2)
+        .any(|pair| pair[0].as_os_str() == "share" && (pair[1].as_os_str() == "man" || pair[1].as_os_str() == "info"));
+    if !in_docs {
+        return false;
+    }
+
+    if path.file_name().is_some_and(|name| name == "dir") {
+        return false;
+    }
+
+    !path.extension().is_some_and(|ext| ext == "gz" || ext == "bz2" || ext == "xz" || ext == "zst")
+}
+
+fn classify_file(root: &Path, path: &Path, strip: bool, compress_man: bool) -> Result<PostInstallAction> {
+    if compress_man && is_manual_page(path) {
+        return Ok(PostInstallAction::Compress);
+    }
+
+    if !strip {
+        return Ok(PostInstallAction::None);
+    }
+
+    let mut header = [0u8; 18];
+    let mut file = File::open(root.join(path)).with_context(|| format!("Failed to open `{}`", path.to_string_lossy()))?;
+    let mut read = 0;
+    while read < header.len() {
+        let count = file.read(&mut header[read..])?;
+        if count == 0 {
+            return Ok(PostInstallAction::None);
+        }
+        read += count;
+    }
+
+    if &header[..4] != b"\x7fELF" {
+        return Ok(PostInstallAction::None);
+    }
+
+    // e_type: relocatable objects (and kernel modules) only lose debug info
+    Ok(match u16::from_le_bytes([header[16], header[17]]) {
+        1 => PostInstallAction::StripDebug,
+        2 | 3 => PostInstallAction::Strip,
+        _ => PostInstallAction::None,
+    })
+}
@@ -0,0 +1,93 @@
+use std::{
+    fs::{create_dir_all, exists, metadata, read_to_string},
+    path::Path,
+};
+
+use anyhow::{bail, Context, Result};
+use thiserror::Error;
+
+use crate::{
+    config::{ConfigPrebuilt, ConfigRecipe},
+    events::{self, Event},
+    runtime::{CpuPlacement, Mount, OutputConfig, RuntimeConfig},
+    util::force_rm,
+    ChariotBuildContext,
+};
+
+// Kept apart from other prebuilt failures, a wrong archive is only replaced by a build from the scripts when that was asked for
+#[derive(Error, Debug)]
+#[error("Prebuilt `{prebuilt}` does not match its checksum, expected b2sum `{expected}` but got `{actual}`")]
+pub struct PrebuiltMismatch {
+    pub prebuilt: String,
+    pub expected: String,
+    pub actual: String,
+}
+
+impl ChariotBuildContext {
+    // Unpacks a prebuilt archive of the install dir, returns where it came from and its checksum
+    pub fn recipe_prebuilt(&self, recipe: &ConfigRecipe, recipe_path: &Path, prebuilt: &ConfigPrebuilt, log_path: &Path, cpu_placement: Option<CpuPlacement>) -> Result<(String, String)> {
+        let aux_dir = recipe_path.join("aux");
+        force_rm(&aux_dir).context("Failed to clean recipe auxiliary dir")?;
+        create_dir_all(&aux_dir).context("Failed to create recipe auxiliary dir")?;
+
+        let mut runtime_config = RuntimeConfig::new(self.common.rootfs.root())
+            .set_cwd("/chariot/recipe")
+            .add_mount(Mount::new(recipe_path, "/chariot/recipe"))
+            .set_cpu_placement(cpu_placement)
+            .set_output_config(OutputConfig {
+                quiet: !self.common.verbose,
+                log_path: Some(log_path.to_path_buf()),
+            });
+
+        let (source, b2sum, archive) = match prebuilt {
+            ConfigPrebuilt::Url { url, b2sum } => {
+                runtime_config
+                    .run_shell(format!("wget --no-hsts -qO /chariot/recipe/aux/prebuilt {}", url))
+                    .context("Failed to fetch (wget) prebuilt")?;
+                if events::enabled() {
+                    let bytes = metadata(aux_dir.join("prebuilt")).map(|meta| meta.len()).unwrap_or(0);
+                    events::emit(Event::Download { what: &recipe.to_string(), bytes });
+                }
+                (url, Some(b2sum), "/chariot/recipe/aux/prebuilt")
+            }
+            ConfigPrebuilt::Path { path, b2sum } => {
+                if !exists(path)? {
+                    bail!("Prebuilt `{}` not found", path);
+                }
+
+                // Mountpoints are created before anything is mounted, so it cannot go below the recipe mount
+                runtime_config.mounts.push(Mount::new(path, "/chariot/prebuilt").is_file().read_only());
+                (path, b2sum.as_ref(), "/chariot/prebuilt")
+            }
+        };
+
+        // Local archives without a checksum are trusted, the checksum is still recorded so the state tells which archive was used
+        runtime_config
+            .run_shell(format!("b2sum {} > /chariot/recipe/aux/b2sums.txt", archive))
+            .context("Failed to checksum prebuilt")?;
+        let b2sums = read_to_string(aux_dir.join("b2sums.txt")).context("Failed to read b2sums.txt")?;
+        let actual = match b2sums.split_whitespace().next() {
+            None => bail!("Empty checksum for prebuilt"),
+            Some(actual) => actual.to_string(),
+        };
+
+        if let Some(expected) = b2sum {
+            if !expected.eq_ignore_ascii_case(&actual) {
+                return Err(PrebuiltMismatch {
+                    prebuilt: source.clone(),
+                    expected: expected.clone(),
+                    actual,
+                }
+                .into());
+            }
+        }
+
+        // Tar picks the compression from the archive itself
+        runtime_config
+            .run_shell(format!("tar --no-same-owner -x -f {} -C /chariot/recipe/install", archive))
+            .context("Failed to extract prebuilt")?;
+
+        force_rm(&aux_dir).context("Failed to clean recipe auxiliary dir")?;
+        Ok((source.clone(), actual))
+    }
+}
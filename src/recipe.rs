@@ -1,18 +1,25 @@
 use std::{
     collections::{BTreeMap, BTreeSet},
-    fs::{create_dir_all, exists, read_to_string, write},
+    fmt::Display,
+    fs::{create_dir_all, exists, metadata, read_to_string, write},
     path::{Path, PathBuf},
+    time::Instant,
 };
 
 use anyhow::{bail, Context, Result};
-use blake3::{Hash, Hasher};
+use blake3::Hash;
 use bytesize::ByteSize;
-use log::info;
+use log::{error, info, warn};
 
 use crate::{
-    config::{ConfigNamespace, ConfigRecipeDependency, ConfigRecipeId, ConfigSourceKind},
-    runtime::{Mount, OutputConfig, RuntimeConfig},
-    util::{dir_changed_at, dir_size, force_rm, force_rm_contents, format_duration, get_timestamp, recursive_copy},
+    access::{access_report, image_package_files, list_files, AccessTarget, AccessTracer},
+    cache::Cache,
+    config::{Config, ConfigNamespace, ConfigPrebuilt, ConfigRecipeDependency, ConfigRecipeId, ConfigSourceKind},
+    events::{self, Event},
+    prebuilt::PrebuiltMismatch,
+    runtime::{folded_stacks, profile_summary, read_profile, Mount, OutputConfig, RuntimeConfig},
+    trace,
+    util::{dir_changed_at, dir_size, file_changed_at, force_rm, force_rm_contents, format_duration, get_timestamp, recursive_copy},
     ChariotBuildContext, ChariotContext,
 };
 
@@ -22,6 +29,17 @@ pub struct RecipeState {
     pub timestamp: u64,
     pub size: u64,
     pub hash: String,
+    pub check: Option<String>,
+    pub outputs: BTreeMap<String, RecipeOutputState>,
+    pub inputs: BTreeMap<String, String>,
+    // Where the prebuilt archive the install tree came from was fetched from and its checksum
+    pub prebuilt: Option<(String, String)>,
+}
+
+#[derive(Clone)]
+pub struct RecipeOutputState {
+    pub hash: String,
+    pub changed: u64,
 }
 
 impl RecipeState {
@@ -42,6 +60,34 @@ impl RecipeState {
         let timestamp = table["timestamp"].as_integer().unwrap_or(0) as u64;
         let size = table["size"].as_integer().unwrap_or(0) as u64;
         let hash = table["hash"].as_str().unwrap_or("");
+        let check = table.get("check").and_then(|v| v.as_str()).map(|v| v.to_string());
+
+        let mut outputs = BTreeMap::new();
+        if let Some(outputs_table) = table.get("outputs").and_then(|v| v.as_table()) {
+            for (output, output_table) in outputs_table {
+                outputs.insert(
+                    output.clone(),
+                    RecipeOutputState {
+                        hash: output_table.get("hash").and_then(|v| v.as_str()).unwrap_or("").to_string(),
+                        changed: output_table.get("changed").and_then(|v| v.as_integer()).unwrap_or(0) as u64,
+                    },
+                );
+            }
+        }
+
+        let mut inputs = BTreeMap::new();
+        if let Some(inputs_table) = table.get("inputs").and_then(|v| v.as_table()) {
+            for (input, value) in inputs_table {
+                inputs.insert(input.clone(), value.as_str().unwrap_or("").to_string());
+            }
+        }
+
+        let prebuilt = table.get("prebuilt").and_then(|v| v.as_table()).map(|prebuilt_table| {
+            (
+                prebuilt_table.get("source").and_then(|v| v.as_str()).unwrap_or("").to_string(),
+                prebuilt_table.get("b2sum").and_then(|v| v.as_str()).unwrap_or("").to_string(),
+            )
+        });
 
         Ok(Some(Self {
             intact,
@@ -49,6 +95,10 @@ impl RecipeState {
             timestamp,
             size,
             hash: hash.to_string(),
+            check,
+            outputs,
+            inputs,
+            prebuilt,
         }))
     }
 
@@ -61,6 +111,29 @@ impl RecipeState {
         state_table.insert(String::from("timestamp"), toml::Value::Integer(state.timestamp as i64));
         state_table.insert(String::from("size"), toml::Value::Integer(state.size as i64));
         state_table.insert(String::from("hash"), toml::Value::String(state.hash));
+        if let Some(check) = state.check {
+            state_table.insert(String::from("check"), toml::Value::String(check));
+        }
+        if !state.outputs.is_empty() {
+            let mut outputs_table = toml::Table::new();
+            for (output, output_state) in state.outputs {
+                let mut output_table = toml::Table::new();
+                output_table.insert(String::from("hash"), toml::Value::String(output_state.hash));
+                output_table.insert(String::from("changed"), toml::Value::Integer(output_state.changed as i64));
+                outputs_table.insert(output, toml::Value::Table(output_table));
+            }
+            state_table.insert(String::from("outputs"), toml::Value::Table(outputs_table));
+        }
+        if !state.inputs.is_empty() {
+            let inputs_table = toml::Table::from_iter(state.inputs.into_iter().map(|(input, value)| (input, toml::Value::String(value))));
+            state_table.insert(String::from("inputs"), toml::Value::Table(inputs_table));
+        }
+        if let Some((source, b2sum)) = state.prebuilt {
+            let mut prebuilt_table = toml::Table::new();
+            prebuilt_table.insert(String::from("source"), toml::Value::String(source));
+            prebuilt_table.insert(String::from("b2sum"), toml::Value::String(b2sum));
+            state_table.insert(String::from("prebuilt"), toml::Value::Table(prebuilt_table));
+        }
         write(&path, toml::to_string(&state_table).context("Failed to serialize recipe state")?).context("Failed to write recipe state")
     }
 }
@@ -77,7 +150,11 @@ impl ChariotBuildContext {
     ) -> Result<Option<u64>> {
         in_flight.push(recipe_id);
 
-        let recipe = &self.common.config.recipes[&recipe_id];
+        let recipe = &self.common.config.recipe(recipe_id);
+        let _span = trace::span("recipe", recipe);
+        if events::enabled() && self.queued_recipes.borrow_mut().insert(recipe_id) {
+            events::emit(Event::RecipeQueued { recipe: &recipe.to_string() });
+        }
         for dep_opt in &recipe.used_options {
             if let Some(valid_values) = dep_opt.1 {
                 let effective_opt = &self.common.effective_options[dep_opt.0];
@@ -91,10 +168,11 @@ impl ChariotBuildContext {
             }
         }
 
-        // Process dependencies
+        // Process dependencies, a recipe installed from its prebuilt only needs the runtime ones
+        let uses_prebuilt = self.common.recipe_uses_prebuilt(recipe_id, self.skip_prebuilts)?;
         let mut latest_recipe_timestamp: u64 = 0;
-        for dependency in &self.common.config.dependency_map[&recipe_id] {
-            let recipe = &self.common.config.recipes[&dependency.recipe_id];
+        for dependency in self.common.recipe_needed_dependencies(recipe_id, uses_prebuilt) {
+            let recipe = &self.common.config.recipe(dependency.recipe_id);
 
             if in_flight.contains(&recipe.id) {
                 bail!("Recursive dependency `{}`", recipe);
@@ -104,11 +182,18 @@ impl ChariotBuildContext {
                 .recipe_process(in_flight.clone(), attempted_recipes, invalidated_recipes, recipe.id, dependency.loose, dependency.optional)
                 .with_context(|| format!("Broken dependency `{}`", recipe))?;
 
-            let timestamp = match result {
+            let mut timestamp = match result {
                 Some(timestamp) => timestamp,
                 None => return Ok(Some(get_timestamp()?)),
             };
 
+            // Dependencies on a single output only care about when that output last changed
+            if let Some(output) = &dependency.output {
+                if let Some(changed) = self.common.recipe_output_changed(recipe.id, output)? {
+                    timestamp = changed;
+                }
+            }
+
             if timestamp > latest_recipe_timestamp {
                 latest_recipe_timestamp = timestamp;
             }
@@ -119,8 +204,22 @@ impl ChariotBuildContext {
 
         // Check invalidation status
         let state = RecipeState::read(&recipe_path).context("Failed to parse recipe state")?;
-        if let Some(state) = state {
+        if let Some(state) = &state {
             if state.intact && !state.invalidated && (loose || state.timestamp >= latest_recipe_timestamp) && (self.ignore_changes || state.hash == recipe_hash.to_string()) {
+                if state.check.as_deref() == Some("pending") && !self.skip_checks && !self.pending_checks.borrow().contains(&recipe_id) {
+                    self.pending_checks.borrow_mut().push(recipe_id);
+                }
+
+                if events::enabled() && self.up_to_date_recipes.borrow_mut().insert(recipe_id) {
+                    let reason = if state.hash != recipe_hash.to_string() {
+                        "recipe changed but changes are ignored"
+                    } else if state.timestamp < latest_recipe_timestamp {
+                        "dependencies changed but the recipe is a loose dependency"
+                    } else {
+                        "state is intact and the hash matches"
+                    };
+                    events::emit(Event::RecipeUpToDate { recipe: &recipe.to_string(), reason });
+                }
                 return Ok(Some(state.timestamp));
             }
         }
@@ -133,9 +232,18 @@ impl ChariotBuildContext {
 
         // Process recipe
         info!("Processing recipe `{}`", recipe);
+        let progress = events::recipe(recipe, &self.common.recipe_effective_options(recipe_id));
+
+        let placement_lease = self.cpu_placer.as_ref().map(|placer| placer.acquire(recipe.to_string()));
+        let cpu_placement = placement_lease.as_ref().map(|lease| lease.placement.clone());
 
         create_dir_all(&recipe_path).context("Failed to create recipe dir")?;
 
+        // Only recorded for recipes that actually get processed, up to date recipes never pay for it
+        let recipe_inputs = self.common.recipe_hash_inputs(recipe_id).context("Failed to collect recipe hash inputs")?;
+
+        let previous_outputs = state.map(|state| state.outputs).unwrap_or_default();
+
         let start_timestamp = get_timestamp()?;
         RecipeState::write(
             &recipe_path,
@@ -145,6 +253,10 @@ impl ChariotBuildContext {
                 timestamp: start_timestamp,
                 size: 0,
                 hash: recipe_hash.to_string(),
+                check: None,
+                outputs: previous_outputs.clone(),
+                inputs: recipe_inputs.clone(),
+                prebuilt: None,
             },
         )?;
 
@@ -152,6 +264,7 @@ impl ChariotBuildContext {
         force_rm(&logs_path).context("Failed to clean logs dir")?;
         create_dir_all(&logs_path).context("Failed to create recipe logs dir")?;
 
+        let mut prebuilt = None;
         match &recipe.namespace {
             ConfigNamespace::Source(src) => {
                 let src_dir = recipe_path.join("src");
@@ -162,14 +275,17 @@ impl ChariotBuildContext {
                 force_rm(&aux_dir).context("Failed to clean source recipe auxiliary dir")?;
                 create_dir_all(&aux_dir).context("Failed to create source recipe auxiliary dir")?;
 
+                let fetch_log_path = logs_path.join("fetch.log");
                 let mut runtime_config = RuntimeConfig::new(self.common.rootfs.root())
                     .set_cwd("/chariot/source")
                     .add_mount(Mount::new(&recipe_path, "/chariot/source"))
+                    .set_cpu_placement(cpu_placement.clone())
                     .set_output_config(OutputConfig {
                         quiet: !self.common.verbose,
-                        log_path: Some(logs_path.join("fetch.log")),
+                        log_path: Some(fetch_log_path.clone()),
                     });
 
+                let fetch_progress = events::stage(recipe, "fetch", Some(&fetch_log_path));
                 match &src.kind {
                     ConfigSourceKind::Local => {
                         if !exists(&src.url)? {
@@ -195,6 +311,10 @@ impl ChariotBuildContext {
                         runtime_config
                             .run_shell(format!("wget --no-hsts -qO /chariot/source/aux/archive {}", src.url))
                             .context("Failed to fetch (wget) tar source")?;
+                        if events::enabled() {
+                            let bytes = metadata(recipe_path.join("aux").join("archive")).map(|meta| meta.len()).unwrap_or(0);
+                            events::emit(Event::Download { what: &recipe.to_string(), bytes });
+                        }
 
                         runtime_config.run_shell("b2sum --check /chariot/source/aux/b2sums.txt").context("b2sums failed for tar source")?;
 
@@ -213,30 +333,43 @@ impl ChariotBuildContext {
                     }
                 }
 
+                fetch_progress.finish();
+
                 if let Some(patch) = &src.patch {
+                    let log_path = logs_path.join("patch.log");
+                    let progress = events::stage(recipe, "patch", Some(&log_path));
                     if !exists(patch)? {
                         bail!("Failed to locate patch file");
                     }
 
                     runtime_config.output_config = Some(OutputConfig {
                         quiet: !self.common.verbose,
-                        log_path: Some(logs_path.join("patch.log")),
+                        log_path: Some(log_path.clone()),
                     });
                     runtime_config.cwd = Path::new("/chariot/source/src").to_path_buf();
                     runtime_config.mounts.push(Mount::new(patch, "/chariot/patch").is_file().read_only());
                     runtime_config.run_shell("patch -p1 -i /chariot/patch").context("Failed to apply patch")?;
+                    progress.finish();
                 }
 
                 if let Some(regenerate) = &src.regenerate {
-                    self.common
+                    let log_path = logs_path.join("regenerate.log");
+                    let profile_path = self.stage_profile_path(recipe.id, &logs_path, "regenerate");
+                    let progress = events::stage(recipe, "regenerate", Some(&log_path));
+                    let result = self
+                        .common
                         .setup_runtime_config(Some(recipe.id), None, None)
                         .context("Failed to setup recipe context")?
+                        .set_cpu_placement(cpu_placement.clone())
                         .set_output_config(OutputConfig {
                             quiet: !self.common.verbose,
-                            log_path: Some(logs_path.join("regenerate.log")),
+                            log_path: Some(log_path.clone()),
                         })
-                        .run_script(regenerate.lang.as_str(), &regenerate.code)
-                        .context("Failed to run regenerate")?;
+                        .set_profile_path(profile_path.clone())
+                        .run_script(regenerate.lang.as_str(), &regenerate.code);
+                    self.stage_profile_report(recipe, "regenerate", &profile_path);
+                    result.context("Failed to run regenerate")?;
+                    progress.finish();
                 }
             }
             ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) | ConfigNamespace::Custom(common) => {
@@ -244,38 +377,122 @@ impl ChariotBuildContext {
                     force_rm_contents(recipe_path.join("build"), None).context("Failed to clean recipe build dir")?;
                 }
                 force_rm_contents(recipe_path.join("install"), None).context("Failed to clean recipe install dir")?;
-
-                let mut prefix = self.prefix.clone();
-                if matches!(recipe.namespace, ConfigNamespace::Tool(_)) {
-                    prefix = String::from("/usr/local");
+                force_rm(recipe_path.join("debug")).context("Failed to clean recipe debug dir")?;
+
+                // A prebuilt archive stands in for configure, build, install and post-install, the scripts are the fallback when it is unusable
+                if let Some(config_prebuilt) = common.prebuilt.as_ref().filter(|_| !self.skip_prebuilts) {
+                    let log_path = logs_path.join("prebuilt.log");
+                    let progress = events::stage(recipe, "prebuilt", Some(&log_path));
+                    match self.recipe_prebuilt(recipe, &recipe_path, config_prebuilt, &log_path, cpu_placement.clone()) {
+                        Ok(provenance) => {
+                            progress.finish();
+                            info!("Installed prebuilt from `{}`", provenance.0);
+                            prebuilt = Some(provenance);
+                        }
+                        Err(err) => {
+                            drop(progress);
+                            if common.configure.is_none() && common.build.is_none() && common.install.is_none() {
+                                return Err(err).context("Failed to install prebuilt");
+                            }
+
+                            match err.downcast_ref::<PrebuiltMismatch>() {
+                                Some(_) if !self.allow_prebuilt_mismatch => {
+                                    return Err(err).context("Failed to install prebuilt, pass --allow-prebuilt-mismatch to build it from its scripts instead");
+                                }
+                                Some(mismatch) => warn!("{}, building `{}` from its scripts instead", mismatch, recipe),
+                                None => warn!("Prebuilt of `{}` is unusable, building it instead: {}", recipe, err),
+                            }
+                            force_rm_contents(recipe_path.join("install"), None).context("Failed to clean recipe install dir")?;
+
+                            // The build dependencies were left out for the prebuilt, the build needs them after all
+                            if uses_prebuilt {
+                                for dependency in self.common.config.dependencies(recipe_id).iter().filter(|dependency| !dependency.runtime) {
+                                    let dep_recipe = &self.common.config.recipe(dependency.recipe_id);
+                                    if in_flight.contains(&dep_recipe.id) {
+                                        bail!("Recursive dependency `{}`", dep_recipe);
+                                    }
+
+                                    self.recipe_process(in_flight.clone(), attempted_recipes, invalidated_recipes, dep_recipe.id, dependency.loose, dependency.optional)
+                                        .with_context(|| format!("Broken dependency `{}`", dep_recipe))?;
+                                }
+                            }
+                        }
+                    }
                 }
 
-                let mut runtime_config = self
-                    .common
-                    .setup_runtime_config(Some(recipe.id), None, None)
-                    .context("Failed to setup recipe context")?
-                    .add_env_var(String::from("PREFIX"), prefix)
-                    .add_env_var(String::from("PARALLELISM"), self.parallelism.to_string());
+                if prebuilt.is_none() {
+                    let mut packages = None;
+                    if common.post_install.strip == Some(true) {
+                        packages = Some(vec![String::from("binutils")]);
+                    }
 
-                for stage in [("configure", &common.configure), ("build", &common.build), ("install", &common.install)] {
-                    let code_block = match stage.1 {
-                        Some(v) => v,
-                        None => continue,
-                    };
+                    let mut runtime_config = self
+                        .common
+                        .setup_runtime_config(Some(recipe.id), packages, None)
+                        .context("Failed to setup recipe context")?
+                        .set_cpu_placement(cpu_placement.clone())
+                        .add_env_var(String::from("PREFIX"), self.recipe_prefix(recipe_id))
+                        .add_env_var(String::from("PARALLELISM"), self.parallelism.to_string());
+
+                    let mut access = None;
+                    if self.trace_access && self.chosen_recipes.contains(&recipe.id) {
+                        let targets = self.recipe_access_targets(recipe.id, &runtime_config).context("Failed to collect dependency files")?;
+                        let mut tracer = AccessTracer::new()?;
+                        for target in &targets {
+                            tracer.watch_target(target).with_context(|| format!("Failed to watch dependency `{}`", target.0))?;
+                        }
+                        access = Some((tracer, targets));
+                    }
 
-                    runtime_config.output_config = Some(OutputConfig {
-                        quiet: !self.common.verbose,
-                        log_path: Some(logs_path.join(stage.0.to_owned() + ".log")),
-                    });
+                    for stage in [("configure", &common.configure), ("build", &common.build), ("install", &common.install)] {
+                        let code_block = match stage.1 {
+                            Some(v) => v,
+                            None => continue,
+                        };
+
+                        let log_path = logs_path.join(stage.0.to_owned() + ".log");
+                        let progress = events::stage(recipe, stage.0, Some(&log_path));
+                        runtime_config.output_config = Some(OutputConfig {
+                            quiet: !self.common.verbose,
+                            log_path: Some(log_path.clone()),
+                        });
+                        runtime_config.profile_path = self.stage_profile_path(recipe.id, &logs_path, stage.0);
+
+                        let result = runtime_config.run_script(&code_block.lang, &code_block.code);
+                        self.stage_profile_report(recipe, stage.0, &runtime_config.profile_path);
+                        result.with_context(|| format!("Failed to run {}", stage.0))?;
+                        progress.finish();
+                    }
+                    runtime_config.profile_path = None;
 
-                    runtime_config.run_script(&code_block.lang, &code_block.code).with_context(|| format!("Failed to run {}", stage.0))?;
+                    if let Some((tracer, targets)) = access {
+                        self.recipe_access_report(recipe, &logs_path, tracer, &targets);
+                    }
+
+                    let log_path = logs_path.join("post_install.log");
+                    let progress = events::stage(recipe, "post_install", Some(&log_path));
+                    self.recipe_post_install(&mut runtime_config, &recipe_path, &common.post_install)
+                        .context("Failed to run post-install")?;
+                    progress.finish();
+                    if common.check.is_some() && !self.skip_checks {
+                        self.pending_checks.borrow_mut().push(recipe.id);
+                    }
                 }
             }
         }
 
+        let end_timestamp = get_timestamp()?;
+        let outputs_progress = events::stage(recipe, "outputs", None);
+        let outputs = self
+            .common
+            .recipe_outputs_split(recipe_id, &previous_outputs, end_timestamp)
+            .context("Failed to split recipe outputs")?;
+        outputs_progress.finish();
+
+        let size_span = trace::span("size", "dir_size");
         let recipe_size = dir_size(&recipe_path).context("Failed to resolve recipe size")?;
+        drop(size_span);
 
-        let end_timestamp = get_timestamp()?;
         RecipeState::write(
             &recipe_path,
             RecipeState {
@@ -284,23 +501,255 @@ impl ChariotBuildContext {
                 timestamp: end_timestamp,
                 size: recipe_size,
                 hash: recipe_hash.to_string(),
+                check: match &recipe.namespace {
+                    ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) | ConfigNamespace::Custom(common) if common.check.is_some() && prebuilt.is_none() => Some(String::from("pending")),
+                    _ => None,
+                },
+                outputs,
+                inputs: recipe_inputs,
+                prebuilt,
             },
         )?;
 
+        progress.finish(recipe_size);
         info!("Finished in {} ({})", format_duration(end_timestamp - start_timestamp), ByteSize(recipe_size).to_string());
 
         Ok(Some(end_timestamp))
     }
+
+    pub fn recipe_checks_process(&self) -> Result<()> {
+        let pending_checks = self.pending_checks.borrow().clone();
+        if pending_checks.is_empty() {
+            return Ok(());
+        }
+
+        info!("Running {} deferred check(s)", pending_checks.len());
+
+        let mut failed_checks: Vec<ConfigRecipeId> = Vec::new();
+        for recipe_id in pending_checks {
+            let recipe = &self.common.config.recipe(recipe_id);
+            let check = match &recipe.namespace {
+                ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) | ConfigNamespace::Custom(common) => match &common.check {
+                    Some(check) => check,
+                    None => continue,
+                },
+                ConfigNamespace::Source(_) => continue,
+            };
+
+            info!("Checking recipe `{}`", recipe);
+
+            let placement_lease = self.cpu_placer.as_ref().map(|placer| placer.acquire(recipe.to_string()));
+
+            let recipe_path = self.common.path_recipe(recipe_id);
+            let start_timestamp = get_timestamp()?;
+
+            let mut runtime_config = self
+                .common
+                .setup_runtime_config(Some(recipe_id), None, None)
+                .context("Failed to setup recipe context")?
+                .set_cpu_placement(placement_lease.as_ref().map(|lease| lease.placement.clone()))
+                .add_env_var(String::from("PREFIX"), self.recipe_prefix(recipe_id))
+                .add_env_var(String::from("PARALLELISM"), self.parallelism.to_string())
+                .set_output_config(OutputConfig {
+                    quiet: !self.common.verbose,
+                    log_path: Some(recipe_path.join("logs").join("check.log")),
+                })
+                .set_profile_path(self.stage_profile_path(recipe_id, &recipe_path.join("logs"), "check"));
+
+            // Checks only get a read-only view of the build and install trees
+            for mount in runtime_config.mounts.iter_mut() {
+                if mount.to == Path::new("/chariot/build") || mount.to == Path::new("/chariot/install") {
+                    mount.read_only = true;
+                }
+            }
+
+            let log_path = recipe_path.join("logs").join("check.log");
+            let progress = events::stage(recipe, "check", Some(&log_path));
+            let result = runtime_config.run_script(&check.lang, &check.code);
+            self.stage_profile_report(recipe, "check", &runtime_config.profile_path);
+            if result.is_ok() {
+                progress.finish();
+            }
+
+            if let Some(mut state) = RecipeState::read(&recipe_path).context("Failed to parse recipe state")? {
+                state.check = Some(String::from(if result.is_ok() { "passed" } else { "failed" }));
+                RecipeState::write(&recipe_path, state)?;
+            }
+
+            match result {
+                Ok(_) => info!("Check passed in {}", format_duration(get_timestamp()? - start_timestamp)),
+                Err(err) => {
+                    warn!("Check failed for `{}`: {}", recipe, err);
+                    failed_checks.push(recipe_id);
+                }
+            }
+        }
+
+        self.pending_checks.borrow_mut().clear();
+
+        if failed_checks.is_empty() {
+            info!("All checks passed");
+            return Ok(());
+        }
+
+        for recipe_id in &failed_checks {
+            error!(
+                "Check failed `{}` (see {})",
+                self.common.config.recipe(*recipe_id),
+                self.common.path_recipe(*recipe_id).join("logs").join("check.log").to_string_lossy()
+            );
+        }
+
+        bail!("{} check(s) failed", failed_checks.len());
+    }
+
+    fn recipe_prefix(&self, recipe_id: ConfigRecipeId) -> String {
+        match self.common.config.recipe(recipe_id).namespace {
+            ConfigNamespace::Tool(_) => String::from("/usr/local"),
+            _ => self.prefix.clone(),
+        }
+    }
+
+    // Only the recipes passed to build are profiled
+    fn stage_profile_path(&self, recipe_id: ConfigRecipeId, logs_path: &Path, stage: &str) -> Option<PathBuf> {
+        match self.profile && self.chosen_recipes.contains(&recipe_id) {
+            true => Some(logs_path.join(format!("{}.profile.jsonl", stage))),
+            false => None,
+        }
+    }
+
+    // The direct dependencies of a recipe with where their files end up on the host, image packages are resolved through the dpkg file lists
+    fn recipe_access_targets(&self, recipe_id: ConfigRecipeId, runtime_config: &RuntimeConfig) -> Result<Vec<AccessTarget>> {
+        let recipe = self.common.config.recipe(recipe_id);
+        let mut targets = Vec::new();
+        for dependency in self.common.config.dependencies(recipe_id) {
+            let dependency_recipe = self.common.config.recipe(dependency.recipe_id);
+            let recipe_path = self.common.path_recipe(dependency.recipe_id);
+            let target = match &dependency_recipe.namespace {
+                ConfigNamespace::Source(_) | ConfigNamespace::Custom(_) => {
+                    let mount_to = match &dependency_recipe.namespace {
+                        ConfigNamespace::Source(_) => Path::new("/chariot/sources").join(&dependency_recipe.name),
+                        _ => Path::new("/chariot/custom").join(&dependency_recipe.name),
+                    };
+                    match runtime_config.mounts.iter().find(|mount| mount.to == mount_to) {
+                        None => continue,
+                        Some(mount) => (dependency_recipe.to_string(), mount.from.clone(), None),
+                    }
+                }
+                ConfigNamespace::Package(_) => (
+                    dependency_recipe.to_string(),
+                    self.common.cache.path_dependency_cache_packages(),
+                    Some(list_files(&recipe_path.join("install"))?),
+                ),
+                ConfigNamespace::Tool(_) => (
+                    dependency_recipe.to_string(),
+                    self.common.cache.path_dependency_cache_tools(),
+                    Some(list_files(&recipe_path.join("install").join("usr").join("local"))?),
+                ),
+            };
+            if !targets.iter().any(|existing: &AccessTarget| existing.0 == target.0) {
+                targets.push(target);
+            }
+        }
+
+        for image_dependency in &recipe.image_dependencies {
+            match image_package_files(runtime_config.rootfs_path(), &image_dependency.package)? {
+                None => warn!("No file list for image package `{}`, its accesses are not traced", image_dependency.package),
+                Some(files) => targets.push((format!("image/{}", image_dependency.package), runtime_config.rootfs_path().to_path_buf(), Some(files))),
+            }
+        }
+        Ok(targets)
+    }
+
+    // Logs the dependencies that were never opened and writes every opened file per dependency to the recipe logs
+    fn recipe_access_report(&self, recipe: impl Display, logs_path: &Path, tracer: AccessTracer, targets: &[AccessTarget]) {
+        let (opened, complete) = tracer.finish();
+        let report = match access_report(targets, &opened) {
+            Err(err) => {
+                warn!("Failed to report dependency access of `{}`: {}", recipe, err);
+                return;
+            }
+            Ok(report) => report,
+        };
+
+        let mut out = String::new();
+        for (dependency, files, total) in &report {
+            out.push_str(&format!("{}: {} of {} file(s) opened\n", dependency, files.len(), total));
+            for file in files {
+                out.push_str(&format!("  {}\n", file.to_string_lossy()));
+            }
+        }
+        let report_path = logs_path.join("access.txt");
+        if let Err(err) = write(&report_path, out) {
+            warn!("Failed to write dependency access report: {}", err);
+        }
+
+        let unused: Vec<&str> = report.iter().filter(|(_, files, _)| files.is_empty()).map(|(dependency, _, _)| dependency.as_str()).collect();
+        info!(
+            "Dependency access of `{}`: {} of {} dependencies opened, see {}",
+            recipe,
+            report.len() - unused.len(),
+            report.len(),
+            report_path.to_string_lossy()
+        );
+        if !unused.is_empty() {
+            warn!("Dependencies of `{}` that were never opened: {}", recipe, unused.join(", "));
+        }
+        if !complete {
+            warn!("Dependency access of `{}` is incomplete, the inotify watch limit or queue was exceeded", recipe);
+        }
+    }
+
+    // Writes the folded stacks and the summary next to the raw profile, a broken profile never fails the build
+    fn stage_profile_report(&self, recipe: impl Display, stage: &str, profile_path: &Option<PathBuf>) {
+        let profile_path = match profile_path {
+            None => return,
+            Some(profile_path) => profile_path,
+        };
+
+        let result = read_profile(profile_path).and_then(|processes| {
+            let folded_path = profile_path.with_extension("folded");
+            write(&folded_path, folded_stacks(&processes)).context("Failed to write folded stacks")?;
+
+            let summary = profile_summary(&processes, 10);
+            let summary_path = profile_path.with_extension("txt");
+            write(&summary_path, summary.join("\n") + "\n").context("Failed to write profile summary")?;
+
+            info!("Profile of `{}` {}: {}", recipe, stage, summary[0]);
+            for line in summary.iter().skip(1).take_while(|line| !line.starts_with("Process trees")).take(6) {
+                info!("{}", line);
+            }
+            info!("Full profile in {}, flame graph stacks in {}", summary_path.to_string_lossy(), folded_path.to_string_lossy());
+            Ok(())
+        });
+
+        if let Err(err) = result {
+            warn!("Failed to report profile of `{}` {}: {}", recipe, stage, err);
+        }
+    }
 }
 
 impl ChariotContext {
-    pub fn path_recipe(&self, recipe_id: ConfigRecipeId) -> PathBuf {
-        let recipe = &self.config.recipes[&recipe_id];
-        let mut options: BTreeMap<&str, &str> = BTreeMap::new();
-        for opt in &self.config.options_map[&recipe.id] {
-            options.insert(opt.as_str(), self.effective_options[opt].as_str());
+    // Recipe paths only depend on the effective options, so they are computed once for every recipe up front
+    pub fn resolve_recipe_paths(cache: &Cache, config: &Config, effective_options: &BTreeMap<String, String>) -> Vec<PathBuf> {
+        let mut paths = Vec::with_capacity(config.recipes.len());
+        for recipe in &config.recipes {
+            let mut options: BTreeMap<&str, &str> = BTreeMap::new();
+            for opt in config.recipe_options(recipe.id) {
+                options.insert(opt, effective_options[opt].as_str());
+            }
+            paths.push(cache.path_recipe(recipe.namespace.name(), recipe.name.as_str(), &options));
         }
-        self.cache.path_recipe(&recipe.namespace.to_string(), recipe.name.as_str(), &options)
+        paths
+    }
+
+    pub fn path_recipe(&self, recipe_id: ConfigRecipeId) -> &Path {
+        &self.recipe_paths[recipe_id as usize]
+    }
+
+    // The options a recipe is built with, together with the recipe they identify its variant
+    pub fn recipe_effective_options(&self, recipe_id: ConfigRecipeId) -> BTreeMap<String, String> {
+        BTreeMap::from_iter(self.config.recipe_options(recipe_id).map(|opt| (opt.to_string(), self.effective_options[opt].clone())))
     }
 
     pub fn recipe_invalidate(&self, recipe_id: ConfigRecipeId) -> Result<()> {
@@ -318,43 +767,71 @@ impl ChariotContext {
     }
 
     pub fn hash_recipe(&self, recipe_id: ConfigRecipeId) -> Result<Hash> {
-        let recipe = &self.config.recipes[&recipe_id];
-        let data = postcard::to_allocvec(recipe).context("Failed to serialize recipe")?;
-
-        let mut hasher = Hasher::new();
-        hasher.update(&data);
-
-        for dep in &self.config.dependency_map[&recipe.id] {
-            let mut modifiers = String::new();
-            modifiers.push(if dep.loose { 'l' } else { '-' });
-            modifiers.push(if dep.mutable { 'm' } else { '-' });
-            modifiers.push(if dep.runtime { 'r' } else { '-' });
-            hasher.update(modifiers.as_bytes());
-
-            let dep_recipe = &self.config.recipes[&dep.recipe_id];
-            hasher.update(dep_recipe.to_string().as_bytes());
-        }
-
-        if let ConfigNamespace::Source(source) = &recipe.namespace {
-            if matches!(source.kind, ConfigSourceKind::Local) {
-                let path = PathBuf::from(&source.url);
-                if exists(&path)? {
-                    if let Some((secs, nsecs)) = dir_changed_at(&path)? {
-                        hasher.update(&secs.to_le_bytes());
-                        hasher.update(&nsecs.to_le_bytes());
+        if let Some(hash) = self.recipe_hashes.borrow()[recipe_id as usize] {
+            return Ok(hash);
+        }
+
+        let recipe = &self.config.recipe(recipe_id);
+        let _span = trace::span("hash", recipe);
+        let mut hasher = self.config.recipe_hasher(recipe_id)?;
+        for (_, (secs, nsecs)) in self.recipe_change_times(recipe_id)? {
+            hasher.update(&secs.to_le_bytes());
+            hasher.update(&nsecs.to_le_bytes());
+        }
+
+        let hash = hasher.finalize();
+        self.recipe_hashes.borrow_mut()[recipe_id as usize] = Some(hash);
+        Ok(hash)
+    }
+
+    // Whether a recipe is going to be installed from its prebuilt, a local archive that does not exist leaves the decision to the attempt
+    pub fn recipe_uses_prebuilt(&self, recipe_id: ConfigRecipeId, skip_prebuilts: bool) -> Result<bool> {
+        match &self.config.recipe(recipe_id).namespace {
+            ConfigNamespace::Source(_) => Ok(false),
+            ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) | ConfigNamespace::Custom(common) => match (&common.prebuilt, skip_prebuilts) {
+                (None, _) | (_, true) => Ok(false),
+                (Some(ConfigPrebuilt::Url { .. }), false) => Ok(true),
+                (Some(ConfigPrebuilt::Path { path, b2sum: _ }), false) => Ok(exists(path)?),
+            },
+        }
+    }
+
+    // The dependencies that have to be processed before a recipe, the build dependencies of a recipe installed from its prebuilt are not
+    pub fn recipe_needed_dependencies(&self, recipe_id: ConfigRecipeId, uses_prebuilt: bool) -> impl Iterator<Item = &ConfigRecipeDependency> {
+        self.config.dependencies(recipe_id).iter().filter(move |dependency| !uses_prebuilt || dependency.runtime)
+    }
+
+    // Change times of the files a recipe reads from outside the config, these are hashed after the recipe definition
+    pub fn recipe_change_times(&self, recipe_id: ConfigRecipeId) -> Result<Vec<(&'static str, (i64, i64))>> {
+        let mut change_times = Vec::new();
+        match &self.config.recipe(recipe_id).namespace {
+            ConfigNamespace::Source(source) => {
+                if matches!(source.kind, ConfigSourceKind::Local) && exists(&source.url)? {
+                    if let Some(changed_at) = dir_changed_at(&source.url)? {
+                        change_times.push(("local_source", changed_at));
+                    }
+                }
+            }
+            ConfigNamespace::Package(common) | ConfigNamespace::Tool(common) | ConfigNamespace::Custom(common) => {
+                if let Some(ConfigPrebuilt::Path { path, b2sum: _ }) = &common.prebuilt {
+                    if let Some(changed_at) = file_changed_at(path)? {
+                        change_times.push(("prebuilt_file", changed_at));
                     }
                 }
             }
         }
-
-        Ok(hasher.finalize())
+        Ok(change_times)
     }
 
     pub fn setup_runtime_config(&self, recipe_id: Option<ConfigRecipeId>, packages: Option<Vec<String>>, recipes: Option<Vec<ConfigRecipeId>>) -> Result<RuntimeConfig> {
+        let _span = trace::span("depcache", "assemble depcache");
+        let start = Instant::now();
+
         // Wipe the current depcache
         force_rm(self.cache.path_dependency_cache_sources()).context("Failed to clean sources depcache")?;
         force_rm(self.cache.path_dependency_cache_packages()).context("Failed to clean package depcache")?;
         force_rm(self.cache.path_dependency_cache_tools()).context("Failed to clean tool depcache")?;
+        force_rm(self.cache.path_dependency_cache_custom()).context("Failed to clean custom depcache")?;
         create_dir_all(self.cache.path_dependency_cache_sources()).context("Failed to create sources depcache")?;
         create_dir_all(self.cache.path_dependency_cache_packages()).context("Failed to create package depcache")?;
         create_dir_all(self.cache.path_dependency_cache_tools()).context("Failed to create tool depcache")?;
@@ -364,7 +841,7 @@ impl ChariotContext {
         // Pool image packages
         let mut image_packages: BTreeSet<String> = BTreeSet::new();
         if let Some(recipe_id) = recipe_id {
-            for dependency in &self.config.recipes[&recipe_id].image_dependencies {
+            for dependency in &self.config.recipe(recipe_id).image_dependencies {
                 image_packages.insert(dependency.package.clone());
             }
         }
@@ -372,9 +849,9 @@ impl ChariotContext {
             image_packages.append(&mut BTreeSet::from_iter(packages.into_iter()));
         }
 
-        let mut installed: Vec<ConfigRecipeId> = Vec::new();
+        let mut installed: Vec<(ConfigRecipeId, Option<String>)> = Vec::new();
         if let Some(recipe_id) = recipe_id {
-            for dependency in &self.config.dependency_map[&recipe_id] {
+            for dependency in self.config.dependencies(recipe_id) {
                 self.install_dependency(&mut mounts, &mut image_packages, &mut installed, dependency)
                     .context("Failed to install dependency")?;
             }
@@ -391,6 +868,7 @@ impl ChariotContext {
                         mutable: false,
                         loose: false,
                         optional: false,
+                        output: None,
                     },
                 )
                 .context("Failed to install dependency")?;
@@ -412,7 +890,7 @@ impl ChariotContext {
         }
 
         if let Some(recipe_id) = recipe_id {
-            let recipe = &self.config.recipes[&recipe_id];
+            let recipe = &self.config.recipe(recipe_id);
 
             for opt in &recipe.used_options {
                 runtime_config.environment.insert(format!("OPTION_{}", opt.0), self.effective_options[opt.0].clone());
@@ -444,13 +922,34 @@ impl ChariotContext {
             }
         }
 
+        // Walking the assembled depcache would cost every build, the sizes recorded by the installed recipes are used instead
+        if events::measured() {
+            let mut bytes = 0;
+            for recipe_id in BTreeSet::from_iter(installed.iter().map(|(recipe_id, _)| *recipe_id)) {
+                if let Some(state) = RecipeState::read(self.path_recipe(recipe_id))? {
+                    bytes += state.size;
+                }
+            }
+            events::emit(Event::DepcacheAssembled {
+                bytes,
+                duration_ms: start.elapsed().as_millis() as u64,
+            });
+        }
+
         Ok(runtime_config)
     }
 
-    fn install_dependency(&self, mounts: &mut Vec<Mount>, image_packages: &mut BTreeSet<String>, installed: &mut Vec<ConfigRecipeId>, dependency: &ConfigRecipeDependency) -> Result<()> {
-        let recipe = &self.config.recipes[&dependency.recipe_id];
-        if !installed.contains(&dependency.recipe_id) {
-            installed.push(recipe.id);
+    fn install_dependency(
+        &self,
+        mounts: &mut Vec<Mount>,
+        image_packages: &mut BTreeSet<String>,
+        installed: &mut Vec<(ConfigRecipeId, Option<String>)>,
+        dependency: &ConfigRecipeDependency,
+    ) -> Result<()> {
+        let recipe = &self.config.recipe(dependency.recipe_id);
+        let key = (dependency.recipe_id, dependency.output.clone());
+        if !installed.contains(&key) && !installed.contains(&(dependency.recipe_id, None)) {
+            installed.push(key);
 
             for dep_opt in &recipe.used_options {
                 if let Some(valid_values) = dep_opt.1 {
@@ -478,14 +977,41 @@ impl ChariotContext {
                 ConfigNamespace::Package(_) => {
                     let package_depcache_path = self.cache.path_dependency_cache_packages();
                     create_dir_all(&package_depcache_path).context("Failed to create package depcache")?;
-                    recursive_copy(self.path_recipe(recipe.id).join("install"), &package_depcache_path).context("Failed to copy package to package depcache dir")?;
+                    match dependency.output.as_deref() {
+                        None => recursive_copy(self.path_recipe(recipe.id).join("install"), &package_depcache_path).context("Failed to copy package to package depcache dir")?,
+                        Some("debug") => self
+                            .install_recipe_output(recipe.id, "debug", Path::new(""), &package_depcache_path.join("usr").join("lib").join("debug"))
+                            .context("Failed to copy package debug output to package depcache dir")?,
+                        Some(output) => self
+                            .install_recipe_output(recipe.id, output, Path::new(""), &package_depcache_path)
+                            .context("Failed to copy package output to package depcache dir")?,
+                    }
                 }
                 ConfigNamespace::Tool(_) => {
                     let tool_depcache_path = self.cache.path_dependency_cache_tools();
                     create_dir_all(&tool_depcache_path).context("Failed to create tool depcache")?;
-                    recursive_copy(self.path_recipe(recipe.id).join("install").join("usr").join("local"), &tool_depcache_path).context("Failed to copy tool to tool depcache dir")?;
+                    match dependency.output.as_deref() {
+                        None => recursive_copy(self.path_recipe(recipe.id).join("install").join("usr").join("local"), &tool_depcache_path).context("Failed to copy tool to tool depcache dir")?,
+                        Some("debug") => self
+                            .install_recipe_output(recipe.id, "debug", Path::new("usr/local"), &tool_depcache_path.join("lib").join("debug"))
+                            .context("Failed to copy tool debug output to tool depcache dir")?,
+                        Some(output) => self
+                            .install_recipe_output(recipe.id, output, Path::new("usr/local"), &tool_depcache_path)
+                            .context("Failed to copy tool output to tool depcache dir")?,
+                    }
                 }
-                ConfigNamespace::Custom(_) => mounts.push(Mount::new(self.path_recipe(recipe.id).join("install"), Path::new("/chariot/custom").join(&recipe.name)).read_only()),
+                ConfigNamespace::Custom(_) => match &dependency.output {
+                    None => mounts.push(Mount::new(self.path_recipe(recipe.id).join("install"), Path::new("/chariot/custom").join(&recipe.name)).read_only()),
+                    Some(output) => {
+                        let custom_depcache_path = self.cache.path_dependency_cache_custom().join(&recipe.name);
+                        create_dir_all(&custom_depcache_path).context("Failed to create custom depcache")?;
+                        self.install_recipe_output(recipe.id, output, Path::new(""), &custom_depcache_path)
+                            .context("Failed to copy custom output to custom depcache dir")?;
+                        if !mounts.iter().any(|mount| mount.from == custom_depcache_path) {
+                            mounts.push(Mount::new(&custom_depcache_path, Path::new("/chariot/custom").join(&recipe.name)).read_only());
+                        }
+                    }
+                },
             }
         }
 
@@ -497,7 +1023,7 @@ impl ChariotContext {
             image_packages.insert(image_dep.package.clone());
         }
 
-        for dependency in &self.config.dependency_map[&dependency.recipe_id] {
+        for dependency in self.config.dependencies(dependency.recipe_id) {
             if !dependency.runtime {
                 continue;
             }
@@ -1,6 +1,7 @@
 use std::{
     collections::BTreeSet,
-    fs::{create_dir_all, exists, read_to_string, write},
+    fs::{create_dir_all, exists, metadata, read_to_string, write},
+    os::unix::fs::MetadataExt,
     path::PathBuf,
     process::{Command, Stdio},
     rc::Rc,
@@ -11,6 +12,7 @@ use log::{info, warn};
 
 use crate::{
     cache::Cache,
+    events::{self, Event},
     runtime::{Mount, OutputConfig, RuntimeConfig},
     util::{force_rm, recursive_hardlink},
 };
@@ -59,7 +61,22 @@ pub struct RootFS {
 }
 
 impl Cache {
-    pub fn rootfs_init(self: Rc<Cache>, version: String, root_packages: BTreeSet<String>, verbose: bool) -> Result<Rc<RootFS>> {
+    // A local archive replaces the release download, it has to be initialized already so nothing gets installed into it.
+    // The root packages are then assumed to be part of the archive, the state only records the packages chariot installed itself.
+    pub fn rootfs_init(self: Rc<Cache>, version: String, archive: Option<PathBuf>, root_packages: BTreeSet<String>, verbose: bool) -> Result<Rc<RootFS>> {
+        let installed_packages = match &archive {
+            None => root_packages.clone(),
+            Some(_) => BTreeSet::new(),
+        };
+
+        let version = match &archive {
+            None => version,
+            Some(archive) => {
+                let meta = metadata(archive).with_context(|| format!("Failed to fetch metadata of rootfs archive `{}`", archive.to_string_lossy()))?;
+                format!("local:{}:{}:{}", archive.to_string_lossy(), meta.len(), meta.mtime())
+            }
+        };
+
         let mut reset = true;
         let state_path = self.path_rootfs().join("state.toml");
         if exists(&state_path)? {
@@ -74,13 +91,13 @@ impl Cache {
                 let packages_match = match current_root_packages {
                     Some(packages) => {
                         let mut ok = true;
-                        if packages.len() != root_packages.len() {
+                        if packages.len() != installed_packages.len() {
                             ok = false;
                         } else {
                             for package in packages {
                                 let package = package.as_str().unwrap_or("");
 
-                                if root_packages.contains(&String::from(package)) {
+                                if installed_packages.contains(&String::from(package)) {
                                     continue;
                                 }
 
@@ -106,29 +123,22 @@ impl Cache {
             }
         }
 
+        events::emit(match reset {
+            true => Event::CacheMiss { cache: "rootfs" },
+            false => Event::CacheHit { cache: "rootfs" },
+        });
+
         if reset {
             info!("Fetching rootfs");
 
             self.rootfs_wipe()?;
             create_dir_all(self.path_rootfs()).context("Failed to create rootfs directory")?;
 
-            let archive_path = self.path_rootfs().join("rootfs.tar.zst");
-            let res = Command::new("wget")
-                .args([
-                    "-O",
-                    archive_path.to_str().unwrap(),
-                    format!("https://github.com/elysium-os/chariot-rootfs/releases/download/{}/rootfs-amd64.tar.xz", version).as_str(),
-                ])
-                .stdout(match verbose {
-                    true => Stdio::inherit(),
-                    false => Stdio::piped(),
-                })
-                .output()
-                .context("Failed to wget rootfs archive")?;
-
-            if !res.status.success() {
-                bail!("Failed to wget rootfs archive: {}", String::from_utf8(res.stderr).unwrap_or(String::from("Failed to parse stderr")));
-            }
+            let is_local = archive.is_some();
+            let archive_path = match archive {
+                Some(archive) => archive,
+                None => self.fetch_rootfs_archive(&version, verbose)?,
+            };
 
             info!("Extracting rootfs");
             let rootfs_path = self.path_rootfs().join("rootfs");
@@ -145,38 +155,43 @@ impl Cache {
                 bail!("Failed to extract root archive: {}", String::from_utf8(res.stderr).unwrap_or(String::from("Failed to parse stderr")));
             }
 
-            info!("Initializing rootfs");
-            let package_cache_path = self.path_rootfs().join("pkg_cache");
-            create_dir_all(&package_cache_path).context("Failed to create rootfs dir")?;
+            if !is_local {
+                info!("Initializing rootfs");
+                let package_cache_path = self.path_rootfs().join("pkg_cache");
+                create_dir_all(&package_cache_path).context("Failed to create rootfs dir")?;
 
-            let runtime_config = RuntimeConfig::new(&rootfs_path)
-                .root_user()
-                .rw()
-                .set_output_config(crate::runtime::OutputConfig {
-                    log_path: Some(self.path_rootfs().join("init.log")),
-                    quiet: !verbose,
-                })
-                .add_mount(Mount::new(&package_cache_path, "/var/cache/apt/archives"));
-
-            runtime_config.run_shell("echo 'en_US.UTF-8 UTF-8' > /etc/locale.gen")?;
-            runtime_config.run_shell(
-                "echo '
-                    APT::Install-Suggests \"0\";
-                    APT::Install-Recommends \"0\";
-                    APT::Sandbox::User \"root\";
-                    Acquire::Check-Valid-Until \"0\";
-                    ' > /etc/apt/apt.conf",
-            )?;
-
-            runtime_config.run_shell("apt-get update")?;
-            runtime_config.run_shell("apt-get install -y locales")?;
-            runtime_config.run_shell("locale-gen")?;
-            runtime_config.run_shell(String::from("apt-get install -y ") + root_packages.iter().cloned().collect::<Vec<String>>().join(" ").as_str())?;
+                let runtime_config = RuntimeConfig::new(&rootfs_path)
+                    .root_user()
+                    .rw()
+                    .set_output_config(crate::runtime::OutputConfig {
+                        log_path: Some(self.path_rootfs().join("init.log")),
+                        quiet: !verbose,
+                    })
+                    .add_mount(Mount::new(&package_cache_path, "/var/cache/apt/archives"));
+
+                runtime_config.run_shell("echo 'en_US.UTF-8 UTF-8' > /etc/locale.gen")?;
+                runtime_config.run_shell(
+                    "echo '
+                        APT::Install-Suggests \"0\";
+                        APT::Install-Recommends \"0\";
+                        APT::Sandbox::User \"root\";
+                        Acquire::Check-Valid-Until \"0\";
+                        ' > /etc/apt/apt.conf",
+                )?;
+
+                runtime_config.run_shell("apt-get update")?;
+                runtime_config.run_shell("apt-get install -y locales")?;
+                runtime_config.run_shell("locale-gen")?;
+                runtime_config.run_shell(String::from("apt-get install -y ") + installed_packages.iter().cloned().collect::<Vec<String>>().join(" ").as_str())?;
+            }
 
             let mut state_table = toml::Table::new();
             state_table.insert(String::from("intact"), toml::Value::Boolean(true));
             state_table.insert(String::from("version"), toml::Value::String(version));
-            state_table.insert(String::from("root_pkgs"), toml::Value::Array(root_packages.iter().map(|v| toml::Value::String(v.clone())).collect()));
+            state_table.insert(
+                String::from("root_pkgs"),
+                toml::Value::Array(installed_packages.iter().map(|v| toml::Value::String(v.clone())).collect()),
+            );
 
             write(&state_path, toml::to_string(&state_table).context("Failed to serialize rootfs state")?).context("Failed to write rootfs state")?;
 
@@ -186,6 +201,32 @@ impl Cache {
         Ok(Rc::new(RootFS { cache: self, root_packages }))
     }
 
+    fn fetch_rootfs_archive(&self, version: &str, verbose: bool) -> Result<PathBuf> {
+        let archive_path = self.path_rootfs().join("rootfs.tar.zst");
+        let res = Command::new("wget")
+            .args([
+                "-O",
+                archive_path.to_str().unwrap(),
+                format!("https://github.com/elysium-os/chariot-rootfs/releases/download/{}/rootfs-amd64.tar.xz", version).as_str(),
+            ])
+            .stdout(match verbose {
+                true => Stdio::inherit(),
+                false => Stdio::piped(),
+            })
+            .output()
+            .context("Failed to wget rootfs archive")?;
+
+        if !res.status.success() {
+            bail!("Failed to wget rootfs archive: {}", String::from_utf8(res.stderr).unwrap_or(String::from("Failed to parse stderr")));
+        }
+        if events::enabled() {
+            let bytes = metadata(&archive_path).map(|meta| meta.len()).unwrap_or(0);
+            events::emit(Event::Download { what: "rootfs", bytes });
+        }
+
+        Ok(archive_path)
+    }
+
     pub fn rootfs_wipe(&self) -> Result<()> {
         force_rm(self.path_rootfs()).context("Failed to wipe rootfs")
     }
@@ -214,7 +255,13 @@ impl RootFS {
                 intact = table["intact"].as_bool().unwrap_or(false);
             }
 
-            if !exists(&dest_rootfs_path)? || !intact {
+            let reuse = exists(&dest_rootfs_path)? && intact;
+            events::emit(match reuse {
+                true => Event::CacheHit { cache: "rootfs_subset" },
+                false => Event::CacheMiss { cache: "rootfs_subset" },
+            });
+
+            if !reuse {
                 force_rm(&dest_rootfs_path).context("Failed to clean subset")?;
                 create_dir_all(&dest_rootfs_path).context("Failed to create subset dir")?;
 
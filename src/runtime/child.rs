@@ -3,10 +3,15 @@ use std::{
     ffi::CString,
     fs::{create_dir_all, exists, metadata, remove_dir, remove_file, write, File},
     io::{self, Write},
-    os::fd::{AsFd, AsRawFd},
+    os::{
+        fd::{AsFd, AsRawFd},
+        unix::net::UnixListener,
+    },
     panic,
     path::Path,
     process::exit,
+    thread::sleep,
+    time::Duration,
 };
 
 use anyhow::{bail, Context, Result};
@@ -17,10 +22,15 @@ use nix::{
     poll::{poll, PollFd, PollFlags},
     sched::{unshare, CloneFlags},
     sys::wait::{wait, waitpid, WaitPidFlag, WaitStatus},
-    unistd::{chdir, chroot, close, dup2, execvp, fork, getegid, geteuid, pipe, read, setgid, setuid, ForkResult},
+    unistd::{chdir, chroot, close, dup2, execvp, fork, getegid, geteuid, pipe, read, setgid, setuid, ForkResult, Pid},
 };
 
-use super::RuntimeConfig;
+use super::{
+    profile::{Profiler, PROFILE_INTERVAL},
+    pump::OutputPump,
+    session::serve,
+    RuntimeConfig,
+};
 
 pub fn stage1(config: &RuntimeConfig, args: Vec<String>) -> Result<()> {
     let mut log_file = None;
@@ -36,30 +46,61 @@ pub fn stage1(config: &RuntimeConfig, args: Vec<String>) -> Result<()> {
         }
     }
 
+    // Opened on the host, the container init writes the profile after chroot
+    let mut profile_file = None;
+    if let Some(path) = &config.profile_path {
+        profile_file = match File::create(path) {
+            Err(e) => {
+                error!("Failed to create profile file: {}", e);
+                None
+            }
+            Ok(f) => Some(f),
+        }
+    }
+
     let fork_result = unsafe { fork() }.context("Failed to fork")?;
     match fork_result {
-        ForkResult::Child => stage2(config, args, log_file),
-        ForkResult::Parent { child: init_pid } => {
-            let i = waitpid(init_pid, None).context("Failed to waitpid")?;
-            match i {
-                WaitStatus::Exited(_, code) => {
-                    if code == 0 {
-                        return Ok(());
-                    }
-                    bail!("Runtime exited with non-zero error code `{}`", code);
-                }
-                _ => bail!("Runtime process failed"),
+        ForkResult::Child => stage2(config, || stage3(config, args, log_file, profile_file)),
+        ForkResult::Parent { child: init_pid } => wait_runtime(init_pid),
+    }
+}
+
+// Sessions run the same container setup, but the container init serves commands from the listener instead of running a single one
+pub fn session_stage1(config: &RuntimeConfig, listener: UnixListener, idle_timeout: Duration) -> Result<()> {
+    let fork_result = unsafe { fork() }.context("Failed to fork")?;
+    match fork_result {
+        ForkResult::Child => stage2(config, || {
+            enter_container(config);
+            serve(config, listener, idle_timeout)
+        }),
+        ForkResult::Parent { child: init_pid } => wait_runtime(init_pid),
+    }
+}
+
+fn wait_runtime(init_pid: Pid) -> Result<()> {
+    let i = waitpid(init_pid, None).context("Failed to waitpid")?;
+    match i {
+        WaitStatus::Exited(_, code) => {
+            if code == 0 {
+                return Ok(());
             }
+            bail!("Runtime exited with non-zero error code `{}`", code);
         }
+        _ => bail!("Runtime process failed"),
     }
 }
 
-fn stage2(config: &RuntimeConfig, args: Vec<String>, log_file: Option<File>) -> ! {
+// The closure becomes the container init and never returns
+fn stage2(config: &RuntimeConfig, stage3: impl FnOnce()) -> ! {
     panic::set_hook(Box::new(|info| {
         eprintln!("Chariot runtime panic `{}`", info);
         exit(1);
     }));
 
+    if let Some(placement) = &config.cpu_placement {
+        placement.apply().expect("cpu placement failed");
+    }
+
     let euid = geteuid();
     let egid = getegid();
 
@@ -74,7 +115,10 @@ fn stage2(config: &RuntimeConfig, args: Vec<String>, log_file: Option<File>) ->
 
     let fork_result = unsafe { fork() }.expect("second fork failed");
     match fork_result {
-        ForkResult::Child => stage3(config, args, log_file),
+        ForkResult::Child => {
+            stage3();
+            panic!("container init returned");
+        }
         ForkResult::Parent { child: child_pid } => {
             let status = waitpid(child_pid, None).expect("second waitpid failed");
             if let WaitStatus::Exited(_, code) = status {
@@ -85,7 +129,116 @@ fn stage2(config: &RuntimeConfig, args: Vec<String>, log_file: Option<File>) ->
     }
 }
 
-fn stage3(config: &RuntimeConfig, args: Vec<String>, mut log_file: Option<File>) -> ! {
+fn stage3(config: &RuntimeConfig, args: Vec<String>, mut log_file: Option<File>, profile_file: Option<File>) -> ! {
+    enter_container(config);
+
+    let output_config = match &config.output_config {
+        Some(pipe_config) => Some((pipe_config, pipe().expect("log pipe creation failed"))),
+        None => None,
+    };
+
+    let fork_result = unsafe { fork() }.expect("third fork failed");
+    match fork_result {
+        ForkResult::Child => {
+            if let Some(output_config) = &output_config {
+                dup2(output_config.1 .1.as_raw_fd(), STDOUT_FILENO).expect("dup2 stdout failed");
+                dup2(output_config.1 .1.as_raw_fd(), STDERR_FILENO).expect("dup2 stderr failed");
+            };
+
+            set_environment(config);
+
+            let exec_result = execvp(&CString::new(args[0].as_str()).unwrap(), &args.iter().map(|a| CString::new(a.as_str()).unwrap()).collect::<Vec<_>>());
+
+            eprintln!("error while executing program: {}", exec_result.unwrap_err());
+            exit(1);
+        }
+        ForkResult::Parent { child: init_pid } => match (output_config, profile_file.map(Profiler::new)) {
+            (Some(output_config), mut profiler) => {
+                close(output_config.1 .1.as_raw_fd()).expect("close stdout_write_fd failed");
+
+                let mut poll_fds = [PollFd::new(output_config.1 .0.as_fd(), PollFlags::POLLIN)];
+                let mut log_buffer = Vec::new();
+
+                let mut pump = OutputPump::new();
+                let mut buffer = [0u8; 1024];
+                loop {
+                    match waitpid(init_pid, Some(WaitPidFlag::WNOHANG)).expect("waitpid failed") {
+                        WaitStatus::StillAlive => {}
+                        status => {
+                            if let Some(profiler) = profiler.take() {
+                                profiler.finish();
+                            }
+
+                            if let WaitStatus::Exited(_, code) = status {
+                                if code != 0 && output_config.0.quiet {
+                                    error!("Logs for runtime failure");
+                                    io::stdout().write_all(log_buffer.as_slice()).unwrap();
+                                    io::stdout().flush().unwrap();
+                                }
+                                exit(code);
+                            }
+                            panic!("runtime process failed: {:?}", status);
+                        }
+                    }
+
+                    let mut timeout = 300_u16;
+                    if let Some(profiler) = &mut profiler {
+                        profiler.sample();
+                        timeout = PROFILE_INTERVAL.as_millis() as u16;
+                    }
+
+                    let n = poll(&mut poll_fds, timeout).expect("poll failed");
+                    if n == 0 {
+                        continue;
+                    }
+
+                    if poll_fds[0].revents().unwrap().contains(PollFlags::POLLIN) {
+                        let count = read(output_config.1 .0.as_raw_fd(), &mut buffer).expect("pipe read failed");
+                        if count > 0 {
+                            if output_config.0.quiet {
+                                pump.pump(&buffer[..count], &mut log_buffer).unwrap();
+                            } else {
+                                pump.pump(&buffer[..count], &mut std::io::stdout()).unwrap();
+                            }
+                            if !output_config.0.quiet {
+                                std::io::stdout().flush().unwrap();
+                            }
+
+                            if let Some(file) = &mut log_file {
+                                file.write_all(&buffer[..count]).unwrap();
+                                file.flush().unwrap();
+                            }
+                        }
+                    }
+                }
+            }
+            (None, Some(mut profiler)) => loop {
+                match waitpid(init_pid, Some(WaitPidFlag::WNOHANG)).expect("waitpid failed") {
+                    WaitStatus::StillAlive => {
+                        profiler.sample();
+                        sleep(PROFILE_INTERVAL);
+                    }
+                    status => {
+                        profiler.finish();
+                        match status {
+                            WaitStatus::Exited(_, code) => exit(code),
+                            status => panic!("runtime process failed: {:?}", status),
+                        }
+                    }
+                }
+            },
+            (None, None) => {
+                let status = wait().expect("wait failed");
+                match status {
+                    WaitStatus::Exited(_, code) => exit(code),
+                    status => panic!("runtime process failed: {:?}", status),
+                }
+            }
+        },
+    };
+}
+
+fn enter_container(config: &RuntimeConfig) {
     let mut clone_flags = CloneFlags::CLONE_NEWNS;
     if config.network_isolation {
         clone_flags |= CloneFlags::CLONE_NEWNET;
@@ -176,113 +329,28 @@ fn stage3(config: &RuntimeConfig, args: Vec<String>, mut log_file: Option<File>)
 
     chroot(&config.rootfs_path).expect("chroot failed");
     chdir(&config.cwd).expect("chdir failed");
+}
 
-    let output_config = match &config.output_config {
-        Some(pipe_config) => Some((pipe_config, pipe().expect("log pipe creation failed"))),
-        None => None,
-    };
-
-    let fork_result = unsafe { fork() }.expect("third fork failed");
-    match fork_result {
-        ForkResult::Child => {
-            if let Some(output_config) = &output_config {
-                dup2(output_config.1 .1.as_raw_fd(), STDOUT_FILENO).expect("dup2 stdout failed");
-                dup2(output_config.1 .1.as_raw_fd(), STDERR_FILENO).expect("dup2 stderr failed");
-            };
-
-            unsafe {
-                for v in env::vars() {
-                    env::remove_var(v.0);
-                }
-
-                if config.uid.as_raw() == 0 {
-                    env::set_var("PATH", "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin");
-                } else {
-                    env::set_var("PATH", "/usr/local/bin:/usr/bin:/bin");
-                }
-                env::set_var("LD_LIBRARY_PATH", "/usr/local/lib64:/usr/local/lib:/usr/lib64:/usr/lib");
-                env::set_var("HOME", &config.cwd);
-                env::set_var("LANG", "C");
-                env::set_var("LC_COLLATE", "C");
-                env::set_var("TERM", "xterm-256color");
-
-                for (name, value) in config.environment.iter() {
-                    env::set_var(name, value);
-                }
-            }
-
-            let exec_result = execvp(&CString::new(args[0].as_str()).unwrap(), &args.iter().map(|a| CString::new(a.as_str()).unwrap()).collect::<Vec<_>>());
-
-            eprintln!("error while executing program: {}", exec_result.unwrap_err());
-            exit(1);
+// Containers start from a clean environment with only the configured variables
+pub(super) fn set_environment(config: &RuntimeConfig) {
+    unsafe {
+        for v in env::vars() {
+            env::remove_var(v.0);
         }
-        ForkResult::Parent { child: init_pid } => match output_config {
-            Some(output_config) => {
-                close(output_config.1 .1.as_raw_fd()).expect("close stdout_write_fd failed");
-
-                let mut poll_fds = [PollFd::new(output_config.1 .0.as_fd(), PollFlags::POLLIN)];
-                let mut log_buffer = Vec::new();
 
-                let mut start = true;
-                let mut buffer = [0u8; 1024];
-                loop {
-                    match waitpid(init_pid, Some(WaitPidFlag::WNOHANG)).expect("waitpid failed") {
-                        WaitStatus::StillAlive => {}
-                        status => {
-                            if let WaitStatus::Exited(_, code) = status {
-                                if code != 0 && output_config.0.quiet {
-                                    error!("Logs for runtime failure");
-                                    io::stdout().write_all(log_buffer.as_slice()).unwrap();
-                                    io::stdout().flush().unwrap();
-                                }
-                                exit(code);
-                            }
-                            panic!("runtime process failed: {:?}", status);
-                        }
-                    }
-
-                    let n = poll(&mut poll_fds, 300_u16).expect("poll failed");
-                    if n == 0 {
-                        continue;
-                    }
-
-                    if poll_fds[0].revents().unwrap().contains(PollFlags::POLLIN) {
-                        let count = read(output_config.1 .0.as_raw_fd(), &mut buffer).expect("pipe read failed");
-                        if count > 0 {
-                            for b in &buffer[..count] {
-                                if start {
-                                    if output_config.0.quiet {
-                                        log_buffer.write_all("\x1b[0m| ".as_bytes()).unwrap();
-                                    } else {
-                                        std::io::stdout().write_all("\x1b[0m| ".as_bytes()).unwrap();
-                                    }
-                                }
-                                if output_config.0.quiet {
-                                    log_buffer.write(&[*b]).unwrap();
-                                } else {
-                                    std::io::stdout().write(&[*b]).unwrap();
-                                }
-                                start = b.to_ascii_lowercase() as char == '\n';
-                            }
-                            if !output_config.0.quiet {
-                                std::io::stdout().flush().unwrap();
-                            }
-
-                            if let Some(file) = &mut log_file {
-                                file.write_all(&buffer[..count]).unwrap();
-                                file.flush().unwrap();
-                            }
-                        }
-                    }
-                }
-            }
-            None => {
-                let status = wait().expect("wait failed");
-                match status {
-                    WaitStatus::Exited(_, code) => exit(code),
-                    status => panic!("runtime process failed: {:?}", status),
-                }
-            }
-        },
-    };
+        if config.uid.as_raw() == 0 {
+            env::set_var("PATH", "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin");
+        } else {
+            env::set_var("PATH", "/usr/local/bin:/usr/bin:/bin");
+        }
+        env::set_var("LD_LIBRARY_PATH", "/usr/local/lib64:/usr/local/lib:/usr/lib64:/usr/lib");
+        env::set_var("HOME", &config.cwd);
+        env::set_var("LANG", "C");
+        env::set_var("LC_COLLATE", "C");
+        env::set_var("TERM", "xterm-256color");
+
+        for (name, value) in config.environment.iter() {
+            env::set_var(name, value);
+        }
+    }
 }
@@ -1,14 +1,29 @@
 use std::{
     collections::HashMap,
+    os::unix::net::UnixListener,
     path::{Path, PathBuf},
+    time::{Duration, Instant},
 };
 
 use anyhow::{bail, Result};
 use nix::unistd::{Gid, Uid};
 
-use child::stage1;
+use crate::{
+    events::{self, Event},
+    trace,
+};
+use child::{session_stage1, stage1};
+
+pub use placement::{CpuPlacement, CpuPlacer};
+pub use profile::{folded_stacks, profile_summary, read_profile};
+pub use pump::OutputPump;
+pub use session::{attach, SessionRequest};
 
 mod child;
+mod placement;
+mod profile;
+mod pump;
+mod session;
 
 pub struct RuntimeConfig {
     rootfs_path: PathBuf,
@@ -20,6 +35,8 @@ pub struct RuntimeConfig {
     pub mounts: Vec<Mount>,
     pub environment: HashMap<String, String>,
     pub output_config: Option<OutputConfig>,
+    pub cpu_placement: Option<CpuPlacement>,
+    pub profile_path: Option<PathBuf>,
 }
 
 pub struct OutputConfig {
@@ -69,6 +86,8 @@ impl RuntimeConfig {
             mounts: Vec::new(),
             environment: HashMap::new(),
             output_config: None,
+            cpu_placement: None,
+            profile_path: None,
         }
     }
 
@@ -112,6 +131,16 @@ impl RuntimeConfig {
         self
     }
 
+    pub fn set_cpu_placement(mut self, placement: Option<CpuPlacement>) -> RuntimeConfig {
+        self.cpu_placement = placement;
+        self
+    }
+
+    pub fn set_profile_path(mut self, path: Option<PathBuf>) -> RuntimeConfig {
+        self.profile_path = path;
+        self
+    }
+
     pub fn add_mount(mut self, mount: Mount) -> RuntimeConfig {
         self.mounts.push(mount);
         self
@@ -135,6 +164,10 @@ impl RuntimeConfig {
 }
 
 impl RuntimeConfig {
+    pub fn rootfs_path(&self) -> &Path {
+        &self.rootfs_path
+    }
+
     fn relative_rootfs_path(&self, path: &str) -> PathBuf {
         match path.to_string().strip_prefix("/") {
             Some(str) => self.rootfs_path.join(Path::new(str)),
@@ -143,7 +176,21 @@ impl RuntimeConfig {
     }
 
     pub fn run(&self, args: Vec<String>) -> Result<()> {
-        stage1(self, args)
+        let command = args.first().cloned().unwrap_or_default();
+        let _span = trace::span("container", &command);
+        let start = Instant::now();
+        let result = stage1(self, args);
+        events::emit(Event::ContainerFinished {
+            command: &command,
+            duration_ms: start.elapsed().as_millis() as u64,
+            success: result.is_ok(),
+        });
+        result
+    }
+
+    // Keeps the container running and serves commands from the listener until stopped or idle for the timeout
+    pub fn run_session(&self, listener: UnixListener, idle_timeout: Duration) -> Result<()> {
+        session_stage1(self, listener, idle_timeout)
     }
 
     pub fn run_script(&self, language: impl AsRef<str>, script: impl AsRef<str>) -> Result<()> {
@@ -0,0 +1,229 @@
+use std::{
+    cell::{Cell, RefCell},
+    fs::{read_dir, read_to_string},
+};
+
+use anyhow::{bail, Context, Result};
+use log::info;
+use nix::{
+    libc,
+    sched::{sched_getaffinity, sched_setaffinity, CpuSet},
+    unistd::Pid,
+};
+
+const MPOL_PREFERRED: libc::c_int = 1;
+
+#[derive(Clone)]
+pub struct CpuPlacement {
+    pub cpus: Vec<usize>,
+    pub node: Option<usize>,
+}
+
+enum CpuPlacerMode {
+    Fixed(Vec<usize>),
+    Numa(Vec<(usize, Vec<usize>)>),
+}
+
+pub struct CpuPlacer {
+    mode: CpuPlacerMode,
+    active: RefCell<Vec<usize>>,
+    next: Cell<usize>,
+}
+
+pub struct CpuPlacementLease<'a> {
+    placer: &'a CpuPlacer,
+    index: usize,
+    pub placement: CpuPlacement,
+}
+
+impl CpuPlacement {
+    pub fn apply(&self) -> Result<()> {
+        let mut cpuset = CpuSet::new();
+        for cpu in &self.cpus {
+            cpuset.set(*cpu).with_context(|| format!("Invalid cpu `{}`", cpu))?;
+        }
+        sched_setaffinity(Pid::from_raw(0), &cpuset).context("Failed to set cpu affinity")?;
+
+        if let Some(node) = self.node {
+            let mut nodemask = [0 as libc::c_ulong; 16];
+            if node >= nodemask.len() * libc::c_ulong::BITS as usize {
+                bail!("Invalid NUMA node `{}`", node);
+            }
+            nodemask[node / libc::c_ulong::BITS as usize] |= 1 << (node % libc::c_ulong::BITS as usize);
+
+            let res = unsafe { libc::syscall(libc::SYS_set_mempolicy, MPOL_PREFERRED, nodemask.as_ptr(), nodemask.len() * libc::c_ulong::BITS as usize) };
+            if res != 0 {
+                bail!("Failed to set memory policy: {}", std::io::Error::last_os_error());
+            }
+        }
+
+        Ok(())
+    }
+}
+
+impl CpuPlacer {
+    pub fn new(spec: &str) -> Result<CpuPlacer> {
+        let allowed = allowed_cpus().context("Failed to read current cpu affinity")?;
+
+        let mode = match spec {
+            "numa" => {
+                let mut nodes = Vec::new();
+                for entry in read_dir("/sys/devices/system/node").context("Failed to read NUMA topology")? {
+                    let entry = entry?;
+                    let name = entry.file_name().to_string_lossy().to_string();
+                    let node = match name.strip_prefix("node").map(|id| id.parse::<usize>()) {
+                        Some(Ok(node)) => node,
+                        _ => continue,
+                    };
+
+                    let cpulist = read_to_string(entry.path().join("cpulist")).with_context(|| format!("Failed to read cpulist of NUMA node {}", node))?;
+                    let cpus: Vec<usize> = parse_cpu_list(cpulist.trim())?.into_iter().filter(|cpu| allowed.contains(cpu)).collect();
+                    if cpus.is_empty() {
+                        continue;
+                    }
+
+                    nodes.push((node, cpus));
+                }
+                nodes.sort();
+
+                if nodes.is_empty() {
+                    bail!("No usable NUMA nodes found");
+                }
+
+                info!("Detected {} usable NUMA node(s)", nodes.len());
+                CpuPlacerMode::Numa(nodes)
+            }
+            cpulist => {
+                let cpus = parse_cpu_list(cpulist)?;
+                for cpu in &cpus {
+                    if !allowed.contains(cpu) {
+                        bail!("Cpu `{}` is not available to chariot", cpu);
+                    }
+                }
+                CpuPlacerMode::Fixed(cpus)
+            }
+        };
+
+        let slots = match &mode {
+            CpuPlacerMode::Fixed(_) => 1,
+            CpuPlacerMode::Numa(nodes) => nodes.len(),
+        };
+
+        Ok(CpuPlacer {
+            mode,
+            active: RefCell::new(vec![0; slots]),
+            next: Cell::new(0),
+        })
+    }
+
+    pub fn acquire(&self, recipe: impl AsRef<str>) -> CpuPlacementLease<'_> {
+        let mut active = self.active.borrow_mut();
+
+        let (index, placement) = match &self.mode {
+            CpuPlacerMode::Fixed(cpus) => {
+                info!("Placing `{}` on cpus {}", recipe.as_ref(), format_cpu_list(cpus));
+                (0, CpuPlacement { cpus: cpus.clone(), node: None })
+            }
+            CpuPlacerMode::Numa(nodes) => {
+                // Recipes are built one at a time, so the load is mostly tied and ties rotate over the nodes. Without that every recipe would land on the first node.
+                let start = self.next.get() % nodes.len();
+                let mut index = start;
+                for i in (start..nodes.len()).chain(0..start) {
+                    if active[i] < active[index] {
+                        index = i;
+                    }
+                }
+                self.next.set(index + 1);
+
+                let (node, cpus) = &nodes[index];
+                info!(
+                    "Placing `{}` on NUMA node {} (cpus {}, {} other recipe(s) on node)",
+                    recipe.as_ref(),
+                    node,
+                    format_cpu_list(cpus),
+                    active[index]
+                );
+                (
+                    index,
+                    CpuPlacement {
+                        cpus: cpus.clone(),
+                        node: Some(*node),
+                    },
+                )
+            }
+        };
+
+        active[index] += 1;
+
+        CpuPlacementLease { placer: self, index, placement }
+    }
+}
+
+impl Drop for CpuPlacementLease<'_> {
+    fn drop(&mut self) {
+        self.placer.active.borrow_mut()[self.index] -= 1;
+    }
+}
+
+fn allowed_cpus() -> Result<Vec<usize>> {
+    let cpuset = sched_getaffinity(Pid::from_raw(0))?;
+
+    let mut cpus = Vec::new();
+    for cpu in 0..CpuSet::count() {
+        if cpuset.is_set(cpu)? {
+            cpus.push(cpu);
+        }
+    }
+    Ok(cpus)
+}
+
+pub fn parse_cpu_list(list: &str) -> Result<Vec<usize>> {
+    let mut cpus = Vec::new();
+    for part in list.split(",") {
+        let part = part.trim();
+        if part.is_empty() {
+            continue;
+        }
+
+        let (start, end) = match part.split_once("-") {
+            None => (part, part),
+            Some(range) => range,
+        };
+
+        let start = start.trim().parse::<usize>().with_context(|| format!("Invalid cpu list entry `{}`", part))?;
+        let end = end.trim().parse::<usize>().with_context(|| format!("Invalid cpu list entry `{}`", part))?;
+        if start > end || end >= CpuSet::count() {
+            bail!("Invalid cpu list entry `{}`", part);
+        }
+
+        cpus.extend(start..=end);
+    }
+
+    cpus.sort();
+    cpus.dedup();
+    if cpus.is_empty() {
+        bail!("Empty cpu list `{}`", list);
+    }
+
+    Ok(cpus)
+}
+
+pub fn format_cpu_list(cpus: &[usize]) -> String {
+    let mut ranges: Vec<String> = Vec::new();
+
+    let mut i = 0;
+    while i < cpus.len() {
+        let start = cpus[i];
+        while i + 1 < cpus.len() && cpus[i + 1] == cpus[i] + 1 {
+            i += 1;
+        }
+
+        match cpus[i] == start {
+            true => ranges.push(start.to_string()),
+            false => ranges.push(format!("{}-{}", start, cpus[i])),
+        }
+        i += 1;
+    }
+
+    ranges.join(",")
+}
@@ -0,0 +1,264 @@
+use std::{
+    collections::BTreeMap,
+    fs::{read, read_dir, read_to_string, File},
+    io::Write,
+    path::Path,
+    time::{Duration, Instant},
+};
+
+use anyhow::{Context, Result};
+use nix::libc;
+use serde::{Deserialize, Serialize};
+
+// The container init samples /proc at this interval, processes living shorter than it can be missed
+pub const PROFILE_INTERVAL: Duration = Duration::from_millis(50);
+
+// Times are relative to the start of the container, cpu time is the user and system time of the process itself
+#[derive(Serialize, Deserialize, Clone)]
+pub struct ProfiledProcess {
+    pub pid: i32,
+    pub ppid: i32,
+    pub argv: Vec<String>,
+    pub start_ms: u64,
+    pub end_ms: u64,
+    pub cpu_ms: u64,
+}
+
+// Runs in the container init, which is pid 1 of the container pid namespace so every process in /proc belongs to the container
+pub struct Profiler {
+    file: File,
+    ticks_per_second: u64,
+    base_ms: u64,
+    start: Instant,
+    last_sample: Option<Instant>,
+    // Keyed by pid and start time since pids get reused
+    processes: BTreeMap<(i32, u64), ProfiledProcess>,
+}
+
+impl Profiler {
+    pub fn new(file: File) -> Profiler {
+        // Process start times in /proc are clock ticks since boot
+        let uptime = read_to_string("/proc/uptime").unwrap_or_default();
+        let uptime = uptime.split_whitespace().next().and_then(|uptime| uptime.parse::<f64>().ok()).unwrap_or(0.0);
+
+        Profiler {
+            file,
+            ticks_per_second: match unsafe { libc::sysconf(libc::_SC_CLK_TCK) } {
+                ticks if ticks > 0 => ticks as u64,
+                _ => 100,
+            },
+            base_ms: (uptime * 1000.0) as u64,
+            start: Instant::now(),
+            last_sample: None,
+            processes: BTreeMap::new(),
+        }
+    }
+
+    pub fn sample(&mut self) {
+        if self.last_sample.is_some_and(|last_sample| last_sample.elapsed() < PROFILE_INTERVAL) {
+            return;
+        }
+        self.last_sample = Some(Instant::now());
+
+        let now_ms = self.start.elapsed().as_millis() as u64;
+        let entries = match read_dir("/proc") {
+            Err(_) => return,
+            Ok(entries) => entries,
+        };
+
+        for entry in entries.flatten() {
+            let pid = match entry.file_name().to_str().and_then(|name| name.parse::<i32>().ok()) {
+                Some(pid) if pid != 1 => pid,
+                _ => continue,
+            };
+
+            // Processes exit between listing and reading all the time
+            let stat = match read_to_string(format!("/proc/{}/stat", pid)) {
+                Err(_) => continue,
+                Ok(stat) => stat,
+            };
+
+            // The command name can contain spaces and parentheses, the fields after it cannot
+            let (comm, fields) = match stat.split_once('(').and_then(|(_, rest)| rest.rsplit_once(')')) {
+                None => continue,
+                Some(split) => split,
+            };
+            let fields: Vec<&str> = fields.split_whitespace().collect();
+            if fields.len() < 20 {
+                continue;
+            }
+
+            let zombie = fields[0] == "Z";
+            let ppid = fields[1].parse::<i32>().unwrap_or(0);
+            let cpu_ticks = fields[11].parse::<u64>().unwrap_or(0) + fields[12].parse::<u64>().unwrap_or(0);
+            let start_ticks = fields[19].parse::<u64>().unwrap_or(0);
+
+            // Zombies and processes in the middle of an exec have an empty command line
+            let argv: Vec<String> = read(format!("/proc/{}/cmdline", pid))
+                .unwrap_or_default()
+                .split(|b| *b == 0)
+                .filter(|arg| !arg.is_empty())
+                .map(|arg| String::from_utf8_lossy(arg).to_string())
+                .collect();
+
+            let ticks_per_second = self.ticks_per_second;
+            let base_ms = self.base_ms;
+            let process = self.processes.entry((pid, start_ticks)).or_insert_with(|| ProfiledProcess {
+                pid,
+                ppid,
+                argv: vec![comm.to_string()],
+                start_ms: (start_ticks * 1000 / ticks_per_second).saturating_sub(base_ms),
+                end_ms: now_ms,
+                cpu_ms: 0,
+            });
+
+            // Only the last executed image is kept, which for the usual fork and exec is the one doing the work
+            if !argv.is_empty() {
+                process.argv = argv;
+            }
+            process.cpu_ms = cpu_ticks * 1000 / ticks_per_second;
+            if !zombie {
+                process.end_ms = now_ms;
+            }
+        }
+    }
+
+    // Takes a last sample and writes every process seen as one JSON line
+    pub fn finish(mut self) {
+        self.last_sample = None;
+        self.sample();
+
+        let mut data = Vec::new();
+        for process in self.processes.values() {
+            if let Ok(line) = serde_json::to_vec(process) {
+                data.extend(line);
+                data.push(b'\n');
+            }
+        }
+        let _ = self.file.write_all(&data);
+    }
+}
+
+pub fn read_profile(path: impl AsRef<Path>) -> Result<Vec<ProfiledProcess>> {
+    let data = read_to_string(&path).context("Failed to read profile")?;
+    let mut processes: Vec<ProfiledProcess> = data.lines().filter_map(|line| serde_json::from_str(line).ok()).collect();
+
+    // Everything working on the process tree relies on this order
+    processes.sort_by_key(|process| (process.start_ms, process.pid));
+    Ok(processes)
+}
+
+// Parents are resolved by pid, picking the latest process with that pid that comes before the child in start order.
+// Processes whose parent was never sampled become roots.
+fn profile_parents(processes: &[ProfiledProcess]) -> Vec<Option<usize>> {
+    let mut by_pid: BTreeMap<i32, Vec<usize>> = BTreeMap::new();
+    for (i, process) in processes.iter().enumerate() {
+        by_pid.entry(process.pid).or_default().push(i);
+    }
+
+    processes
+        .iter()
+        .enumerate()
+        .map(|(i, process)| by_pid.get(&process.ppid)?.iter().rev().find(|parent| **parent < i).copied())
+        .collect()
+}
+
+fn command_name(process: &ProfiledProcess) -> String {
+    let program = process.argv.first().map(|arg| arg.as_str()).unwrap_or("?");
+    program.rsplit('/').next().unwrap_or(program).to_string()
+}
+
+fn seconds(ms: u64) -> String {
+    format!("{:.1}s", ms as f64 / 1000.0)
+}
+
+// One line per process stack with its own cpu time in milliseconds, the folded format read by flamegraph.pl, inferno and speedscope
+pub fn folded_stacks(processes: &[ProfiledProcess]) -> String {
+    let parents = profile_parents(processes);
+
+    let mut stacks: BTreeMap<String, u64> = BTreeMap::new();
+    for (i, process) in processes.iter().enumerate() {
+        if process.cpu_ms == 0 {
+            continue;
+        }
+
+        let mut frames = vec![command_name(process)];
+        let mut parent = parents[i];
+        while let Some(index) = parent {
+            frames.push(command_name(&processes[index]));
+            parent = parents[index];
+        }
+        frames.reverse();
+        *stacks.entry(frames.join(";")).or_default() += process.cpu_ms;
+    }
+
+    stacks.iter().map(|(stack, cpu_ms)| format!("{} {}\n", stack, cpu_ms)).collect()
+}
+
+// The commands that used the most cpu time, followed by the process trees pruned to the subtrees that took a noticeable share of the stage
+pub fn profile_summary(processes: &[ProfiledProcess], limit: usize) -> Vec<String> {
+    let parents = profile_parents(processes);
+    let mut children: Vec<Vec<usize>> = vec![Vec::new(); processes.len()];
+    let mut roots = Vec::new();
+    for (i, parent) in parents.iter().enumerate() {
+        match parent {
+            Some(parent) => children[*parent].push(i),
+            None => roots.push(i),
+        }
+    }
+
+    // Parents always come before their children, so walking backwards sums every subtree before its parent
+    let mut inclusive_cpu: Vec<u64> = processes.iter().map(|process| process.cpu_ms).collect();
+    let mut subtree_size = vec![1usize; processes.len()];
+    for i in (0..processes.len()).rev() {
+        if let Some(parent) = parents[i] {
+            inclusive_cpu[parent] += inclusive_cpu[i];
+            subtree_size[parent] += subtree_size[i];
+        }
+    }
+
+    let total_cpu: u64 = processes.iter().map(|process| process.cpu_ms).sum();
+    let wall = processes.iter().map(|process| process.end_ms).max().unwrap_or(0);
+    let mut lines = vec![format!("{} process(es), {} cpu over {} wall", processes.len(), seconds(total_cpu), seconds(wall))];
+
+    let mut commands: BTreeMap<String, (usize, u64, u64)> = BTreeMap::new();
+    for process in processes {
+        let command = commands.entry(command_name(process)).or_default();
+        command.0 += 1;
+        command.1 += process.cpu_ms;
+        command.2 += process.end_ms.saturating_sub(process.start_ms);
+    }
+    let mut commands: Vec<(String, (usize, u64, u64))> = commands.into_iter().collect();
+    commands.sort_by(|a, b| b.1 .1.cmp(&a.1 .1).then(b.1 .2.cmp(&a.1 .2)));
+
+    lines.push(String::from("Commands by cpu time:"));
+    for (command, (count, cpu_ms, wall_ms)) in commands.iter().take(limit) {
+        lines.push(format!("  {:>8} cpu {:>8} wall {:>6}x {}", seconds(*cpu_ms), seconds(*wall_ms), count, command));
+    }
+
+    lines.push(String::from("Process trees:"));
+    let threshold = (total_cpu / 100).max(1);
+    let mut stack: Vec<(usize, usize)> = roots.iter().rev().map(|root| (*root, 0)).collect();
+    while let Some((i, depth)) = stack.pop() {
+        let process = &processes[i];
+        // Scripts passed with -c span lines
+        let mut command = process.argv.join(" ").split_whitespace().collect::<Vec<&str>>().join(" ");
+        if command.chars().count() > 120 {
+            command = command.chars().take(117).collect::<String>() + "...";
+        }
+        lines.push(format!(
+            "  {:>8} cpu {:>8} wall {:>6}p {}{}",
+            seconds(inclusive_cpu[i]),
+            seconds(process.end_ms.saturating_sub(process.start_ms)),
+            subtree_size[i],
+            "  ".repeat(depth),
+            command
+        ));
+
+        let mut shown: Vec<usize> = children[i].iter().copied().filter(|child| inclusive_cpu[*child] >= threshold).collect();
+        shown.sort_by_key(|child| inclusive_cpu[*child]);
+        stack.extend(shown.into_iter().map(|child| (child, depth + 1)));
+    }
+
+    lines
+}
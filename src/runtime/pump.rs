@@ -0,0 +1,25 @@
+use std::io::{Result, Write};
+
+const LINE_PREFIX: &[u8] = b"\x1b[0m| ";
+
+// Prefixes every line of container output, chunks read from the pipe do not line up with lines so the pump remembers whether the last one ended a line
+pub struct OutputPump {
+    line_start: bool,
+}
+
+impl OutputPump {
+    pub fn new() -> OutputPump {
+        OutputPump { line_start: true }
+    }
+
+    pub fn pump(&mut self, data: &[u8], out: &mut impl Write) -> Result<()> {
+        for line in data.split_inclusive(|b| *b == b'\n') {
+            if self.line_start {
+                out.write_all(LINE_PREFIX)?;
+            }
+            out.write_all(line)?;
+            self.line_start = line.ends_with(b"\n");
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,265 @@
+use std::{
+    collections::BTreeSet,
+    env,
+    ffi::CString,
+    io::{ErrorKind, IoSlice, IoSliceMut, Read, Write},
+    os::{
+        fd::{AsFd, AsRawFd, FromRawFd, OwnedFd, RawFd},
+        unix::net::{UnixListener, UnixStream},
+    },
+    path::Path,
+    process::exit,
+    sync::atomic::{AtomicI32, Ordering},
+    time::{Duration, Instant},
+};
+
+use anyhow::{bail, Context, Result};
+use nix::{
+    cmsg_space, libc,
+    poll::{poll, PollFd, PollFlags, PollTimeout},
+    sys::{
+        signal::{killpg, signal, SigHandler, Signal},
+        socket::{recvmsg, sendmsg, ControlMessage, ControlMessageOwned, MsgFlags},
+        wait::{waitpid, WaitPidFlag, WaitStatus},
+    },
+    unistd::{chdir, close, dup2, execvp, fork, setpgid, ForkResult, Pid},
+};
+use serde::{Deserialize, Serialize};
+
+use super::{child::set_environment, RuntimeConfig};
+
+// A command for a session container. The standard streams of the client are passed along with it, so the command reads and writes the terminal of
+// the client directly and nothing is relayed.
+#[derive(Serialize, Deserialize)]
+pub struct SessionRequest {
+    pub args: Vec<String>,
+    pub env: Vec<(String, String)>,
+    pub cwd: Option<String>,
+    pub stop: bool,
+}
+
+// Handlers exit with this code after acknowledging a stop request
+const STOP_EXIT_CODE: i32 = 100;
+
+const SERVE_INTERVAL: u16 = 100;
+
+const FORWARDED_SIGNALS: [Signal; 4] = [Signal::SIGINT, Signal::SIGTERM, Signal::SIGQUIT, Signal::SIGHUP];
+
+static SESSION_FD: AtomicI32 = AtomicI32::new(-1);
+
+// Returns `None` when no session is listening on the socket, otherwise the exit code of the command
+pub fn attach(socket_path: &Path, request: &SessionRequest) -> Result<Option<i32>> {
+    let mut stream = match UnixStream::connect(socket_path) {
+        Ok(stream) => stream,
+        Err(err) if matches!(err.kind(), ErrorKind::NotFound | ErrorKind::ConnectionRefused) => return Ok(None),
+        Err(err) => return Err(err).context("Failed to connect to session"),
+    };
+
+    let data = serde_json::to_vec(request).context("Failed to serialize session request")?;
+    let header = (data.len() as u32).to_le_bytes();
+    sendmsg::<()>(stream.as_raw_fd(), &[IoSlice::new(&header)], &[ControlMessage::ScmRights(&[0, 1, 2])], MsgFlags::empty(), None).context("Failed to send session request")?;
+    stream.write_all(&data).context("Failed to send session request")?;
+
+    // Signals meant for the command reach this process, as it is the one in the foreground of the terminal
+    SESSION_FD.store(stream.as_raw_fd(), Ordering::Relaxed);
+    let mut previous = Vec::new();
+    for sig in FORWARDED_SIGNALS {
+        previous.push((sig, unsafe { signal(sig, SigHandler::Handler(forward_signal)) }.context("Failed to install signal handler")?));
+    }
+
+    let mut code = [0u8; 4];
+    let result = stream.read_exact(&mut code);
+
+    for (sig, handler) in previous {
+        unsafe { signal(sig, handler) }.context("Failed to restore signal handler")?;
+    }
+    SESSION_FD.store(-1, Ordering::Relaxed);
+
+    result.context("Session ended before the command finished")?;
+    Ok(Some(i32::from_le_bytes(code)))
+}
+
+extern "C" fn forward_signal(signal: libc::c_int) {
+    let byte = signal as u8;
+    unsafe { libc::write(SESSION_FD.load(Ordering::Relaxed), &byte as *const u8 as *const libc::c_void, 1) };
+}
+
+// Runs as the container init. Every connection gets its own handler process, the init only reaps and exits once stopped or idle for too long,
+// which tears down every process left in the container with it.
+pub(super) fn serve(config: &RuntimeConfig, listener: UnixListener, idle_timeout: Duration) -> ! {
+    listener.set_nonblocking(true).expect("session listener setup failed");
+
+    let mut handlers = BTreeSet::new();
+    let mut last_active = Instant::now();
+    loop {
+        // Orphaned processes of the container are reparented to the init, so not every child is a handler
+        loop {
+            match waitpid(Pid::from_raw(-1), Some(WaitPidFlag::WNOHANG)) {
+                Ok(WaitStatus::Exited(pid, code)) => {
+                    if handlers.remove(&pid) && code == STOP_EXIT_CODE {
+                        exit(0);
+                    }
+                }
+                Ok(WaitStatus::Signaled(pid, _, _)) => {
+                    handlers.remove(&pid);
+                }
+                Ok(WaitStatus::StillAlive) | Err(_) => break,
+                Ok(_) => {}
+            }
+        }
+
+        if !handlers.is_empty() {
+            last_active = Instant::now();
+        } else if last_active.elapsed() >= idle_timeout {
+            exit(0);
+        }
+
+        let _ = poll(&mut [PollFd::new(listener.as_fd(), PollFlags::POLLIN)], SERVE_INTERVAL);
+        let stream = match listener.accept() {
+            Err(_) => continue,
+            Ok((stream, _)) => stream,
+        };
+
+        match unsafe { fork() }.expect("session handler fork failed") {
+            ForkResult::Child => handle(config, stream),
+            ForkResult::Parent { child } => {
+                handlers.insert(child);
+                last_active = Instant::now();
+            }
+        }
+    }
+}
+
+fn handle(config: &RuntimeConfig, mut stream: UnixStream) -> ! {
+    // Listing sessions connects without sending anything
+    let (request, fds) = match receive_request(&mut stream) {
+        Err(err) => {
+            eprintln!("Failed to receive session request: {}", err);
+            exit(1);
+        }
+        Ok(None) => exit(0),
+        Ok(Some(request)) => request,
+    };
+
+    if request.stop {
+        let _ = stream.write_all(&0_i32.to_le_bytes());
+        exit(STOP_EXIT_CODE);
+    }
+
+    let child = match unsafe { fork() }.expect("session command fork failed") {
+        ForkResult::Child => {
+            // Its own process group, so forwarded signals reach everything the command started
+            let _ = setpgid(Pid::from_raw(0), Pid::from_raw(0));
+            for (fd, target) in fds.iter().zip(0..) {
+                dup2(*fd, target).expect("dup2 failed");
+            }
+
+            set_environment(config);
+            for (name, value) in &request.env {
+                unsafe { env::set_var(name, value) };
+            }
+
+            if let Some(cwd) = &request.cwd {
+                if let Err(err) = chdir(cwd.as_str()) {
+                    eprintln!("error while changing into `{}`: {}", cwd, err);
+                    exit(1);
+                }
+            }
+
+            let args: Vec<CString> = request.args.iter().map(|a| CString::new(a.as_str()).unwrap()).collect();
+            match args.first() {
+                None => eprintln!("error while executing program: no command given"),
+                Some(program) => eprintln!("error while executing program: {}", execvp(program, &args).unwrap_err()),
+            }
+            exit(127);
+        }
+        ForkResult::Parent { child } => child,
+    };
+    let _ = setpgid(child, child);
+    for fd in fds {
+        let _ = close(fd);
+    }
+
+    // A pidfd makes the exit of the command wake the poll, without one (before linux 5.3) the exit is polled for
+    let pidfd = match unsafe { libc::syscall(libc::SYS_pidfd_open, child.as_raw(), 0) } {
+        fd if fd >= 0 => Some(unsafe { OwnedFd::from_raw_fd(fd as RawFd) }),
+        _ => None,
+    };
+    let timeout = match pidfd {
+        Some(_) => PollTimeout::NONE,
+        None => PollTimeout::from(10_u16),
+    };
+
+    let mut attached = true;
+    loop {
+        match waitpid(child, Some(WaitPidFlag::WNOHANG)) {
+            Ok(WaitStatus::Exited(_, code)) => reply(&mut stream, code),
+            Ok(WaitStatus::Signaled(_, signal, _)) => reply(&mut stream, 128 + signal as i32),
+            Err(_) => reply(&mut stream, 1),
+            Ok(_) => {}
+        }
+
+        let mut poll_fds = Vec::new();
+        if attached {
+            poll_fds.push(PollFd::new(stream.as_fd(), PollFlags::POLLIN));
+        }
+        if let Some(pidfd) = &pidfd {
+            poll_fds.push(PollFd::new(pidfd.as_fd(), PollFlags::POLLIN));
+        }
+        let _ = poll(&mut poll_fds, timeout);
+
+        let readable = attached && poll_fds[0].revents().is_some_and(|revents| !revents.is_empty());
+        drop(poll_fds);
+        if !readable {
+            continue;
+        }
+
+        // The client sends the signals it receives one byte each and going away kills the command
+        let mut byte = [0u8; 1];
+        match stream.read(&mut byte) {
+            Ok(1) => {
+                if let Ok(signal) = Signal::try_from(byte[0] as i32) {
+                    let _ = killpg(child, signal);
+                }
+            }
+            _ => {
+                let _ = killpg(child, Signal::SIGKILL);
+                attached = false;
+            }
+        }
+    }
+}
+
+fn reply(stream: &mut UnixStream, code: i32) -> ! {
+    let _ = stream.write_all(&code.to_le_bytes());
+    exit(0);
+}
+
+fn receive_request(stream: &mut UnixStream) -> Result<Option<(SessionRequest, Vec<RawFd>)>> {
+    let mut header = [0u8; 4];
+    let mut cmsg_buffer = cmsg_space!([RawFd; 3]);
+    let mut fds = Vec::new();
+    {
+        let mut iov = [IoSliceMut::new(&mut header)];
+        let msg = recvmsg::<()>(stream.as_raw_fd(), &mut iov, Some(&mut cmsg_buffer), MsgFlags::MSG_CMSG_CLOEXEC).context("Failed to receive request header")?;
+        if msg.bytes == 0 {
+            return Ok(None);
+        }
+        if msg.bytes != 4 {
+            bail!("Truncated request header");
+        }
+        for cmsg in msg.cmsgs().context("Failed to receive file descriptors")? {
+            if let ControlMessageOwned::ScmRights(received) = cmsg {
+                fds.extend(received);
+            }
+        }
+    }
+
+    if fds.len() != 3 {
+        bail!("Request did not pass the standard streams");
+    }
+
+    let mut data = vec![0u8; u32::from_le_bytes(header) as usize];
+    stream.read_exact(&mut data).context("Failed to receive request")?;
+    Ok(Some((serde_json::from_slice(&data).context("Failed to parse request")?, fds)))
+}
@@ -0,0 +1,131 @@
+use std::{
+    fs::{create_dir_all, exists, read_dir, rename, File, OpenOptions},
+    os::{
+        fd::AsRawFd,
+        unix::net::{UnixListener, UnixStream},
+    },
+    path::{Path, PathBuf},
+    process::exit,
+    thread::sleep,
+    time::{Duration, Instant},
+};
+
+use anyhow::{bail, Context, Result};
+use log::error;
+use nix::unistd::{dup2, fork, setsid, ForkResult};
+
+use crate::{
+    cache::Cache,
+    runtime::{attach, RuntimeConfig, SessionRequest},
+    util::force_rm,
+};
+
+// Sessions keep a container and the depcache it was started with alive in the background, commands attach to it through the socket in its directory.
+// The session removes its directory once the container is gone.
+const STOP_TIMEOUT: Duration = Duration::from_secs(5);
+
+fn session_path(cache_path: &Path, name: &str) -> PathBuf {
+    cache_path.join("sessions").join(name)
+}
+
+fn socket_path(cache_path: &Path, name: &str) -> PathBuf {
+    session_path(cache_path, name).join("socket")
+}
+
+// Returns false when the session is not running
+pub fn run(cache_path: &Path, name: &str, request: &SessionRequest) -> Result<bool> {
+    match attach(&socket_path(cache_path, name), request).with_context(|| format!("Failed to run command in session `{}`", name))? {
+        None => Ok(false),
+        Some(0) => Ok(true),
+        Some(code) => bail!("Command exited with code `{}` in session `{}`", code, name),
+    }
+}
+
+pub fn start(cache: &Cache, name: &str, mut runtime_config: RuntimeConfig, idle_timeout: Duration) -> Result<()> {
+    let path = session_path(&cache.path(), name);
+    force_rm(&path).context("Failed to clean session")?;
+    create_dir_all(&path).context("Failed to create session")?;
+
+    // The depcache of this process is wiped by the next container setup and removed once the process exits, so the session takes it over
+    let depcache_path = path.join("depcache");
+    if exists(cache.path_dependency_cache())? {
+        rename(cache.path_dependency_cache(), &depcache_path).context("Failed to move depcache into session")?;
+    }
+    for mount in runtime_config.mounts.iter_mut() {
+        if let Ok(relative) = mount.from.strip_prefix(cache.path_dependency_cache()) {
+            mount.from = depcache_path.join(relative);
+        }
+    }
+
+    // Bound before forking, so commands can connect right away and wait for the container to come up
+    let listener = UnixListener::bind(socket_path(&cache.path(), name)).context("Failed to bind session socket")?;
+    let log_file = File::create(path.join("session.log")).context("Failed to create session log")?;
+    let null = OpenOptions::new().read(true).open("/dev/null").context("Failed to open /dev/null")?;
+
+    match unsafe { fork() }.context("Failed to fork")? {
+        ForkResult::Parent { child: _ } => Ok(()),
+        ForkResult::Child => {
+            // A session of its own, interrupting the command that started it kills the process group
+            let _ = setsid();
+            let _ = dup2(null.as_raw_fd(), 0);
+            let _ = dup2(log_file.as_raw_fd(), 1);
+            let _ = dup2(log_file.as_raw_fd(), 2);
+            cache.close_locks();
+
+            let code = match runtime_config.run_session(listener, idle_timeout) {
+                Ok(()) => 0,
+                Err(err) => {
+                    error!("Session `{}` failed: {}", name, err);
+                    1
+                }
+            };
+            let _ = force_rm(&path);
+            exit(code);
+        }
+    }
+}
+
+// Returns false when the session was not running, leftovers of sessions that did not shut down cleanly are removed either way
+pub fn stop(cache_path: &Path, name: &str) -> Result<bool> {
+    let path = session_path(cache_path, name);
+    let request = SessionRequest {
+        args: Vec::new(),
+        env: Vec::new(),
+        cwd: None,
+        stop: true,
+    };
+
+    if attach(&socket_path(cache_path, name), &request)
+        .with_context(|| format!("Failed to stop session `{}`", name))?
+        .is_none()
+    {
+        force_rm(&path).context("Failed to clean session")?;
+        return Ok(false);
+    }
+
+    let start = Instant::now();
+    while exists(&path)? {
+        if start.elapsed() >= STOP_TIMEOUT {
+            bail!("Session `{}` did not shut down", name);
+        }
+        sleep(Duration::from_millis(10));
+    }
+    Ok(true)
+}
+
+// Every session with whether it is running
+pub fn list(cache_path: &Path) -> Result<Vec<(String, bool)>> {
+    let sessions_path = cache_path.join("sessions");
+    if !exists(&sessions_path)? {
+        return Ok(Vec::new());
+    }
+
+    let mut sessions = Vec::new();
+    for entry in read_dir(&sessions_path).context("Failed to read sessions")? {
+        let name = entry?.file_name().to_string_lossy().to_string();
+        let running = UnixStream::connect(socket_path(cache_path, &name)).is_ok();
+        sessions.push((name, running));
+    }
+    sessions.sort();
+    Ok(sessions)
+}
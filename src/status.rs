@@ -0,0 +1,263 @@
+use std::{
+    collections::{BTreeMap, BTreeSet},
+    io::{stderr, IsTerminal},
+    process,
+    sync::{
+        atomic::{AtomicBool, AtomicU32, Ordering},
+        Mutex,
+    },
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use bytesize::ByteSize;
+use log::info;
+use nix::{libc, unistd::write};
+
+use crate::{events::Event, util::format_duration};
+
+// A status area below the log showing how far a build got and how long it should still take, expected durations come from the build history.
+// When stderr is not a terminal a plain progress line is logged periodically instead.
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static STATUS: Mutex<Option<Status>> = Mutex::new(None);
+static TICKER: Mutex<Option<JoinHandle<()>>> = Mutex::new(None);
+
+// Containers are forked from the main thread while the ticker may hold the status lock, so forked children never touch the status area
+static OWNER: AtomicU32 = AtomicU32::new(0);
+
+const REDRAW_INTERVAL: Duration = Duration::from_secs(1);
+const PLAIN_INTERVAL: Duration = Duration::from_secs(30);
+
+struct Status {
+    terminal: bool,
+    start: Instant,
+    total: usize,
+    done: BTreeSet<String>,
+    pending: BTreeMap<String, Option<u64>>,
+    running: BTreeMap<String, (Instant, String, Option<u64>)>,
+    downloaded: u64,
+    drawn: usize,
+}
+
+// The plan lists every recipe of the build, whether it is expected to be rebuilt and how long that took historically
+pub fn enable(plan: Vec<(String, bool, Option<u64>)>) {
+    *STATUS.lock().unwrap() = Some(Status {
+        terminal: stderr().is_terminal(),
+        start: Instant::now(),
+        total: plan.len(),
+        done: BTreeSet::new(),
+        pending: BTreeMap::from_iter(plan.into_iter().filter(|(_, stale, _)| *stale).map(|(recipe, _, expected)| (recipe, expected))),
+        running: BTreeMap::new(),
+        downloaded: 0,
+        drawn: 0,
+    });
+    OWNER.store(process::id(), Ordering::Relaxed);
+    ENABLED.store(true, Ordering::Relaxed);
+
+    *TICKER.lock().unwrap() = thread::Builder::new().name(String::from("status")).spawn(tick).ok();
+}
+
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+// Called from the interrupt handler, so it only stops further drawing and leaves the lock alone
+pub fn interrupt() {
+    ENABLED.store(false, Ordering::Relaxed);
+}
+
+// Stops the ticker and clears the status area
+pub fn finish() {
+    if !enabled() {
+        return;
+    }
+    ENABLED.store(false, Ordering::Relaxed);
+
+    if let Some(ticker) = TICKER.lock().unwrap().take() {
+        ticker.thread().unpark();
+        let _ = ticker.join();
+    }
+
+    if let Some(mut status) = STATUS.lock().unwrap().take() {
+        write_stderr(&status.clear());
+        status.drawn = 0;
+    }
+}
+
+pub fn record(event: &Event) {
+    let mut status = STATUS.lock().unwrap();
+    let status = match status.as_mut() {
+        None => return,
+        Some(status) => status,
+    };
+
+    match event {
+        Event::RecipeUpToDate { recipe, .. } => {
+            status.pending.remove(*recipe);
+            status.done.insert(recipe.to_string());
+        }
+        Event::RecipeStarted { recipe, .. } => {
+            let expected = status.pending.get(*recipe).copied().flatten();
+            status.running.insert(recipe.to_string(), (Instant::now(), String::new(), expected));
+        }
+        Event::StageStarted { recipe, stage } => {
+            if let Some((_, running_stage, _)) = status.running.get_mut(*recipe) {
+                *running_stage = stage.to_string();
+            }
+        }
+        Event::RecipeFinished { recipe, .. } | Event::RecipeFailed { recipe } => {
+            status.pending.remove(*recipe);
+            status.running.remove(*recipe);
+            status.done.insert(recipe.to_string());
+        }
+        Event::Download { bytes, .. } => status.downloaded += bytes,
+        _ => return,
+    }
+
+    if status.terminal {
+        let out = status.redraw(None);
+        write_stderr(&out);
+    }
+}
+
+// Log lines go through here so they end up above the status area instead of being drawn over
+pub fn print_line(line: &str) {
+    if !enabled() || OWNER.load(Ordering::Relaxed) != process::id() {
+        eprintln!("{}", line);
+        return;
+    }
+
+    let mut status = STATUS.lock().unwrap();
+    let out = match status.as_mut() {
+        Some(status) if status.terminal => status.redraw(Some(line)),
+        _ => format!("{}\n", line),
+    };
+    write_stderr(&out);
+}
+
+fn tick() {
+    let mut last_line = Instant::now();
+    loop {
+        thread::park_timeout(REDRAW_INTERVAL);
+        if !enabled() {
+            return;
+        }
+
+        let mut guard = STATUS.lock().unwrap();
+        let status = match guard.as_mut() {
+            None => return,
+            Some(status) => status,
+        };
+
+        if status.terminal {
+            let out = status.redraw(None);
+            write_stderr(&out);
+        } else if last_line.elapsed() >= PLAIN_INTERVAL {
+            last_line = Instant::now();
+            let mut line = status.summary();
+            for (recipe, (start, stage, expected)) in &status.running {
+                line.push_str(format!(" | {}", running_line(recipe, *start, stage, *expected)).as_str());
+            }
+
+            // The logger prints through `print_line` which takes the status lock again
+            drop(guard);
+            info!("Progress: {}", line);
+        }
+    }
+}
+
+impl Status {
+    fn clear(&self) -> String {
+        let mut out = String::new();
+        for line in 0..self.drawn {
+            if line > 0 {
+                out.push_str("\x1b[1A");
+            }
+            out.push_str("\r\x1b[2K");
+        }
+        out
+    }
+
+    // Clears the area, prints the log line if any and draws the area again below it
+    fn redraw(&mut self, log_line: Option<&str>) -> String {
+        let mut out = self.clear();
+        if let Some(log_line) = log_line {
+            out.push_str(log_line);
+            out.push('\n');
+        }
+
+        let mut lines = vec![self.summary()];
+        for (recipe, (start, stage, expected)) in &self.running {
+            lines.push(format!("  {}", running_line(recipe, *start, stage, *expected)));
+        }
+
+        // Lines wrapping would throw off clearing the area on the next redraw
+        let width = terminal_width().saturating_sub(1);
+        let lines: Vec<String> = lines.into_iter().map(|line| line.chars().take(width).collect()).collect();
+
+        out.push_str(&lines.join("\n"));
+        self.drawn = lines.len();
+        out
+    }
+
+    fn summary(&self) -> String {
+        let mut summary = format!("[{}/{}] {} elapsed", self.done.len().min(self.total), self.total, format_duration(self.start.elapsed().as_secs()));
+
+        // Builds run one recipe at a time, so the remaining critical path is everything still expected to be rebuilt
+        let mut remaining: u64 = 0;
+        let mut unknown = 0;
+        for (recipe, expected) in &self.pending {
+            match expected {
+                None => unknown += 1,
+                Some(expected) => {
+                    let elapsed = self.running.get(recipe).map(|(start, _, _)| start.elapsed().as_millis() as u64).unwrap_or(0);
+                    remaining += expected.saturating_sub(elapsed);
+                }
+            }
+        }
+
+        match (unknown, self.pending.len()) {
+            (_, 0) => {}
+            (0, _) => summary.push_str(format!(" | ETA {}", format_duration(remaining / 1000)).as_str()),
+            (unknown, pending) if unknown == pending => summary.push_str(format!(" | ETA unknown, {} recipe(s) without history", unknown).as_str()),
+            (unknown, _) => summary.push_str(format!(" | ETA {}+, {} recipe(s) without history", format_duration(remaining / 1000), unknown).as_str()),
+        }
+
+        if self.downloaded > 0 {
+            summary.push_str(format!(" | {} downloaded", ByteSize(self.downloaded)).as_str());
+        }
+        summary
+    }
+}
+
+fn running_line(recipe: &str, start: Instant, stage: &str, expected: Option<u64>) -> String {
+    let mut line = recipe.to_string();
+    if !stage.is_empty() {
+        line.push_str(format!(" {}", stage).as_str());
+    }
+
+    line.push_str(format!(" {}", format_duration(start.elapsed().as_secs())).as_str());
+    if let Some(expected) = expected {
+        line.push_str(format!(" / ~{}", format_duration(expected / 1000)).as_str());
+    }
+    line
+}
+
+fn terminal_width() -> usize {
+    let mut size: libc::winsize = unsafe { std::mem::zeroed() };
+    match unsafe { libc::ioctl(libc::STDERR_FILENO, libc::TIOCGWINSZ, &mut size) } {
+        0 if size.ws_col > 0 => size.ws_col as usize,
+        _ => 80,
+    }
+}
+
+// Written straight to the file descriptor, the ticker never holds the std stderr lock a forked child could inherit
+fn write_stderr(out: &str) {
+    let mut data = out.as_bytes();
+    while !data.is_empty() {
+        match write(stderr(), data) {
+            Ok(0) | Err(_) => return,
+            Ok(written) => data = &data[written..],
+        }
+    }
+}
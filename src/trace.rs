@@ -0,0 +1,153 @@
+use std::{
+    cell::Cell,
+    fmt::Display,
+    fs::File,
+    io::{BufWriter, Write},
+    path::Path,
+    process,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Mutex,
+    },
+    thread,
+    time::Instant,
+};
+
+use anyhow::{Context, Result};
+use serde::Serialize;
+
+// Spans are collected in memory and written out as Chrome trace-event JSON once the run is over, which Perfetto and chrome://tracing load directly.
+// Tracing is off unless `enable` was called, in which case a span costs a clock read and formatting its name.
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static TRACE: Mutex<Option<Trace>> = Mutex::new(None);
+static NEXT_LANE: AtomicU64 = AtomicU64::new(1);
+
+thread_local! {
+    static LANE: Cell<u64> = const { Cell::new(0) };
+}
+
+struct Trace {
+    start: Instant,
+    events: Vec<TraceEvent>,
+}
+
+#[derive(Serialize)]
+struct TraceEvent {
+    name: String,
+    cat: &'static str,
+    ph: &'static str,
+    ts: u64,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    dur: Option<u64>,
+    pid: u32,
+    tid: u64,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    args: Option<TraceArgs>,
+}
+
+#[derive(Serialize)]
+struct TraceArgs {
+    name: String,
+}
+
+#[derive(Serialize)]
+#[serde(rename_all = "camelCase")]
+struct TraceFile<'a> {
+    trace_events: &'a Vec<TraceEvent>,
+    display_time_unit: &'static str,
+}
+
+pub struct Span {
+    start: Instant,
+    name: Option<(&'static str, String)>,
+}
+
+pub fn enable() {
+    *TRACE.lock().unwrap() = Some(Trace {
+        start: Instant::now(),
+        events: Vec::new(),
+    });
+    ENABLED.store(true, Ordering::Relaxed);
+}
+
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+// Opens a span that ends when the returned guard is dropped, spans on the same thread nest by time
+pub fn span(category: &'static str, name: impl Display) -> Span {
+    Span {
+        start: Instant::now(),
+        name: enabled().then(|| (category, name.to_string())),
+    }
+}
+
+impl Drop for Span {
+    fn drop(&mut self) {
+        let (category, name) = match self.name.take() {
+            None => return,
+            Some(name) => name,
+        };
+
+        let end = Instant::now();
+        let lane = lane();
+        if let Some(trace) = TRACE.lock().unwrap().as_mut() {
+            trace.events.push(TraceEvent {
+                name,
+                cat: category,
+                ph: "X",
+                ts: self.start.saturating_duration_since(trace.start).as_micros() as u64,
+                dur: Some(end.duration_since(self.start).as_micros() as u64),
+                pid: process::id(),
+                tid: lane,
+                args: None,
+            });
+        }
+    }
+}
+
+// Every thread that records a span gets its own lane, named after the thread
+fn lane() -> u64 {
+    LANE.with(|lane| {
+        if lane.get() != 0 {
+            return lane.get();
+        }
+
+        lane.set(NEXT_LANE.fetch_add(1, Ordering::Relaxed));
+        if let Some(trace) = TRACE.lock().unwrap().as_mut() {
+            trace.events.push(TraceEvent {
+                name: String::from("thread_name"),
+                cat: "",
+                ph: "M",
+                ts: 0,
+                dur: None,
+                pid: process::id(),
+                tid: lane.get(),
+                args: Some(TraceArgs {
+                    name: thread::current().name().unwrap_or("worker").to_string(),
+                }),
+            });
+        }
+        lane.get()
+    })
+}
+
+pub fn write_trace(path: impl AsRef<Path>) -> Result<()> {
+    let trace = match TRACE.lock().unwrap().take() {
+        None => return Ok(()),
+        Some(trace) => trace,
+    };
+    ENABLED.store(false, Ordering::Relaxed);
+
+    let file = File::create(&path).with_context(|| format!("Failed to create trace file `{}`", path.as_ref().to_string_lossy()))?;
+    let mut writer = BufWriter::new(file);
+    serde_json::to_writer(
+        &mut writer,
+        &TraceFile {
+            trace_events: &trace.events,
+            display_time_unit: "ms",
+        },
+    )
+    .context("Failed to serialize trace")?;
+    writer.flush().context("Failed to write trace")
+}
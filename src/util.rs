@@ -1,5 +1,5 @@
 use std::{
-    fs::{copy, create_dir, exists, hard_link, read_dir, read_link, remove_dir, remove_file, set_permissions, symlink_metadata, File, OpenOptions},
+    fs::{copy, create_dir, create_dir_all, exists, hard_link, metadata, read_dir, read_link, remove_dir, remove_file, set_permissions, symlink_metadata, File, OpenOptions},
     io,
     os::{
         linux::fs::MetadataExt,
@@ -143,6 +143,36 @@ pub fn recursive_copy(from: impl AsRef<Path>, to: impl AsRef<Path>) -> Result<()
     Ok(())
 }
 
+pub fn copy_path(from: impl AsRef<Path>, to: impl AsRef<Path>) -> Result<()> {
+    let (from, to) = (from.as_ref(), to.as_ref());
+    if let Some(parent) = to.parent() {
+        create_dir_all(parent).with_context(|| format!("Failed to create directory `{}`", parent.to_string_lossy()))?;
+    }
+
+    let meta = symlink_metadata(from).with_context(|| format!("Failed to fetch metadata `{}`", from.to_string_lossy()))?;
+
+    let dest_exists = match symlink_metadata(to) {
+        Ok(_) => Ok(true),
+        Err(e) if e.kind() == io::ErrorKind::NotFound => Ok(false),
+        Err(e) => Err(e),
+    }
+    .with_context(|| format!("Failed to fetch metadata `{}`", to.to_string_lossy()))?;
+
+    if dest_exists {
+        warn!("Copy conflict on path `{}` skipping...", to.to_string_lossy());
+        return Ok(());
+    }
+
+    if meta.is_symlink() {
+        let target = read_link(from).with_context(|| format!("Failed to read link `{}`", from.to_string_lossy()))?;
+        symlink(target, to).with_context(|| format!("Failed to symlink `{}` -> `{}`", from.to_string_lossy(), to.to_string_lossy()))?;
+        return Ok(());
+    }
+
+    copy(from, to).with_context(|| format!("Failed to copy file `{}` -> `{}`", from.to_string_lossy(), to.to_string_lossy()))?;
+    Ok(())
+}
+
 pub fn dir_changed_at(dir: impl AsRef<Path>) -> Result<Option<(i64, i64)>> {
     let mut latest = None;
     for entry in read_dir(&dir).with_context(|| format!("Failed to read directory `{}`", dir.as_ref().to_string_lossy()))? {
@@ -165,6 +195,14 @@ pub fn dir_changed_at(dir: impl AsRef<Path>) -> Result<Option<(i64, i64)>> {
     Ok(latest)
 }
 
+pub fn file_changed_at(path: impl AsRef<Path>) -> Result<Option<(i64, i64)>> {
+    if !exists(&path)? {
+        return Ok(None);
+    }
+    let meta = metadata(&path).with_context(|| format!("Failed to fetch metadata `{}`", path.as_ref().to_string_lossy()))?;
+    Ok(Some((meta.st_ctime(), meta.st_ctime_nsec())))
+}
+
 pub fn dir_size(dir: impl AsRef<Path>) -> Result<u64> {
     let mut size: u64 = 0;
     for entry in read_dir(&dir).with_context(|| format!("Failed to read directory `{}`", dir.as_ref().to_string_lossy()))? {
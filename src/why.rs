@@ -0,0 +1,247 @@
+use std::{
+    collections::{BTreeMap, HashMap},
+    fs::read_dir,
+    os::linux::fs::MetadataExt,
+    path::{Path, PathBuf},
+};
+
+use anyhow::{bail, Context, Result};
+
+use crate::{
+    config::{ConfigNamespace, ConfigRecipeId},
+    recipe::RecipeState,
+    util::get_timestamp,
+    ChariotContext,
+};
+
+struct RebuildWalk {
+    explain: bool,
+    skip_prebuilts: bool,
+    in_flight: Vec<ConfigRecipeId>,
+    visited: HashMap<(ConfigRecipeId, bool), Option<u64>>,
+    causes: Vec<(ConfigRecipeId, Vec<String>)>,
+}
+
+impl ChariotContext {
+    // The individual inputs folded into `hash_recipe`, these are persisted with the recipe state so a rebuild can be traced back to the input that changed.
+    // Definition fields are stored as digests of the exact bytes that are hashed, dependencies by their modifiers and local files by their latest change time.
+    pub fn recipe_hash_inputs(&self, recipe_id: ConfigRecipeId) -> Result<BTreeMap<String, String>> {
+        let mut inputs: BTreeMap<String, String> = BTreeMap::new();
+        for (name, data) in self.config.recipe_hash_fields(recipe_id)? {
+            inputs.insert(String::from(name), blake3::hash(&data).to_hex()[..16].to_string());
+        }
+
+        for dep in self.config.dependencies(recipe_id) {
+            inputs.insert(format!("dependency/{}", self.config.recipe(dep.recipe_id)), dep.modifiers());
+        }
+
+        for (name, (secs, nsecs)) in self.recipe_change_times(recipe_id)? {
+            inputs.insert(String::from(name), format!("{}.{:09}", secs, nsecs));
+        }
+
+        Ok(inputs)
+    }
+
+    // Walks the dependency closure of the recipes the way `recipe_process` would and returns every recipe that would be rebuilt together with why.
+    // The result is in processing order, dependencies come before their dependents. Without `explain` a changed hash is not traced back to its inputs.
+    pub fn recipe_rebuild_causes(&self, recipe_ids: &[ConfigRecipeId], explain: bool, skip_prebuilts: bool) -> Result<Vec<(ConfigRecipeId, Vec<String>)>> {
+        let mut walk = RebuildWalk {
+            explain,
+            skip_prebuilts,
+            in_flight: Vec::new(),
+            visited: HashMap::new(),
+            causes: Vec::new(),
+        };
+        for recipe_id in recipe_ids {
+            self.collect_rebuild_causes(&mut walk, *recipe_id, false, false)?;
+        }
+        Ok(walk.causes)
+    }
+
+    // Mirrors `recipe_process`, returns the timestamp the recipe would report to its dependents or `None` when an optional recipe does not support the options.
+    // A recipe that would be rebuilt reports the current time. Loose recipes ignore when their dependencies changed, but still report their own timestamp.
+    fn collect_rebuild_causes(&self, walk: &mut RebuildWalk, recipe_id: ConfigRecipeId, loose: bool, optional: bool) -> Result<Option<u64>> {
+        if let Some(timestamp) = walk.visited.get(&(recipe_id, loose)) {
+            return Ok(*timestamp);
+        }
+
+        let recipe = self.config.recipe(recipe_id);
+        for (option, valid_values) in &recipe.used_options {
+            if let Some(valid_values) = valid_values {
+                let effective_opt = &self.effective_options[option];
+                if !valid_values.contains(effective_opt) {
+                    if !optional {
+                        bail!("Recipe `{}` does not support the value `{}` for the option `{}`", recipe, effective_opt, option);
+                    }
+
+                    walk.visited.insert((recipe_id, loose), None);
+                    return Ok(None);
+                }
+            }
+        }
+
+        walk.in_flight.push(recipe_id);
+        let now = get_timestamp()?;
+        let state = RecipeState::read(self.path_recipe(recipe_id)).context("Failed to parse recipe state")?;
+
+        let mut recipe_causes: Vec<String> = Vec::new();
+        let uses_prebuilt = self.recipe_uses_prebuilt(recipe_id, walk.skip_prebuilts)?;
+        for dep in self.recipe_needed_dependencies(recipe_id, uses_prebuilt) {
+            let dep_recipe = self.config.recipe(dep.recipe_id);
+            if walk.in_flight.contains(&dep.recipe_id) {
+                bail!("Recursive dependency `{}`", dep_recipe);
+            }
+
+            let timestamp = self
+                .collect_rebuild_causes(walk, dep.recipe_id, dep.loose, dep.optional)
+                .with_context(|| format!("Broken dependency `{}`", dep_recipe))?;
+
+            // Like `recipe_process` the recipe is left alone but reports the current time, so everything depending on it is rebuilt
+            let Some(mut timestamp) = timestamp else {
+                walk.in_flight.pop();
+                walk.visited.insert((recipe_id, loose), Some(now));
+                return Ok(Some(now));
+            };
+
+            let dep_stale = walk.causes.iter().any(|(id, _)| *id == dep.recipe_id);
+            if let (false, Some(output)) = (dep_stale, &dep.output) {
+                if let Some(changed) = self.recipe_output_changed(dep.recipe_id, output)? {
+                    timestamp = changed;
+                }
+            }
+
+            let Some(state) = &state else {
+                continue;
+            };
+            // A rebuilt dependency is always newer, even when the last build finished within the same second
+            if loose || (!dep_stale && timestamp <= state.timestamp) {
+                continue;
+            }
+
+            match (dep_stale, &dep.output) {
+                (true, None) => recipe_causes.push(format!("dependency `{}` will be rebuilt", dep_recipe)),
+                (true, Some(output)) => recipe_causes.push(format!("dependency `{}` will be rebuilt, this recipe follows if its `{}` output changes", dep_recipe, output)),
+                (false, _) => recipe_causes.push(format!("dependency `{}` changed after the last build", dep_recipe)),
+            }
+        }
+        walk.in_flight.pop();
+
+        match &state {
+            None => recipe_causes.push(String::from("recipe was never built")),
+            Some(state) => {
+                if !state.intact {
+                    recipe_causes.push(String::from("last build did not finish"));
+                }
+                if state.invalidated {
+                    recipe_causes.push(String::from("recipe was explicitly requested by a build that did not finish it"));
+                }
+
+                let hash = self.hash_recipe(recipe_id).context("Failed to generate hash for recipe")?;
+                match (state.hash == hash.to_string(), walk.explain) {
+                    (true, _) => {}
+                    (false, true) => recipe_causes.append(&mut self.diff_hash_inputs(recipe_id, state)?),
+                    (false, false) => recipe_causes.push(String::from("hash changed")),
+                }
+            }
+        }
+
+        let timestamp = match (&state, recipe_causes.is_empty()) {
+            (Some(state), true) => state.timestamp,
+            _ => {
+                // A recipe reached both loosely and strictly can pick up more causes on the strict visit
+                match walk.causes.iter_mut().find(|(id, _)| *id == recipe_id) {
+                    None => walk.causes.push((recipe_id, recipe_causes)),
+                    Some((_, existing)) => {
+                        for cause in recipe_causes {
+                            if !existing.contains(&cause) {
+                                existing.push(cause);
+                            }
+                        }
+                    }
+                }
+                now
+            }
+        };
+        walk.visited.insert((recipe_id, loose), Some(timestamp));
+        Ok(Some(timestamp))
+    }
+
+    fn diff_hash_inputs(&self, recipe_id: ConfigRecipeId, state: &RecipeState) -> Result<Vec<String>> {
+        if state.inputs.is_empty() {
+            return Ok(vec![String::from("hash changed, the last build predates recorded hash inputs")]);
+        }
+
+        let inputs = self.recipe_hash_inputs(recipe_id).context("Failed to collect recipe hash inputs")?;
+
+        let mut causes: Vec<String> = Vec::new();
+        for (input, value) in &inputs {
+            let previous = state.inputs.get(input);
+            if previous == Some(value) {
+                continue;
+            }
+
+            match (input.strip_prefix("dependency/"), previous) {
+                (Some(dep), None) => causes.push(format!("dependency `{}` was added", dep)),
+                (Some(dep), Some(previous)) => causes.push(format!("dependency `{}` modifiers changed from `{}` to `{}`", dep, previous, value)),
+                (None, _) if input == "local_source" => {
+                    let source = match &self.config.recipe(recipe_id).namespace {
+                        ConfigNamespace::Source(source) => &source.url,
+                        _ => continue,
+                    };
+
+                    let since = previous.and_then(|previous| parse_change_time(previous)).unwrap_or((0, 0));
+                    let mut files: Vec<PathBuf> = Vec::new();
+                    changed_files(Path::new(source), since, &mut files)?;
+                    if files.is_empty() {
+                        causes.push(format!("local source `{}` changed", source));
+                    }
+                    for file in files {
+                        causes.push(format!("local source file `{}` changed", file.to_string_lossy()));
+                    }
+                }
+                (None, None) => causes.push(format!("field `{}` was added", input)),
+                (None, Some(_)) => causes.push(format!("field `{}` changed", input)),
+            }
+        }
+
+        for input in state.inputs.keys() {
+            if inputs.contains_key(input) {
+                continue;
+            }
+
+            match input.strip_prefix("dependency/") {
+                Some(dep) => causes.push(format!("dependency `{}` was removed", dep)),
+                None => causes.push(format!("field `{}` was removed", input)),
+            }
+        }
+
+        // Dependency order and the chariot version are hashed but not recorded individually
+        if causes.is_empty() {
+            causes.push(String::from("hash changed without any recorded input changing (dependency order or chariot version)"));
+        }
+
+        Ok(causes)
+    }
+}
+
+fn parse_change_time(value: &str) -> Option<(i64, i64)> {
+    let (secs, nsecs) = value.split_once(".")?;
+    Some((secs.parse().ok()?, nsecs.parse().ok()?))
+}
+
+fn changed_files(dir: &Path, since: (i64, i64), files: &mut Vec<PathBuf>) -> Result<()> {
+    for entry in read_dir(dir).with_context(|| format!("Failed to read directory `{}`", dir.to_string_lossy()))? {
+        let entry = entry?;
+        let meta = entry.metadata().with_context(|| format!("Failed to fetch metadata `{}`", entry.path().to_string_lossy()))?;
+
+        if meta.is_dir() {
+            changed_files(&entry.path(), since, files)?;
+            continue;
+        }
+
+        if (meta.st_ctime(), meta.st_ctime_nsec()) > since {
+            files.push(entry.path());
+        }
+    }
+    Ok(())
+}